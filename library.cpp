@@ -1,909 +1,7410 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <vector>
-#include <string>
-#include <limits>
-#include <algorithm>
-#include <ctime>
-using namespace std;
-
-// ------------------------
-// Enumerations & Utilities
-// ------------------------
-enum BookStatus { AVAILABLE, BORROWED, RESERVED };
-
-string bookStatusToString(BookStatus status) {
-    switch(status) {
-        case AVAILABLE: return "Available";
-        case BORROWED:  return "Borrowed";
-        case RESERVED:  return "Reserved";
-        default:        return "Unknown";
-    }
-}
-
-// ------------------------
-// Book Class
-// ------------------------
-class Book {
-private:
-    string title, author, publisher, isbn;
-    int year;
-    BookStatus status;
-public:
-    Book() : title(""), author(""), publisher(""), year(0), isbn(""), status(AVAILABLE) {}
-    Book(const string &title, const string &author, const string &publisher, int year, const string &isbn, BookStatus status = AVAILABLE)
-        : title(title), author(author), publisher(publisher), year(year), isbn(isbn), status(status) {}
-
-    void setTitle(const string &t) { title = t; }
-    string getTitle() const { return title; }
-    
-    void setAuthor(const string &a) { author = a; }
-    string getAuthor() const { return author; }
-    
-    void setPublisher(const string &p) { publisher = p; }
-    string getPublisher() const { return publisher; }
-    
-    void setYear(int y) { year = y; }
-    int getYear() const { return year; }
-    
-    void setISBN(const string &i) { isbn = i; }
-    string getISBN() const { return isbn; }
-    
-    void setStatus(BookStatus s) { status = s; }
-    BookStatus getStatus() const { return status; }
-    
-    void printDetails() const {
-        cout << "Title: " << title << "\nAuthor: " << author 
-             << "\nPublisher: " << publisher << "\nYear: " << year
-             << "\nISBN: " << isbn << "\nStatus: " << bookStatusToString(status) << "\n";
-    }
-};
-
-// ------------------------
-// Account Class with Borrow/History Records
-// ------------------------
-struct BorrowInfo {
-    Book* book;
-    int borrowDate;
-    int dueDate;
-};
-
-struct HistoryRecord {
-    Book* book;
-    int borrowDate;
-    int dueDate;
-    int returnDate;
-    double fineIncurred;
-};
-
-class Library; // Forward declaration needed for Account::deserialize
-
-class Account {
-public:
-    vector<BorrowInfo> borrowedBooks;
-    vector<HistoryRecord> history;
-    double fines; // outstanding total fine
-
-    Account() : fines(0) {}
-
-    void addBorrowedBook(Book* book, int borrowDate, int dueDate) {
-         borrowedBooks.push_back({book, borrowDate, dueDate});
-    }
-
-    // When returning a book, we compute overdue (if any) and update the fine.
-    void returnBorrowedBook(Book* book, int returnDate, bool isFaculty) {
-         auto it = find_if(borrowedBooks.begin(), borrowedBooks.end(),
-               [book](const BorrowInfo &bi){ return bi.book == book; });
-         if(it != borrowedBooks.end()){
-              int due = it->dueDate;
-              int overdue = (returnDate > due) ? (returnDate - due) : 0;
-              double fine = 0;
-              if(!isFaculty) {
-                 fine = overdue * 10;  // 10 rupees per day
-                 fines += fine;
-              }
-              history.push_back({book, it->borrowDate, due, returnDate, fine});
-              borrowedBooks.erase(it);
-         } else {
-              cout << "Error: Book not found in your borrowed list.\n";
-         }
-    }
-
-    void listBorrowedBooks() const {
-         if(borrowedBooks.empty()){
-            cout << "No books currently borrowed.\n";
-            return;
-         }
-         cout << "Currently Borrowed Books:\n";
-         for(auto &bi : borrowedBooks){
-             cout << "- " << bi.book->getTitle() << " (Borrowed on day " << bi.borrowDate 
-                  << ", Due on day " << bi.dueDate << ")\n";
-         }
-    }
-
-    void listHistory() const {
-         if(history.empty()){
-            cout << "No borrowing history available.\n";
-            return;
-         }
-         cout << "Borrowing History:\n";
-         for(auto &hr : history){
-             cout << "- " << hr.book->getTitle() << " (Borrowed on day " << hr.borrowDate 
-                  << ", Due on day " << hr.dueDate << ", Returned on day " << hr.returnDate 
-                  << ", Fine: " << hr.fineIncurred << ")\n";
-         }
-    }
-
-    int getBorrowedCount() const {
-         return borrowedBooks.size();
-    }
-
-    bool hasOverdueExceeding(int currentDay, int extraDays) const {
-         for(auto &bi : borrowedBooks) {
-              if(currentDay - bi.dueDate > extraDays)
-                  return true;
-         }
-         return false;
-    }
-
-    // Serialize account details to a string.
-    // Format: fines,borrowCount,borrowRecord1;borrowRecord2;...,historyCount,historyRecord1;historyRecord2;...
-    // Each borrowRecord: ISBN:borrowDate:dueDate
-    // Each historyRecord: ISBN:borrowDate:dueDate:returnDate:fineIncurred
-    string serialize() const {
-         ostringstream oss;
-         oss << fines << "," << borrowedBooks.size() << ",";
-         for(size_t i = 0; i < borrowedBooks.size(); i++){
-             oss << borrowedBooks[i].book->getISBN() << ":" << borrowedBooks[i].borrowDate << ":" << borrowedBooks[i].dueDate;
-             if(i != borrowedBooks.size()-1) oss << ";";
-         }
-         oss << "," << history.size() << ",";
-         for(size_t i = 0; i < history.size(); i++){
-             oss << history[i].book->getISBN() << ":" << history[i].borrowDate << ":" << history[i].dueDate 
-                 << ":" << history[i].returnDate << ":" << history[i].fineIncurred;
-             if(i != history.size()-1) oss << ";";
-         }
-         return oss.str();
-    }
-
-    // Deserialize account details from a string.
-    void deserialize(const string &data, Library &lib);
-};
-
-// ------------------------
-// Forward Declaration of Library
-// (Its full definition will come later.)
-class Library;
-
-// ------------------------
-// Abstract Class User
-// ------------------------
-class User {
-private: 
-    string password;
-protected:
-    int id;
-    string name;
-    Account account;
-public:
-    User(int id, const string &name, const string &password)
-        : id(id), name(name), password(password) {}
-    virtual ~User() {}
-
-    int getId() const { return id; }
-    string getName() const { return name; }
-    void setName(const string &newName) { name = newName; }
-
-    string getPassword() const { return password; }
-    bool checkPassword(const string &pass) const { return pass == password; }
-    void setPassword(const string &newPass) { password = newPass; }
-
-    Account& getAccount() { return account; }
-
-    virtual void borrowBook(Library &lib) = 0;
-    virtual void returnBook(Library &lib) = 0;
-    virtual void menu(Library &lib) = 0;
-    virtual string getType() const = 0;
-};
-
-// ------------------------
-// Derived Classes Declarations
-// ------------------------
-class Student : public User {
-public:
-    Student(int id, const string &name, const string &password) : User(id, name, password) {}
-    virtual void borrowBook(Library &lib);
-    virtual void returnBook(Library &lib);
-    virtual void menu(Library &lib);
-    virtual string getType() const { return "Student"; }
-};
-
-class Faculty : public User {
-public:
-    Faculty(int id, const string &name, const string &password) : User(id, name, password) {}
-    virtual void borrowBook(Library &lib);
-    virtual void returnBook(Library &lib);
-    virtual void menu(Library &lib);
-    virtual string getType() const { return "Faculty"; }
-};
-
-class Librarian : public User {
-public:
-    Librarian(int id, const string &name, const string &password) : User(id, name, password) {}
-    virtual void borrowBook(Library &lib);
-    virtual void returnBook(Library &lib);
-    virtual void menu(Library &lib);
-    virtual string getType() const { return "Librarian"; }
-};
-
-// ------------------------
-// Library Class Definition
-// ------------------------
-class Library {
-private:
-    vector<Book> books;
-    vector<User*> users; // stored as pointers
-public:
-    Library() {}
-    ~Library() {
-        for(auto user : users)
-            delete user;
-    }
-    
-    bool isBooksEmpty() const { return books.empty(); }
-    bool isUsersEmpty() const { return users.empty(); }
-
-    // Book Methods
-    void addBook(const Book &book) {
-        books.push_back(book);
-    }
-
-    void removeBook(const string &isbn) {
-        auto it = remove_if(books.begin(), books.end(), [isbn](const Book &b) { return b.getISBN() == isbn; });
-        if(it != books.end()){
-            books.erase(it, books.end());
-            cout << "Book with ISBN " << isbn << " removed.\n";
-        } else {
-            cout << "Book not found.\n";
-        }
-    }
-
-    Book* findBookByISBN(const string &isbn) {
-        for(auto &book : books) {
-            if(book.getISBN() == isbn)
-                return &book;
-        }
-        return nullptr;
-    }
-
-    void listBooks() {
-        if(books.empty()){
-            cout << "No books in the library.\n";
-            return;
-        }
-        cout << "\n--- Library Books ---\n";
-        for(auto &book : books) {
-            book.printDetails();
-            cout << "-------------------------\n";
-        }
-    }
-
-    void searchBooks() {
-        int option;
-        cout << "\nSearch Books by:\n1. Title\n2. Author\n3. ISBN\nEnter choice: ";
-        cin >> option;
-        cin.ignore();
-        string query;
-        cout << "Enter search query: ";
-        getline(cin, query);
-        bool found = false;
-        for(auto &book : books) {
-            if((option == 1 && book.getTitle().find(query) != string::npos) ||
-               (option == 2 && book.getAuthor().find(query) != string::npos) ||
-               (option == 3 && book.getISBN().find(query) != string::npos)) {
-                book.printDetails();
-                cout << "-------------------------\n";
-                found = true;
-            }
-        }
-        if(!found)
-            cout << "No matching books found.\n";
-    }
-
-    // User Methods
-    void addUser(User *user) {
-        if(findUserById(user->getId()) != nullptr) {
-            cout << "User with ID " << user->getId() << " already exists. Cannot add duplicate.\n";
-            delete user;
-            return;
-        }
-        users.push_back(user);
-    }
-
-    User* findUserById(int id) {
-        for(auto user : users) {
-            if(user->getId() == id)
-                return user;
-        }
-        return nullptr;
-    }
-
-    void removeUser(int id) {
-        auto it = remove_if(users.begin(), users.end(), [id](User* u) { return u->getId() == id; });
-        if(it != users.end()){
-            delete *it;
-            users.erase(it, users.end());
-            cout << "User with ID " << id << " removed.\n";
-        } else {
-            cout << "User not found.\n";
-        }
-    }
-
-    void updateUser(int id) {
-        User* user = findUserById(id);
-        if(user) {
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Enter new name for user with ID " << id << ": ";
-            string newName;
-            getline(cin, newName);
-            user->setName(newName);
-            cout << "User updated successfully.\n";
-        } else {
-            cout << "User not found.\n";
-        }
-    }
-
-    void listUsers() {
-        if(users.empty()){
-            cout << "No users registered.\n";
-            return;
-        }
-        cout << "\n--- Registered Users ---\n";
-        for(auto user : users) {
-            cout << "ID: " << user->getId() << " | Name: " << user->getName() << "\n";
-        }
-    }
-
-    // Persistence Functions
-    void saveData() {
-        // Save books to books.txt
-        ofstream fout("books.txt");
-        if(fout.is_open()){
-            for(auto &book : books) {
-                fout << book.getTitle() << "," << book.getAuthor() << "," 
-                     << book.getPublisher() << "," << book.getYear() << "," 
-                     << book.getISBN() << "," << book.getStatus() << "\n";
-            }
-            fout.close();
-            cout << "Books saved to books.txt\n";
-        }
-        // Save users to users.txt in format:
-        // id|name|password|type|accountData
-        ofstream fout2("users.txt");
-        if(fout2.is_open()){
-            for(auto user : users) {
-                fout2 << user->getId() << "|" << user->getName() << "|" << user->getPassword()
-                      << "|" << user->getType() << "|" << user->getAccount().serialize() << "\n";
-            }
-            fout2.close();
-            cout << "Users saved to users.txt\n";
-        }
-    }
-
-    void loadData() {
-        // Load books
-        ifstream fin("books.txt");
-        if(fin.is_open()){
-            books.clear();
-            string line;
-            while(getline(fin, line)){
-                stringstream ss(line);
-                string title, author, publisher, yearStr, isbn, statusStr;
-                if(getline(ss, title, ',') && getline(ss, author, ',') && getline(ss, publisher, ',') &&
-                   getline(ss, yearStr, ',') && getline(ss, isbn, ',') && getline(ss, statusStr)){
-                    int year = stoi(yearStr);
-                    int statInt = stoi(statusStr);
-                    BookStatus status = static_cast<BookStatus>(statInt);
-                    books.push_back(Book(title, author, publisher, year, isbn, status));
-                }
-            }
-            fin.close();
-            cout << "Books loaded from books.txt\n";
-        }
-        // Load users
-        ifstream fin2("users.txt");
-        if(fin2.is_open()){
-            for(auto user : users)
-                delete user;
-            users.clear();
-            string line;
-            while(getline(fin2, line)){
-                vector<string> parts;
-                stringstream ss(line);
-                string token;
-                while(getline(ss, token, '|')) {
-                    parts.push_back(token);
-                }
-                if(parts.size() != 5) continue;
-                int id = stoi(parts[0]);
-                string name = parts[1];
-                string password = parts[2];
-                string type = parts[3];
-                string accountData = parts[4];
-                User* user = nullptr;
-                if(type == "Student")
-                    user = new Student(id, name, password);
-                else if(type == "Faculty")
-                    user = new Faculty(id, name, password);
-                else if(type == "Librarian")
-                    user = new Librarian(id, name, password);
-                if(user) {
-                    user->getAccount().deserialize(accountData, *this);
-                    users.push_back(user);
-                }
-            }
-            fin2.close();
-            cout << "Users loaded from users.txt\n";
-        }
-    }
-};
-
-// ------------------------
-// Account::deserialize Implementation
-// ------------------------
-void Account::deserialize(const string &data, Library &lib) {
-    vector<string> parts;
-    stringstream ss(data);
-    string token;
-    while(getline(ss, token, ',')) {
-         parts.push_back(token);
-    }
-    if(parts.size() < 5) return; // invalid format
-    fines = stod(parts[0]);
-    int borrowCount = stoi(parts[1]);
-    borrowedBooks.clear();
-    if(borrowCount > 0) {
-         string borrowRecords = parts[2];
-         stringstream ssb(borrowRecords);
-         string rec;
-         while(getline(ssb, rec, ';')) {
-              vector<string> recParts;
-              stringstream ssrec(rec);
-              string field;
-              while(getline(ssrec, field, ':')) {
-                   recParts.push_back(field);
-              }
-              if(recParts.size() == 3) {
-                  string isbn = recParts[0];
-                  int bDate = stoi(recParts[1]);
-                  int dDate = stoi(recParts[2]);
-                  Book* b = lib.findBookByISBN(isbn);
-                  if(b)
-                     borrowedBooks.push_back({b, bDate, dDate});
-              }
-         }
-    }
-    int historyCount = stoi(parts[3]);
-    history.clear();
-    if(historyCount > 0) {
-         string historyRecords = parts[4];
-         stringstream ssh(historyRecords);
-         string rec;
-         while(getline(ssh, rec, ';')) {
-              vector<string> recParts;
-              stringstream ssrec(rec);
-              string field;
-              while(getline(ssrec, field, ':')) {
-                   recParts.push_back(field);
-              }
-              if(recParts.size() == 5) {
-                  string isbn = recParts[0];
-                  int bDate = stoi(recParts[1]);
-                  int dDate = stoi(recParts[2]);
-                  int rDate = stoi(recParts[3]);
-                  double fine = stod(recParts[4]);
-                  Book* b = lib.findBookByISBN(isbn);
-                  if(b)
-                     history.push_back({b, bDate, dDate, rDate, fine});
-              }
-         }
-    }
-}
-
-// ------------------------
-// Derived Classes Member Function Definitions
-// ------------------------
-
-// Student
-void Student::borrowBook(Library &lib) {
-    if(account.getBorrowedCount() >= 3) {
-         cout << "Borrowing limit reached (max 3 books allowed).\n";
-         return;
-    }
-    if(account.fines > 0) {
-         cout << "Please clear outstanding fines before borrowing.\n";
-         return;
-    }
-    cout << "Enter ISBN of the book to borrow: ";
-    string isbn;
-    cin >> isbn;
-    Book* book = lib.findBookByISBN(isbn);
-    if(book == nullptr) {
-         cout << "Book not found.\n";
-         return;
-    }
-    if(book->getStatus() != AVAILABLE) {
-         cout << "Book is currently not available.\n";
-         return;
-    }
-    int currentDay = time(0) / (24 * 3600);
-    int dueDate = currentDay + 15;
-    book->setStatus(BORROWED);
-    account.addBorrowedBook(book, currentDay, dueDate);
-    cout << "Book \"" << book->getTitle() << "\" borrowed successfully" 
-         << ". Due after 15 days" << ".\n";
-}
-
-void Student::returnBook(Library &lib) {
-    cout << "Enter ISBN of the book to return: ";
-    string isbn;
-    cin >> isbn;
-    Book* book = lib.findBookByISBN(isbn);
-    if(book == nullptr) {
-         cout << "Book not found.\n";
-         return;
-    }
-    int currentDay = time(0) / (24 * 3600);
-    account.returnBorrowedBook(book, currentDay, false);
-    book->setStatus(AVAILABLE);
-    cout << "Book \"" << book->getTitle() << "\" returned successfully" << ".\n";
-}
-
-void Student::menu(Library &lib) {
-    int choice;
-    do {
-        cout << "\n===== Student Menu =====\n";
-        cout << "1. Borrow Book\n2. Return Book\n3. View Account Details\n4. Pay Fines\n5. List All Books\n6. Search Books\n7. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-        switch(choice) {
-            case 1: borrowBook(lib); break;
-            case 2: returnBook(lib); break;
-            case 3:
-                account.listBorrowedBooks();
-                account.listHistory();
-                cout << "Outstanding Fines: " << account.fines << " rupees\n";
-                break;
-            case 4: 
-                if(account.fines > 0) {
-                    cout << "Paying fine of " << account.fines << " rupees.\n";
-                    account.fines = 0;
-                } else {
-                    cout << "No outstanding fines.\n";
-                }
-                break;
-            case 5: lib.listBooks(); break;
-            case 6: lib.searchBooks(); break;
-            case 7: cout << "Logging out...\n"; break;
-            default: cout << "Invalid choice. Please try again.\n";
-        }
-    } while(choice != 7);
-}
-
-// Faculty
-void Faculty::borrowBook(Library &lib) {
-    if(account.getBorrowedCount() >= 5) {
-         cout << "Borrowing limit reached (max 5 books allowed).\n";
-         return;
-    }
-    int currentDay = time(0) / (24 * 3600);
-    if(account.hasOverdueExceeding(currentDay, 60)) {
-         cout << "You have a book overdue by more than 60 days. Cannot borrow new books.\n";
-         return;
-    }
-    cout << "Enter ISBN of the book to borrow: ";
-    string isbn;
-    cin >> isbn;
-    Book* book = lib.findBookByISBN(isbn);
-    if(book == nullptr) {
-         cout << "Book not found.\n";
-         return;
-    }
-    if(book->getStatus() != AVAILABLE) {
-         cout << "Book is not available.\n";
-         return;
-    }
-    int dueDate = currentDay + 30;
-    book->setStatus(BORROWED);
-    account.addBorrowedBook(book, currentDay, dueDate);
-    cout << "Book \"" << book->getTitle() << "\" borrowed successfully"
-         << ". Due after 30 days " << ".\n";
-}
-
-void Faculty::returnBook(Library &lib) {
-    cout << "Enter ISBN of the book to return: ";
-    string isbn;
-    cin >> isbn;
-    Book* book = lib.findBookByISBN(isbn);
-    if(book == nullptr) {
-         cout << "Book not found.\n";
-         return;
-    }
-    int currentDay = time(0) / (24 * 3600);
-    account.returnBorrowedBook(book, currentDay, true);
-    book->setStatus(AVAILABLE);
-    cout << "Book \"" << book->getTitle() << "\" returned successfully" << "\n";
-}
-
-void Faculty::menu(Library &lib) {
-    int choice;
-    do {
-        cout << "\n===== Faculty Menu =====\n";
-        cout << "1. Borrow Book\n2. Return Book\n3. View Account Details\n4. List All Books\n5. Search Books\n6. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-        switch(choice) {
-            case 1: borrowBook(lib); break;
-            case 2: returnBook(lib); break;
-            case 3:
-                account.listBorrowedBooks();
-                account.listHistory();
-                cout << "Outstanding Fines: " << account.fines << " rupees\n";
-                break;
-            case 4: lib.listBooks(); break;
-            case 5: lib.searchBooks(); break;
-            case 6: cout << "Logging out...\n"; break;
-            default: cout << "Invalid choice. Please try again.\n";
-        }
-    } while(choice != 6);
-}
-
-// Librarian
-void Librarian::borrowBook(Library &lib) {
-    cout << "Librarians cannot borrow books.\n";
-}
-
-void Librarian::returnBook(Library &lib) {
-    cout << "Librarians do not borrow books.\n";
-}
-
-void Librarian::menu(Library &lib) {
-    int choice;
-    do {
-        cout << "\n===== Librarian Menu =====\n";
-        cout << "1. Add Book\n2. Remove Book\n3. Update Book\n4. Add User\n5. Remove User\n6. Update User\n7. List Books\n8. List Users\n9. Search Books\n10. Logout\n";
-        cout << "Enter your choice: ";
-        cin >> choice;
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        switch(choice) {
-            case 1: {
-                string title, author, publisher, isbn;
-                int year;
-                cout << "Enter book title: ";
-                getline(cin, title);
-                cout << "Enter author: ";
-                getline(cin, author);
-                cout << "Enter publisher: ";
-                getline(cin, publisher);
-                cout << "Enter publication year: ";
-                cin >> year;
-                cout << "Enter ISBN: ";
-                cin >> isbn;
-                Book newBook(title, author, publisher, year, isbn, AVAILABLE);
-                lib.addBook(newBook);
-                cout << "Book added successfully.\n";
-                break;
-            }
-            case 2: {
-                cout << "Enter ISBN of the book to remove: ";
-                string isbn;
-                cin >> isbn;
-                lib.removeBook(isbn);
-                break;
-            }
-            case 3: {
-                cout << "Enter ISBN of the book to update: ";
-                string isbn;
-                cin >> isbn;
-                Book* book = lib.findBookByISBN(isbn);
-                if(book == nullptr) {
-                    cout << "Book not found.\n";
-                    break;
-                }
-                cin.ignore();
-                cout << "Enter new title (or press enter to keep \"" << book->getTitle() << "\"): ";
-                string newTitle;
-                getline(cin, newTitle);
-                if(!newTitle.empty())
-                    book->setTitle(newTitle);
-                cout << "Enter new author (or press enter to keep \"" << book->getAuthor() << "\"): ";
-                string newAuthor;
-                getline(cin, newAuthor);
-                if(!newAuthor.empty())
-                    book->setAuthor(newAuthor);
-                cout << "Book updated successfully.\n";
-                break;
-            }
-            case 4: {
-                cout << "Enter type of user to add (1. Student, 2. Faculty): ";
-                int type;
-                cin >> type;
-                int uid;
-                cout << "Enter new user ID: ";
-                cin >> uid;
-                if(lib.findUserById(uid) != nullptr) {
-                    cout << "User with ID " << uid << " already exists. Cannot add duplicate.\n";
-                    break;
-                }
-                cin.ignore();
-                cout << "Enter user name: ";
-                string uname;
-                getline(cin, uname);
-                cout << "Enter user password: ";
-                string pass;
-                getline(cin, pass);
-                if(type == 1) {
-                    lib.addUser(new Student(uid, uname, pass));
-                    cout << "Student added successfully.\n";
-                } else if(type == 2) {
-                    lib.addUser(new Faculty(uid, uname, pass));
-                    cout << "Faculty added successfully.\n";
-                } else {
-                    cout << "Invalid type.\n";
-                }
-                break;
-            }
-            case 5: {
-                cout << "Enter user ID to remove: ";
-                int uid;
-                cin >> uid;
-                lib.removeUser(uid);
-                break;
-            }
-            case 6: {
-                cout << "Enter user ID to update: ";
-                int uid;
-                cin >> uid;
-                lib.updateUser(uid);
-                break;
-            }
-            case 7: lib.listBooks(); break;
-            case 8: lib.listUsers(); break;
-            case 9: lib.searchBooks(); break;
-            case 10: cout << "Logging out...\n"; break;
-            default: cout << "Invalid choice. Please try again.\n";
-        }
-    } while(choice != 10);
-}
-
-// ------------------------
-// New User Registration Helper
-// ------------------------
-void registerNewUser(Library &lib) {
-    cout << "\n--- New User Registration ---\n";
-    cout << "Select user type:\n1. Student\n2. Faculty\nEnter choice: ";
-    int type;
-    cin >> type;
-    int uid;
-    cout << "Enter a new User ID (number): ";
-    cin >> uid;
-    if(lib.findUserById(uid) != nullptr) {
-        cout << "User ID already exists. Registration aborted.\n";
-        return;
-    }
-    cin.ignore();
-    cout << "Enter your name: ";
-    string uname;
-    getline(cin, uname);
-    cout << "Enter your password: ";
-    string pass;
-    getline(cin, pass);
-    if(type == 1) {
-        lib.addUser(new Student(uid, uname, pass));
-        cout << "Student registered successfully!\n";
-    } else if(type == 2) {
-        lib.addUser(new Faculty(uid, uname, pass));
-        cout << "Faculty registered successfully!\n";
-    } else {
-        cout << "Invalid user type selected.\n";
-    }
-}
-
-// ------------------------
-// Main Function
-// ------------------------
-int main() {
-    Library library;
-    library.loadData(); // Attempt to load data from files
-
-    if(library.isBooksEmpty()){
-        library.addBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "Addison-Wesley", 2013, "9780321563842"));
-        library.addBook(Book("Effective C++", "Scott Meyers", "O'Reilly Media", 2005, "9780321334879"));
-        library.addBook(Book("Clean Code", "Robert C. Martin", "Prentice Hall", 2008, "9780132350884"));
-        library.addBook(Book("Design Patterns", "Erich Gamma et al.", "Addison-Wesley", 1994, "9780201633610"));
-        library.addBook(Book("The Pragmatic Programmer", "Andrew Hunt", "Addison-Wesley", 1999, "9780201616224"));
-        library.addBook(Book("Introduction to Algorithms", "Cormen et al.", "MIT Press", 2009, "9780262033848"));
-        library.addBook(Book("Head First Design Patterns", "Eric Freeman", "O'Reilly Media", 2004, "9780596007126"));
-        library.addBook(Book("C++ Primer", "Stanley B. Lippman", "Addison-Wesley", 2012, "9780321714114"));
-        library.addBook(Book("Modern Operating Systems", "Andrew S. Tanenbaum", "Pearson", 2014, "9780133591620"));
-        library.addBook(Book("Computer Networks", "Andrew S. Tanenbaum", "Pearson", 2010, "9780132126953"));
-    }
-    if(library.isUsersEmpty()){
-        library.addUser(new Student(101, "Alice", "pass123"));
-        library.addUser(new Student(102, "Bob", "pass123"));
-        library.addUser(new Student(103, "Charlie", "pass123"));
-        library.addUser(new Student(104, "Diana", "pass123"));
-        library.addUser(new Student(105, "Evan", "pass123"));
-        library.addUser(new Faculty(201, "Prof. Xavier", "pass123"));
-        library.addUser(new Faculty(202, "Prof. Yvonne", "pass123"));
-        library.addUser(new Faculty(203, "Prof. Zach", "pass123"));
-        library.addUser(new Librarian(301, "Librarian Linda", "libpass"));
-    }
-
-    int mainChoice;
-    do {
-        cout << R"(            __   ____ ____ ____   __   ____ _  _    __  __   __   _  _   __   ___ ____ __  __ ____ _  _ ____    ___ _  _ ___ ____ ____ __  __ 
-(  ) (_  _(  _ (  _ \ /__\ (  _ ( \/ )  (  \/  ) /__\ ( \( ) /__\ / __( ___(  \/  ( ___( \( (_  _)  / __( \/ / __(_  _( ___(  \/  )
- )(__ _)(_ ) _ <)   //(__)\ )   /\  /    )    ( /(__)\ )  ( /(__)( (_-.)__) )    ( )__) )  (  )(    \__ \\  /\__ \ )(  )__) )    ( 
-(____(____(____(_)\_(__)(__(_)\_)(__)   (_/\/\_(__)(__(_)\_(__)(__\___(____(_/\/\_(____(_)\_)(__)   (___/(__)(___/(__)(____(_/\/\_)
-              )" << "\n";
-          
-        cout << "\n===== Main Menu =====\n";
-        cout << "1. Login\n2. Register New User\n3. List All Books\n4. Help/Instructions\n5. Exit\n";
-        cout << "Enter your choice: ";
-        cin >> mainChoice;
-        switch(mainChoice) {
-            case 1: {
-                cout << "Enter your User ID: ";
-                int uid;
-                cin >> uid;
-                User* user = library.findUserById(uid);
-                if(user) {
-                    cout << "Enter password: ";
-                    string pass;
-                    cin >> pass;
-                    if(!user->checkPassword(pass)) {
-                        cout << "Invalid password. Returning to main menu.\n";
-                        break;
-                    }
-                    cout << "Welcome, " << user->getName() << "!\n";
-                    user->menu(library);
-                } else {
-                    char reg;
-                    cout << "User ID not found. Are you new here and want to register? (Y/N): ";
-                    cin >> reg;
-                    if(reg == 'Y' || reg == 'y') {
-                        registerNewUser(library);
-                    } else {
-                        cout << "Returning to main menu.\n";
-                    }
-                }
-                break;
-            }
-            case 2:
-                registerNewUser(library);
-                break;
-            case 3:
-                library.listBooks();
-                break;
-            case 4:
-                cout << "\n--- Help / Instructions ---\n";
-                cout << "1. Login with your user ID and password. If you are new, choose to register.\n";
-                cout << "2. Students and Faculty can borrow/return books. When borrowing, the current day is automatically recorded and a due date is set (15 days for students, 30 days for faculty).\n";
-                cout << "3. When returning, the system automatically calculates overdue fines (10 rupees per day for students).\n";
-                cout << "4. All account details (including borrowed books with dates and history) are saved in users.txt.\n";
-                cout << "5. Librarians have extended privileges to manage books and users.\n";
-                cout << "----------------------------\n";
-                break;
-            case 5:
-                cout << "Exiting the system. Goodbye!\n";
-                break;
-            default:
-                cout << "Invalid choice. Please try again.\n";
-        }
-    } while(mainChoice != 5);
-
-    library.saveData();
-    return 0;
-}
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <ctime>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <deque>
+#include <queue>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <type_traits>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+// ------------------------
+// Enumerations & Utilities
+// ------------------------
+enum BookStatus { AVAILABLE, BORROWED, RESERVED };
+
+string bookStatusToString(BookStatus status) {
+    switch(status) {
+        case AVAILABLE: return "Available";
+        case BORROWED:  return "Borrowed";
+        case RESERVED:  return "Reserved";
+        default:        return "Unknown";
+    }
+}
+
+// Fine in rupees per overdue day for users who are not fine-exempt.
+const int FINE_PER_DAY = 10;
+
+// ------------------------
+// Text Parsing Utilities
+// ------------------------
+// A non-owning [begin, end) slice of a loaded text buffer. The loaders
+// parse fields straight out of the file image through these instead of
+// building a std::string per field.
+struct TextSpan {
+    const char* begin;
+    const char* end;
+    TextSpan() : begin(nullptr), end(nullptr) {}
+    TextSpan(const char* b, const char* e) : begin(b), end(e) {}
+    explicit TextSpan(const string &s) : begin(s.data()), end(s.data() + s.size()) {}
+    size_t size() const { return end - begin; }
+    bool empty() const { return begin == end; }
+    string str() const { return string(begin, end); }
+    bool equals(const char* s) const { return size() == strlen(s) && memcmp(begin, s, size()) == 0; }
+    bool operator==(const TextSpan &o) const { return size() == o.size() && memcmp(begin, o.begin, size()) == 0; }
+};
+
+// FNV-1a over the span's bytes, for hash maps keyed by TextSpan.
+struct TextSpanHash {
+    size_t operator()(const TextSpan &s) const {
+        uint64_t h = 14695981039346656037ULL;
+        for(const char* p = s.begin; p != s.end; p++)
+            h = (h ^ static_cast<unsigned char>(*p)) * 1099511628211ULL;
+        return static_cast<size_t>(h);
+    }
+};
+
+// Splits off the next delim-separated field from rest, with the same
+// semantics as getline(stream, field, delim): returns false once rest is
+// exhausted, so a trailing empty field is not reported.
+bool nextField(TextSpan &rest, char delim, TextSpan &field) {
+    if(rest.empty()) return false;
+    const char* d = static_cast<const char*>(memchr(rest.begin, delim, rest.size()));
+    field = TextSpan(rest.begin, d ? d : rest.end);
+    rest.begin = d ? d + 1 : rest.end;
+    return true;
+}
+
+// Like nextField on '\n', but also drops a trailing '\r' (CRLF files).
+bool nextLine(TextSpan &rest, TextSpan &line) {
+    if(!nextField(rest, '\n', line)) return false;
+    if(!line.empty() && line.end[-1] == '\r') line.end--;
+    return true;
+}
+
+// Parses a leading integer the way stoi does (leading spaces, optional
+// sign, trailing junk ignored). Returns false if there are no digits or,
+// where stoi would throw, the number does not fit in an int.
+bool parseInt(TextSpan text, int &value) {
+    const char* p = text.begin;
+    while(p != text.end && (*p == ' ' || *p == '\t')) p++;
+    bool negative = false;
+    if(p != text.end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    if(p == text.end || *p < '0' || *p > '9') return false;
+    const long long limit = negative ? -static_cast<long long>(numeric_limits<int>::min()) : numeric_limits<int>::max();
+    long long v = 0;
+    while(p != text.end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+        if(v > limit) return false;
+    }
+    value = static_cast<int>(negative ? -v : v);
+    return true;
+}
+
+// Parses an unsigned 64-bit decimal number (journal sequence numbers).
+bool parseUInt64(TextSpan text, uint64_t &value) {
+    const char* p = text.begin;
+    if(p == text.end || *p < '0' || *p > '9') return false;
+    uint64_t v = 0;
+    while(p != text.end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    value = v;
+    return true;
+}
+
+// Parses a leading floating-point number the way stod does.
+bool parseDouble(TextSpan text, double &value) {
+    char buf[64];
+    size_t n = min(text.size(), sizeof(buf) - 1);
+    memcpy(buf, text.begin, n);
+    buf[n] = '\0';
+    char* endp = nullptr;
+    value = strtod(buf, &endp);
+    return endp != buf;
+}
+
+// Read-only view of a whole file. Uses mmap where available and falls
+// back to a single read into memory elsewhere.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+    bool opened;
+#ifdef _WIN32
+    string buffer;
+#endif
+    MappedFile(const MappedFile &);
+    MappedFile& operator=(const MappedFile &);
+public:
+    explicit MappedFile(const string &path) : data(nullptr), length(0), opened(false) {
+#ifdef _WIN32
+        ifstream fin(path, ios::binary);
+        if(!fin.is_open()) return;
+        buffer.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        opened = true;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return;
+        struct stat st;
+        if(fstat(fd, &st) == 0) {
+            opened = true;
+            length = st.st_size;
+            if(length > 0) {
+                void* m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(m == MAP_FAILED) {
+                    opened = false;
+                    length = 0;
+                } else {
+                    madvise(m, length, MADV_SEQUENTIAL);
+                    data = static_cast<const char*>(m);
+                }
+            }
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifndef _WIN32
+        if(data) munmap(const_cast<char*>(data), length);
+#endif
+    }
+    bool isOpen() const { return opened; }
+    TextSpan text() const { return TextSpan(data, data + length); }
+};
+
+// Pushes buffered writes of f through to the disk.
+bool syncFile(FILE* f) {
+    if(fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Moves tmp over path, replacing any file there, and makes the move
+// itself durable: on POSIX the rename is only on disk once the directory
+// holding path is synced. Returns false if either step failed; once the
+// rename has happened path holds the new file either way.
+bool replaceFile(const string &tmp, const string &path) {
+#ifdef _WIN32
+    return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if(rename(tmp.c_str(), path.c_str()) != 0) return false;
+    size_t slash = path.rfind('/');
+    string dir = (slash == string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// Writes a file under a temporary name (path.tmp) and moves it over path
+// on commit(), after syncing it, so that readers see either the old or
+// the new file, never a partial one. A writer destroyed without
+// committing removes its temporary file and leaves path as it was.
+class AtomicFileWriter {
+private:
+    string path, tmp;
+    FILE* file;
+    bool failed;
+    uint64_t flushed;
+    string buffer;
+
+    AtomicFileWriter(const AtomicFileWriter &);
+    AtomicFileWriter& operator=(const AtomicFileWriter &);
+
+    void flush() {
+        if(file && !buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+            failed = true;
+        flushed += buffer.size();
+        buffer.clear();
+    }
+
+public:
+    explicit AtomicFileWriter(const string &p)
+        : path(p), tmp(p + ".tmp"), file(fopen(tmp.c_str(), "wb")), failed(file == nullptr), flushed(0) {}
+    ~AtomicFileWriter() {
+        if(file) {
+            fclose(file);
+            remove(tmp.c_str());
+        }
+    }
+
+    bool isOpen() const { return file != nullptr; }
+    uint64_t size() const { return flushed + buffer.size(); } // bytes appended so far
+
+    void append(const char* data, size_t n) {
+        if(buffer.size() + n >= (1 << 20)) {
+            flush();
+            if(n >= (1 << 20)) { // large blocks go straight to the file
+                if(file && fwrite(data, 1, n, file) != n) failed = true;
+                flushed += n;
+                return;
+            }
+        }
+        buffer.append(data, n);
+    }
+    void append(const string &s) { append(s.data(), s.size()); }
+
+    // Syncs the file and moves it into place. Returns false if anything
+    // could not be written; path is left untouched unless only the final
+    // directory sync failed (see replaceFile).
+    bool commit() {
+        if(!file) return false;
+        flush();
+        bool ok = !failed && syncFile(file);
+        ok = (fclose(file) == 0) && ok;
+        file = nullptr;
+        if(!ok) {
+            remove(tmp.c_str());
+            return false;
+        }
+        if(!replaceFile(tmp, path)) {
+            remove(tmp.c_str()); // gone already if the rename went through
+            return false;
+        }
+        return true;
+    }
+};
+
+// Replaces path with bytes atomically, see AtomicFileWriter.
+bool writeFileAtomically(const string &path, const string &bytes) {
+    AtomicFileWriter out(path);
+    out.append(bytes);
+    return out.commit();
+}
+
+// ------------------------
+// Operation Statistics
+// ------------------------
+// Call counts and latency histograms of the hot operations, cheap enough
+// to leave on. Each thread records into a block of its own with plain
+// relaxed stores (no locked instructions, no shared cache lines); a
+// report adds up the blocks, and a thread's block is folded into the
+// totals when the thread ends. A histogram has one bucket per power of
+// two nanoseconds. Every call is counted, but reading the clock twice
+// costs about as much as a lookup, so the cheapest operations time only
+// one call in STAT_SAMPLE_EVERY. Build with -DLIBRARY_NO_STATS to compile
+// the timers out.
+enum StatOp {
+    STAT_FIND_BOOK, STAT_FIND_USER, STAT_SEARCH, STAT_RANKED_SEARCH, STAT_SUGGEST, STAT_BORROW, STAT_RETURN,
+    STAT_DESERIALIZE, STAT_LOAD_TEXT, STAT_SAVE_TEXT, STAT_LOAD_SNAPSHOT, STAT_BUILD_SNAPSHOT, STAT_OPS
+};
+
+const char* statOpName(StatOp op) {
+    static const char* names[STAT_OPS] = {
+        "findBookByISBN", "findUserById", "searchBooks", "searchBooks (ranked)", "suggestBooks", "borrow", "return",
+        "Account::deserialize", "loadData", "saveData", "loadSnapshot", "buildSnapshot"};
+    return names[op];
+}
+
+// Calls per timed call, by operation (powers of two).
+const uint32_t STAT_SAMPLE_EVERY[STAT_OPS] = {16, 16, 1, 1, 1, 4, 4, 16, 1, 1, 1, 1};
+
+// Bucket b holds latencies below 2^b ns (and at least 2^(b-1)); the last
+// one takes everything from about nine minutes up.
+const size_t STAT_BUCKETS = 40;
+
+struct OpTotals {
+    uint64_t count = 0, timed = 0, totalNs = 0, maxNs = 0; // totalNs and maxNs of the timed calls
+    uint64_t buckets[STAT_BUCKETS] = {};
+
+    // Upper bound of the bucket holding the p-th percentile.
+    uint64_t percentileNs(double p) const {
+        uint64_t rank = (uint64_t)(p / 100.0 * timed + 0.5), seen = 0;
+        for(size_t b = 0; b < STAT_BUCKETS; b++) {
+            seen += buckets[b];
+            if(seen >= max<uint64_t>(rank, 1)) return min(maxNs, uint64_t(1) << b);
+        }
+        return maxNs;
+    }
+};
+
+#ifndef LIBRARY_NO_STATS
+class OpStats {
+private:
+    struct Counter {
+        atomic<uint64_t> count, timed, totalNs, maxNs;
+        atomic<uint64_t> buckets[STAT_BUCKETS];
+    };
+    struct Block {
+        Counter ops[STAT_OPS];
+        Block() {
+            for(auto &c : ops) {
+                c.count = c.timed = c.totalNs = c.maxNs = 0;
+                for(auto &b : c.buckets) b = 0;
+            }
+        }
+    };
+    struct Registry {
+        mutex lock;
+        vector<Block*> live;
+        OpTotals finished[STAT_OPS]; // from threads that have ended
+        size_t threads = 0;          // that recorded anything
+    };
+    // Never destroyed: threads may still end after main returns.
+    static Registry& registry() {
+        static Registry* r = new Registry;
+        return *r;
+    }
+    // The calling thread's block, registered on first use and folded into
+    // the totals when the thread ends.
+    struct Local {
+        Block* block;
+        Local() : block(new Block) {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            r.live.push_back(block);
+            r.threads++;
+        }
+        ~Local() {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            add(*block, r.finished);
+            r.live.erase(find(r.live.begin(), r.live.end(), block));
+            delete block;
+        }
+    };
+    static Block& local() {
+        static thread_local Local mine;
+        return *mine.block;
+    }
+
+    // Only the owning thread writes a counter, so load-and-store is enough.
+    static void bump(atomic<uint64_t> &a, uint64_t delta) {
+        a.store(a.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    static void add(const Block &block, OpTotals* totals) {
+        for(size_t op = 0; op < STAT_OPS; op++) {
+            const Counter &c = block.ops[op];
+            OpTotals &t = totals[op];
+            t.count += c.count.load(memory_order_relaxed);
+            t.timed += c.timed.load(memory_order_relaxed);
+            t.totalNs += c.totalNs.load(memory_order_relaxed);
+            t.maxNs = max(t.maxNs, c.maxNs.load(memory_order_relaxed));
+            for(size_t b = 0; b < STAT_BUCKETS; b++)
+                t.buckets[b] += c.buckets[b].load(memory_order_relaxed);
+        }
+    }
+
+    // Counts a call of op; returns its counter if the call is to be timed.
+    static Counter* begin(StatOp op) {
+        Counter &c = local().ops[op];
+        uint64_t n = c.count.load(memory_order_relaxed);
+        c.count.store(n + 1, memory_order_relaxed);
+        return (n & (STAT_SAMPLE_EVERY[op] - 1)) == 0 ? &c : nullptr;
+    }
+
+    static void end(Counter &c, uint64_t ns) {
+        size_t bucket = 0;
+        while(bucket < STAT_BUCKETS - 1 && (ns >> bucket) != 0)
+            bucket++;
+        bump(c.timed, 1);
+        bump(c.totalNs, ns);
+        if(ns > c.maxNs.load(memory_order_relaxed)) c.maxNs.store(ns, memory_order_relaxed);
+        bump(c.buckets[bucket], 1);
+    }
+
+    friend class StatTimer;
+
+public:
+    static const bool enabled = true;
+
+    // Totals of every thread so far; returns how many threads recorded.
+    static size_t collect(OpTotals* totals) {
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        for(size_t op = 0; op < STAT_OPS; op++)
+            totals[op] = r.finished[op];
+        for(auto block : r.live)
+            add(*block, totals);
+        return r.threads;
+    }
+};
+
+// Counts one call of op and, if it is sampled, times its own lifetime.
+class StatTimer {
+private:
+    OpStats::Counter* counter;
+    chrono::steady_clock::time_point start;
+public:
+    explicit StatTimer(StatOp op) : counter(OpStats::begin(op)) {
+        if(counter) start = chrono::steady_clock::now();
+    }
+    ~StatTimer() {
+        if(counter)
+            OpStats::end(*counter, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+#else
+class OpStats {
+public:
+    static const bool enabled = false;
+    static size_t collect(OpTotals*) { return 0; }
+};
+
+class StatTimer {
+public:
+    explicit StatTimer(StatOp) {}
+};
+#endif
+
+string formatNs(double ns) {
+    char buf[32];
+    if(ns < 1e3) snprintf(buf, sizeof(buf), "%.0f ns", ns);
+    else if(ns < 1e6) snprintf(buf, sizeof(buf), "%.1f us", ns / 1e3);
+    else if(ns < 1e9) snprintf(buf, sizeof(buf), "%.1f ms", ns / 1e6);
+    else snprintf(buf, sizeof(buf), "%.2f s", ns / 1e9);
+    return buf;
+}
+
+// The statistics as a table, one row per operation that has been called.
+// Latencies are those of the timed calls; percentiles are bucket bounds,
+// so they are exact to a factor of two.
+void reportOpStats(ostream &out) {
+    if(!OpStats::enabled) {
+        out << "Operation statistics are not compiled in (built with LIBRARY_NO_STATS).\n";
+        return;
+    }
+    OpTotals totals[STAT_OPS];
+    size_t threads = OpStats::collect(totals);
+    out << left << setw(22) << "operation" << right << setw(10) << "calls" << setw(10) << "timed" << setw(11) << "mean" << setw(11)
+        << "p50 <=" << setw(11) << "p90 <=" << setw(11) << "p99 <=" << setw(11) << "max" << "\n";
+    for(size_t op = 0; op < STAT_OPS; op++) {
+        const OpTotals &t = totals[op];
+        if(t.timed == 0) continue;
+        out << left << setw(22) << statOpName(static_cast<StatOp>(op)) << right << setw(10) << t.count
+            << setw(10) << t.timed << setw(11) << formatNs((double)t.totalNs / t.timed) << setw(11) << formatNs(t.percentileNs(50))
+            << setw(11) << formatNs(t.percentileNs(90)) << setw(11) << formatNs(t.percentileNs(99))
+            << setw(11) << formatNs(t.maxNs) << "\n";
+    }
+    out << "(recorded by " << threads << " thread(s))\n";
+}
+
+const char* const STATS_FILE = "library.stats"; // written when the application exits
+
+// Writes the report of this session to file, replacing the last one.
+void writeStatsFile(const string &file) {
+    if(!OpStats::enabled) return;
+    ostringstream out;
+    time_t now = time(0);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    out << "Operation statistics, session ending " << stamp << "\n";
+    reportOpStats(out);
+    if(!writeFileAtomically(file, out.str()))
+        cout << "Error writing statistics to " << file << ".\n";
+}
+
+// ------------------------
+// Book Class
+// ------------------------
+// The fields of a book before it enters the catalog (new books, loaders).
+struct BookRecord {
+    string title, author, publisher;
+    int year;
+    string isbn;
+    BookStatus status;
+
+    BookRecord(const string &title, const string &author, const string &publisher, int year, const string &isbn, BookStatus status = AVAILABLE)
+        : title(title), author(author), publisher(publisher), year(year), isbn(isbn), status(status) {}
+};
+
+class CatalogStore;
+class BookCopy;
+
+// A title in the catalog: a lightweight view of one title row of the
+// CatalogStore, which holds the shared metadata column by column and
+// keeps track of the title's physical copies. Views are created only by
+// the store and keep their address for its lifetime.
+class Book {
+private:
+    CatalogStore* store;
+    uint32_t row;
+
+    friend class CatalogStore;
+    Book(CatalogStore* s, uint32_t r) : store(s), row(r) {}
+
+public:
+    void setTitle(const string &t);
+    string getTitle() const;
+    TextSpan titleText() const;
+
+    void setAuthor(const string &a);
+    string getAuthor() const;
+    TextSpan authorText() const;
+
+    void setPublisher(const string &p);
+    string getPublisher() const;
+
+    void setYear(int y);
+    int getYear() const;
+
+    void setISBN(const string &i);
+    string getISBN() const;
+    uint64_t isbnCode() const; // the ISBN as stored, see CatalogStore
+
+    CatalogStore* catalog() const { return store; }
+    uint32_t catalogRow() const { return row; }
+
+    // Copies. The available count is kept up to date as copies change
+    // status, and the available copies are chained, so neither "is a copy
+    // in" nor picking one to lend looks at the other copies.
+    uint32_t copyCount() const;
+    uint32_t availableCopies() const;
+    BookCopy* freeCopy() const;            // the next available copy, or nullptr
+    BookCopy* copy(uint32_t number) const; // by copy number (from 1), or nullptr
+    template<class Visit> void forEachCopy(Visit visit) const;
+
+    // AVAILABLE if any copy is in, otherwise RESERVED if one is set aside
+    // for a hold, otherwise BORROWED.
+    BookStatus getStatus() const;
+
+    void printDetails(ostream &out = cout) const {
+        out << "Title: " << getTitle() << "\nAuthor: " << getAuthor()
+            << "\nPublisher: " << getPublisher() << "\nYear: " << getYear()
+            << "\nISBN: " << getISBN() << "\nStatus: " << bookStatusToString(getStatus()) << "\n";
+        if(copyCount() > 1)
+            out << "Copies: " << availableCopies() << " of " << copyCount() << " available\n";
+    }
+};
+
+// One physical copy of a title, with a status of its own. Loans and
+// history records point at copies; everything else about the copy is
+// read from its title.
+class BookCopy {
+private:
+    CatalogStore* store;
+    uint32_t row;
+
+    friend class CatalogStore;
+    BookCopy(CatalogStore* s, uint32_t r) : store(s), row(r) {}
+
+public:
+    Book* book() const;
+    uint32_t copyNumber() const; // from 1, in the order the title's copies were added
+
+    CatalogStore* catalog() const { return store; }
+    uint32_t catalogRow() const { return row; }
+
+    void setStatus(BookStatus s);
+    BookStatus getStatus() const;
+};
+
+// ------------------------
+// Catalog Store
+// ------------------------
+// Append-only array kept in fixed-size chunks, so that growing it never
+// moves an element. Book and BookCopy views are read outside the catalog
+// lock (menus, account listings), while another thread may be adding
+// books; with chunks, nothing they point into is ever reallocated. The
+// chunk directory is replaced when it fills up, and the old ones are kept
+// until the column is destroyed, so a reader holding either sees every
+// chunk it can reach. Appends are serialized by the catalog lock.
+const size_t STABLE_CHUNK_BITS = 12; // 4096 elements per chunk
+
+template <class T>
+class StableColumn {
+private:
+    atomic<T**> directory;
+    size_t slots;           // chunk pointers the directory has room for
+    size_t count;
+    vector<T**> retired;    // earlier directories
+
+    StableColumn(const StableColumn &);
+    StableColumn& operator=(const StableColumn &);
+
+    void addChunk() {
+        size_t chunks = count >> STABLE_CHUNK_BITS;
+        T** dir = directory.load(memory_order_relaxed);
+        if(chunks == slots) {
+            size_t grown = max<size_t>(slots * 2, 16);
+            T** bigger = new T*[grown];
+            if(dir) {
+                copy(dir, dir + chunks, bigger);
+                retired.push_back(dir);
+            }
+            slots = grown;
+            dir = bigger;
+        }
+        dir[chunks] = static_cast<T*>(::operator new(sizeof(T) << STABLE_CHUNK_BITS));
+        directory.store(dir, memory_order_release);
+    }
+
+public:
+    StableColumn() : directory(nullptr), slots(0), count(0) {}
+    ~StableColumn() {
+        T** dir = directory.load(memory_order_relaxed);
+        for(size_t i = 0; i < count; i++)
+            (*this)[i].~T();
+        for(size_t k = 0; k < chunkCount(); k++)
+            ::operator delete(dir[k]);
+        delete[] dir;
+        for(size_t k = 0; k < retired.size(); k++)
+            delete[] retired[k];
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return chunkCount() << STABLE_CHUNK_BITS; }
+
+    T& operator[](size_t i) {
+        return directory.load(memory_order_acquire)[i >> STABLE_CHUNK_BITS][i & ((size_t(1) << STABLE_CHUNK_BITS) - 1)];
+    }
+    const T& operator[](size_t i) const {
+        return directory.load(memory_order_acquire)[i >> STABLE_CHUNK_BITS][i & ((size_t(1) << STABLE_CHUNK_BITS) - 1)];
+    }
+    T& back() { return (*this)[count - 1]; }
+
+    void push_back(const T &value) {
+        if((count & ((size_t(1) << STABLE_CHUNK_BITS) - 1)) == 0)
+            addChunk();
+        new (&(*this)[count]) T(value);
+        count++;
+    }
+
+    // Chunk k as a plain array of chunkLength(k) elements, for scans.
+    size_t chunkCount() const { return (count + (size_t(1) << STABLE_CHUNK_BITS) - 1) >> STABLE_CHUNK_BITS; }
+    const T* chunk(size_t k) const { return directory.load(memory_order_acquire)[k]; }
+    const T* const* chunks() const { return directory.load(memory_order_acquire); }
+    size_t chunkLength(size_t k) const {
+        return min(count - (k << STABLE_CHUNK_BITS), size_t(1) << STABLE_CHUNK_BITS);
+    }
+};
+
+// Interns strings that repeat across many books (authors, publishers),
+// handing out dense 32-bit ids. Values live in a StableColumn so the spans
+// the lookup table is keyed by stay valid as it grows.
+class StringDictionary {
+private:
+    StableColumn<string> values;
+    unordered_map<TextSpan, uint32_t, TextSpanHash> ids;
+public:
+    uint32_t intern(const string &value) {
+        auto it = ids.find(TextSpan(value));
+        if(it != ids.end()) return it->second;
+        uint32_t id = values.size();
+        values.push_back(value);
+        ids.insert({TextSpan(values.back()), id});
+        return id;
+    }
+
+    // Returns false if value was never interned.
+    bool lookup(TextSpan value, uint32_t &id) const {
+        auto it = ids.find(value);
+        if(it == ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    const string& at(uint32_t id) const { return values[id]; }
+    size_t size() const { return values.size(); }
+};
+
+// End of a chain of copies in CatalogStore.
+const uint32_t NO_COPY = 0xFFFFFFFFu;
+
+// Column-oriented book storage in two levels. Each title is one row
+// across parallel columns: titles in a shared character arena, authors and
+// publishers as dictionary ids, the ISBN packed into an integer, the year
+// and the title's copy counts, so that scans touch only a few bytes per
+// title. Each physical copy is a row of the copy columns, holding little
+// more than its title row and status; twenty copies of a book share one
+// set of strings. A title's copies are chained in the order they were
+// added, and its available copies in a second, doubly linked chain (oldest
+// returned first) that lending takes from and returns append to.
+// Rows are never deleted; removed titles have their copies flagged as
+// retired so that loan history pointing at them stays readable. Columns
+// and arena blocks never move, see StableColumn; the bytes of a title
+// that was renamed are reused for later titles.
+class CatalogStore {
+private:
+    // ISBNs of up to 17 digits are stored as (digit count << 59) | value,
+    // which keeps leading zeros; any other ISBN is interned and stored as
+    // ISBN_IRREGULAR | dictionary id.
+    static const unsigned ISBN_LENGTH_SHIFT = 59;
+    static const uint64_t ISBN_IRREGULAR = 31ULL << ISBN_LENGTH_SHIFT;
+    static const size_t ISBN_MAX_DIGITS = 17;
+    // Titles are (arena position << TITLE_LENGTH_BITS) | length, where the
+    // position is (block << TITLE_OFFSET_BITS) | offset. A title longer
+    // than a block gets a block of its own.
+    static const unsigned TITLE_LENGTH_BITS = 24;
+    static const unsigned TITLE_OFFSET_BITS = 16;
+    static const uint8_t STATUS_RETIRED = 0x80;
+
+    // Title columns.
+    StableColumn<char*> titleBlocks;
+    size_t titleBlockUsed;
+    size_t titleArenaBytes;
+    multimap<uint32_t, uint64_t> freeTitleSpace; // length -> arena position
+    StableColumn<uint64_t> titles;
+    StableColumn<uint32_t> authors, publishers;
+    StableColumn<uint64_t> isbns;
+    StableColumn<int32_t> years;
+    StableColumn<uint32_t> copyCounts, availableCounts;
+    StableColumn<uint32_t> firstCopies, lastCopies; // chain through nextCopies
+    StableColumn<uint32_t> firstFree, lastFree;     // chain through nextFree/prevFree
+    // Copy columns.
+    StableColumn<uint32_t> copyTitles;
+    StableColumn<uint8_t> statuses; // BookStatus, plus STATUS_RETIRED
+    StableColumn<uint32_t> copyNumbers;
+    StableColumn<uint32_t> nextCopies;
+    StableColumn<uint32_t> nextFree, prevFree;
+    StringDictionary authorNames, publisherNames, irregularIsbns;
+    StableColumn<Book> views;
+    StableColumn<BookCopy> copyViews;
+
+    CatalogStore(const CatalogStore &);
+    CatalogStore& operator=(const CatalogStore &);
+
+    static bool packDigits(TextSpan isbn, uint64_t &code) {
+        if(isbn.empty() || isbn.size() > ISBN_MAX_DIGITS) return false;
+        uint64_t value = 0;
+        for(const char* p = isbn.begin; p != isbn.end; p++) {
+            if(*p < '0' || *p > '9') return false;
+            value = value * 10 + (*p - '0');
+        }
+        code = (static_cast<uint64_t>(isbn.size()) << ISBN_LENGTH_SHIFT) | value;
+        return true;
+    }
+
+    const char* titleBytes(uint64_t ref) const {
+        if((ref & ((1u << TITLE_LENGTH_BITS) - 1)) == 0) return "";
+        uint64_t position = ref >> TITLE_LENGTH_BITS;
+        return titleBlocks[position >> TITLE_OFFSET_BITS] + (position & ((1u << TITLE_OFFSET_BITS) - 1));
+    }
+
+    // Copies title into the arena: into the smallest freed space that
+    // fits, else at the end of the current block, else into a new block.
+    uint64_t storeTitle(const string &title) {
+        uint32_t length = min<size_t>(title.size(), (1u << TITLE_LENGTH_BITS) - 1);
+        uint64_t position;
+        multimap<uint32_t, uint64_t>::iterator space = freeTitleSpace.lower_bound(length);
+        if(length == 0) {
+            position = 0;
+        } else if(space != freeTitleSpace.end()) {
+            position = space->second;
+            // The rest stays free if it starts where an offset can point,
+            // which is not so deep into a long title's own block.
+            if(space->first > length && (position & ((1u << TITLE_OFFSET_BITS) - 1)) + length < (1u << TITLE_OFFSET_BITS))
+                freeTitleSpace.insert(make_pair(space->first - length, position + length));
+            freeTitleSpace.erase(space);
+        } else {
+            const size_t blockSize = size_t(1) << TITLE_OFFSET_BITS;
+            if(titleBlocks.empty() || titleBlockUsed + length > blockSize) {
+                titleBlocks.push_back(new char[max<size_t>(length, blockSize)]);
+                titleArenaBytes += max<size_t>(length, blockSize);
+                titleBlockUsed = 0;
+            }
+            position = (static_cast<uint64_t>(titleBlocks.size() - 1) << TITLE_OFFSET_BITS) | titleBlockUsed;
+            // A block of its own is full.
+            titleBlockUsed = (length > blockSize) ? blockSize : titleBlockUsed + length;
+        }
+        uint64_t ref = (position << TITLE_LENGTH_BITS) | length;
+        if(length > 0)
+            memcpy(const_cast<char*>(titleBytes(ref)), title.data(), length);
+        return ref;
+    }
+
+    // Replaces a title, handing its old bytes back for later titles. The
+    // old bytes stay allocated, so a reader that fetched the old title's
+    // position just before still reads inside the arena.
+    void renameTitle(uint32_t row, const string &title) {
+        uint64_t old = titles[row];
+        titles[row] = storeTitle(title);
+        uint32_t length = old & ((1u << TITLE_LENGTH_BITS) - 1);
+        if(length > 0)
+            freeTitleSpace.insert(make_pair(length, old >> TITLE_LENGTH_BITS));
+    }
+
+    // Puts copy c at the back of its title's available chain.
+    void linkFree(uint32_t c) {
+        uint32_t t = copyTitles[c];
+        nextFree[c] = NO_COPY;
+        prevFree[c] = lastFree[t];
+        if(lastFree[t] == NO_COPY) firstFree[t] = c;
+        else nextFree[lastFree[t]] = c;
+        lastFree[t] = c;
+        availableCounts[t]++;
+    }
+
+    void unlinkFree(uint32_t c) {
+        uint32_t t = copyTitles[c];
+        if(prevFree[c] == NO_COPY) firstFree[t] = nextFree[c];
+        else nextFree[prevFree[c]] = nextFree[c];
+        if(nextFree[c] == NO_COPY) lastFree[t] = prevFree[c];
+        else prevFree[nextFree[c]] = prevFree[c];
+        availableCounts[t]--;
+    }
+
+    void setCopyStatus(uint32_t c, BookStatus s) {
+        uint8_t &st = statuses[c];
+        if(!(st & STATUS_RETIRED) && st != static_cast<uint8_t>(s)) {
+            if(st == AVAILABLE) unlinkFree(c);
+            else if(s == AVAILABLE) linkFree(c);
+        }
+        st = (st & STATUS_RETIRED) | static_cast<uint8_t>(s);
+    }
+
+public:
+    CatalogStore() : titleBlockUsed(0), titleArenaBytes(0) {}
+    ~CatalogStore() {
+        for(size_t k = 0; k < titleBlocks.size(); k++)
+            delete[] titleBlocks[k];
+    }
+
+    // Adds a title with no copies yet; rec.status is not used.
+    Book* addTitle(const BookRecord &rec) {
+        uint32_t row = views.size();
+        titles.push_back(storeTitle(rec.title));
+        authors.push_back(authorNames.intern(rec.author));
+        publishers.push_back(publisherNames.intern(rec.publisher));
+        isbns.push_back(encodeISBN(rec.isbn));
+        years.push_back(rec.year);
+        copyCounts.push_back(0);
+        availableCounts.push_back(0);
+        firstCopies.push_back(NO_COPY);
+        lastCopies.push_back(NO_COPY);
+        firstFree.push_back(NO_COPY);
+        lastFree.push_back(NO_COPY);
+        views.push_back(Book(this, row));
+        return &views.back();
+    }
+
+    BookCopy* addCopy(Book* book, BookStatus status) {
+        uint32_t t = book->row, c = copyViews.size();
+        copyTitles.push_back(t);
+        statuses.push_back(static_cast<uint8_t>(status));
+        copyNumbers.push_back(++copyCounts[t]);
+        nextCopies.push_back(NO_COPY);
+        nextFree.push_back(NO_COPY);
+        prevFree.push_back(NO_COPY);
+        if(lastCopies[t] == NO_COPY) firstCopies[t] = c;
+        else nextCopies[lastCopies[t]] = c;
+        lastCopies[t] = c;
+        if(status == AVAILABLE) linkFree(c);
+        copyViews.push_back(BookCopy(this, c));
+        return &copyViews.back();
+    }
+
+    // A title with one copy of status rec.status.
+    Book* add(const BookRecord &rec) {
+        Book* book = addTitle(rec);
+        addCopy(book, rec.status);
+        return book;
+    }
+
+    Book* bookAt(uint32_t row) { return &views[row]; }
+    BookCopy* copyAt(uint32_t row) { return &copyViews[row]; }
+
+    // Marks a title and its copies as no longer part of the catalog.
+    void retire(const Book* book) {
+        uint32_t t = book->row;
+        for(uint32_t c = firstCopies[t]; c != NO_COPY; c = nextCopies[c])
+            statuses[c] |= STATUS_RETIRED;
+        availableCounts[t] = 0;
+        firstFree[t] = lastFree[t] = NO_COPY;
+    }
+
+    // The integer an ISBN is stored as; irregular ISBNs are interned.
+    uint64_t encodeISBN(const string &isbn) {
+        uint64_t code;
+        if(packDigits(TextSpan(isbn), code)) return code;
+        return ISBN_IRREGULAR | irregularIsbns.intern(isbn);
+    }
+
+    // Like encodeISBN, but read-only: returns false for an irregular ISBN
+    // that is not in the store.
+    bool findISBNCode(TextSpan isbn, uint64_t &code) const {
+        if(packDigits(isbn, code)) return true;
+        uint32_t id;
+        if(!irregularIsbns.lookup(isbn, id)) return false;
+        code = ISBN_IRREGULAR | id;
+        return true;
+    }
+
+    string decodeISBN(uint64_t code) const {
+        size_t digits = code >> ISBN_LENGTH_SHIFT;
+        uint64_t value = code & ((1ULL << ISBN_LENGTH_SHIFT) - 1);
+        if(digits > ISBN_MAX_DIGITS) return irregularIsbns.at(static_cast<uint32_t>(value));
+        string text(digits, '0');
+        for(size_t i = digits; i-- > 0; value /= 10)
+            text[i] = static_cast<char>('0' + value % 10);
+        return text;
+    }
+
+    // Counts catalog copies with the given status published in
+    // [fromYear, toYear]. Available copies are summed from the per-title
+    // counters; other statuses take a pass over the copy column.
+    size_t countWhere(BookStatus status, int fromYear, int toYear) const {
+        size_t count = 0;
+        if(status == AVAILABLE) {
+            for(size_t k = 0; k < years.chunkCount(); k++) {
+                const int32_t* yr = years.chunk(k);
+                const uint32_t* avail = availableCounts.chunk(k);
+                for(size_t i = 0, n = years.chunkLength(k); i < n; i++)
+                    count += avail[i] * ((yr[i] >= fromYear) & (yr[i] <= toYear));
+            }
+            return count;
+        }
+        const uint8_t want = static_cast<uint8_t>(status);
+        const int32_t* const* yr = years.chunks();
+        const uint32_t mask = (1u << STABLE_CHUNK_BITS) - 1;
+        for(size_t k = 0; k < statuses.chunkCount(); k++) {
+            const uint8_t* st = statuses.chunk(k);
+            const uint32_t* owner = copyTitles.chunk(k);
+            for(size_t i = 0, n = statuses.chunkLength(k); i < n; i++) {
+                int32_t y = yr[owner[i] >> STABLE_CHUNK_BITS][owner[i] & mask];
+                count += (st[i] == want) & (y >= fromYear) & (y <= toYear);
+            }
+        }
+        return count;
+    }
+
+    // Bytes held by the columns, dictionaries excluded.
+    size_t columnBytes() const {
+        return titleArenaBytes + titleBlocks.capacity() * sizeof(char*) + titles.capacity() * sizeof(uint64_t) +
+               (authors.capacity() + publishers.capacity()) * sizeof(uint32_t) +
+               isbns.capacity() * sizeof(uint64_t) + years.capacity() * sizeof(int32_t) +
+               (copyCounts.capacity() + availableCounts.capacity() + firstCopies.capacity() +
+                lastCopies.capacity() + firstFree.capacity() + lastFree.capacity()) * sizeof(uint32_t) +
+               (copyTitles.capacity() + copyNumbers.capacity() + nextCopies.capacity() + nextFree.capacity() +
+                prevFree.capacity()) * sizeof(uint32_t) +
+               statuses.capacity() + views.size() * sizeof(Book) + copyViews.size() * sizeof(BookCopy);
+    }
+
+    friend class Book;
+    friend class BookCopy;
+};
+
+inline TextSpan Book::titleText() const {
+    uint64_t ref = store->titles[row];
+    const char* begin = store->titleBytes(ref);
+    return TextSpan(begin, begin + (ref & ((1u << CatalogStore::TITLE_LENGTH_BITS) - 1)));
+}
+inline string Book::getTitle() const { return titleText().str(); }
+inline void Book::setTitle(const string &t) { store->renameTitle(row, t); }
+
+inline string Book::getAuthor() const { return store->authorNames.at(store->authors[row]); }
+inline TextSpan Book::authorText() const { return TextSpan(store->authorNames.at(store->authors[row])); }
+inline void Book::setAuthor(const string &a) { store->authors[row] = store->authorNames.intern(a); }
+
+inline string Book::getPublisher() const { return store->publisherNames.at(store->publishers[row]); }
+inline void Book::setPublisher(const string &p) { store->publishers[row] = store->publisherNames.intern(p); }
+
+inline int Book::getYear() const { return store->years[row]; }
+inline void Book::setYear(int y) { store->years[row] = y; }
+
+inline string Book::getISBN() const { return store->decodeISBN(store->isbns[row]); }
+inline uint64_t Book::isbnCode() const { return store->isbns[row]; }
+inline void Book::setISBN(const string &i) { store->isbns[row] = store->encodeISBN(i); }
+
+inline uint32_t Book::copyCount() const { return store->copyCounts[row]; }
+inline uint32_t Book::availableCopies() const { return store->availableCounts[row]; }
+inline BookCopy* Book::freeCopy() const {
+    uint32_t c = store->firstFree[row];
+    return (c != NO_COPY) ? store->copyAt(c) : nullptr;
+}
+inline BookCopy* Book::copy(uint32_t number) const {
+    for(uint32_t c = store->firstCopies[row]; c != NO_COPY; c = store->nextCopies[c])
+        if(store->copyNumbers[c] == number) return store->copyAt(c);
+    return nullptr;
+}
+template<class Visit> void Book::forEachCopy(Visit visit) const {
+    for(uint32_t c = store->firstCopies[row]; c != NO_COPY; c = store->nextCopies[c])
+        visit(store->copyAt(c));
+}
+inline BookStatus Book::getStatus() const {
+    if(availableCopies() > 0) return AVAILABLE;
+    BookStatus status = BORROWED;
+    forEachCopy([&status](const BookCopy* c) { if(c->getStatus() == RESERVED) status = RESERVED; });
+    return status;
+}
+
+inline Book* BookCopy::book() const { return store->bookAt(store->copyTitles[row]); }
+inline uint32_t BookCopy::copyNumber() const { return store->copyNumbers[row]; }
+inline BookStatus BookCopy::getStatus() const {
+    return static_cast<BookStatus>(store->statuses[row] & ~CatalogStore::STATUS_RETIRED);
+}
+inline void BookCopy::setStatus(BookStatus s) { store->setCopyStatus(row, s); }
+
+// ------------------------
+// ISBN Resolver
+// ------------------------
+// Read-only ISBN -> title lookup over the catalog's index that takes the
+// ISBN as a span, so that account records parsed straight out of
+// users.txt resolve without building a string per lookup. It reads the
+// catalog's maps, so it is used with catalogLock held (shared is enough)
+// or before the library is shared; the loader threads share one.
+class IsbnResolver {
+private:
+    const CatalogStore &store;
+    const unordered_map<uint64_t, Book*> &index;
+    const unordered_map<uint64_t, Book*>* removed;
+public:
+    IsbnResolver(const CatalogStore &s, const unordered_map<uint64_t, Book*> &i) : store(s), index(i), removed(nullptr) {}
+    // Also finds the books in r, removed from the catalog since it was
+    // loaded, ahead of any book added under the same ISBN later.
+    IsbnResolver(const CatalogStore &s, const unordered_map<uint64_t, Book*> &i, const unordered_map<uint64_t, Book*> &r)
+        : store(s), index(i), removed(&r) {}
+
+    Book* find(TextSpan isbn) const {
+        uint64_t code;
+        if(!store.findISBNCode(isbn, code)) return nullptr;
+        if(removed) {
+            auto it = removed->find(code);
+            if(it != removed->end()) return it->second;
+        }
+        auto it = index.find(code);
+        return (it != index.end()) ? it->second : nullptr;
+    }
+};
+
+// A loan or history record in users.txt names its copy by the book's ISBN
+// and, after the other fields, the copy number (left out for copy 1).
+template<class Resolve> BookCopy* resolveCopy(Resolve resolve, TextSpan isbn, const TextSpan* number) {
+    int copyNumber = 1;
+    if(number && (!parseInt(*number, copyNumber) || copyNumber < 1)) return nullptr;
+    Book* b = resolve(isbn);
+    return b ? b->copy(copyNumber) : nullptr;
+}
+
+// ------------------------
+// Account Class with Borrow/History Records
+// ------------------------
+// Loans and history records point at the copy that was lent.
+struct BorrowInfo {
+    BookCopy* copy;
+    int borrowDate;
+    int dueDate;
+};
+
+struct HistoryRecord {
+    BookCopy* copy;
+    int borrowDate;
+    int dueDate;
+    int returnDate;
+    double fineIncurred;
+};
+
+// Parses one users.txt history record, ISBN:borrowDate:dueDate:returnDate:
+// fineIncurred[:copyNumber]. Returns false if it is malformed or its copy
+// does not resolve.
+template<class Resolve> bool parseHistoryRecord(TextSpan rec, Resolve resolve, HistoryRecord &hr) {
+    TextSpan recParts[6], f;
+    size_t n = 0;
+    while(nextField(rec, ':', f)) {
+         if(n < 6) recParts[n] = f;
+         n++;
+    }
+    if(!((n == 5 || n == 6) && parseInt(recParts[1], hr.borrowDate) && parseInt(recParts[2], hr.dueDate) &&
+         parseInt(recParts[3], hr.returnDate) && parseDouble(recParts[4], hr.fineIncurred)))
+         return false;
+    hr.copy = resolveCopy(resolve, recParts[0], n == 6 ? &recParts[5] : nullptr);
+    return hr.copy != nullptr;
+}
+
+// An account's borrowing history. The newest records stay as plain
+// HistoryRecords in a small hot tail; older ones are packed into cold
+// segments and decoded only when the whole history is read (listHistory,
+// serialization, analytics). A cold record stores the copy as its catalog
+// row and the dates as varint deltas, typically 6-8 bytes instead of a
+// 32-byte HistoryRecord. An account read lazily from users.txt goes one
+// step further and leaves its older records in the file as they are,
+// parsing them only when the whole history is walked.
+class AccountHistory {
+private:
+    // The tail grows to HOT_RECORDS + COLD_BATCH before its oldest
+    // COLD_BATCH records are packed; segments hold up to SEGMENT_RECORDS.
+    static const size_t HOT_RECORDS = 8;
+    static const size_t COLD_BATCH = 8;
+    static const uint32_t SEGMENT_RECORDS = 1024;
+
+    struct ColdSegment {
+        string bytes;
+        uint32_t count;
+        int lastBorrowDate; // borrow dates are coded relative to the previous record
+    };
+
+    vector<HistoryRecord> tail; // oldest first
+    vector<ColdSegment> cold;   // oldest first
+    size_t coldCount;
+    CatalogStore* store;        // resolves the catalog rows in cold records
+    // The oldest records of all, still in users.txt form (the directory
+    // keeps the file open), and the library's resolver for them.
+    TextSpan textRecords;
+    const IsbnResolver* textBooks;
+
+    static void putVarint(string &out, uint64_t v) {
+        while(v >= 0x80) {
+            out += static_cast<char>((v & 0x7F) | 0x80);
+            v >>= 7;
+        }
+        out += static_cast<char>(v);
+    }
+    static void putSigned(string &out, int64_t v) { putVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)); }
+
+    static uint64_t getVarint(const char* &p) {
+        uint64_t v = 0;
+        for(int shift = 0; ; shift += 7) {
+            unsigned char b = static_cast<unsigned char>(*p++);
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if(!(b & 0x80)) return v;
+        }
+    }
+    static int64_t getSigned(const char* &p) {
+        uint64_t v = getVarint(p);
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    void packOldest(size_t n) {
+        for(size_t i = 0; i < n; i++) {
+            const HistoryRecord &hr = tail[i];
+            if(cold.empty() || cold.back().count == SEGMENT_RECORDS) {
+                ColdSegment fresh = {string(), 0, 0};
+                cold.push_back(fresh);
+            }
+            ColdSegment &seg = cold.back();
+            putVarint(seg.bytes, hr.copy->catalogRow());
+            putSigned(seg.bytes, static_cast<int64_t>(hr.borrowDate) - seg.lastBorrowDate);
+            putSigned(seg.bytes, static_cast<int64_t>(hr.dueDate) - hr.borrowDate);
+            putSigned(seg.bytes, static_cast<int64_t>(hr.returnDate) - hr.borrowDate);
+            // Fines are whole paise in practice; anything else is kept bit-exact.
+            double paise = hr.fineIncurred * 100;
+            if(paise >= 0 && paise < 4e18 && paise == floor(paise) && floor(paise) / 100 == hr.fineIncurred) {
+                putVarint(seg.bytes, static_cast<uint64_t>(paise) << 1);
+            } else {
+                putVarint(seg.bytes, 1);
+                seg.bytes.append(reinterpret_cast<const char*>(&hr.fineIncurred), sizeof(double));
+            }
+            seg.lastBorrowDate = hr.borrowDate;
+            seg.count++;
+        }
+        // Segments are written a batch at a time, so keep them exact
+        // rather than paying for the string's geometric growth.
+        cold.back().bytes.shrink_to_fit();
+        tail.erase(tail.begin(), tail.begin() + n);
+        coldCount += n;
+    }
+
+public:
+    AccountHistory() : coldCount(0), store(nullptr), textBooks(nullptr) {}
+
+    void push_back(const HistoryRecord &hr) {
+        if(!store) store = hr.copy->catalog();
+        tail.push_back(hr);
+        if(tail.size() >= HOT_RECORDS + COLD_BATCH)
+            packOldest(COLD_BATCH);
+    }
+
+    void clear() {
+        tail.clear();
+        cold.clear();
+        coldCount = 0;
+        textRecords = TextSpan();
+        textBooks = nullptr;
+    }
+
+    void reserve(size_t n) { tail.reserve(min(n, HOT_RECORDS + COLD_BATCH)); }
+
+    // Given the ';'-separated history records of a users.txt line, keeps
+    // all but the newest HOT_RECORDS as they are, to be resolved through
+    // books when the history is walked, and returns the newest ones for
+    // the caller to parse and push_back. Called on an empty history.
+    // Records that turn out to be malformed are skipped when walked, so
+    // the number of records is only known by walking them.
+    TextSpan deferOlder(TextSpan records, const IsbnResolver* books) {
+        size_t seps = 0;
+        for(const char* p = records.end; p != records.begin; ) {
+            if(*--p == ';' && ++seps == HOT_RECORDS) {
+                textRecords = TextSpan(records.begin, p);
+                textBooks = books;
+                return TextSpan(p + 1, records.end);
+            }
+        }
+        return records;
+    }
+
+    // The most recent records, oldest first, without touching cold storage.
+    const vector<HistoryRecord>& recent() const { return tail; }
+
+    // Calls visit(const HistoryRecord&) for every record, oldest first,
+    // decoding records left in users.txt and cold segments on the way.
+    // Records left in users.txt are resolved through the catalog's ISBN
+    // maps, so walk a history with catalogLock held (shared is enough);
+    // nothing is cached, so walkers need no other lock.
+    template<class Visit> void forEach(Visit visit) const {
+        if(textBooks) {
+            const IsbnResolver* books = textBooks;
+            auto resolve = [books](TextSpan isbn) { return books->find(isbn); };
+            TextSpan rest = textRecords, rec;
+            HistoryRecord hr;
+            while(nextField(rest, ';', rec))
+                if(parseHistoryRecord(rec, resolve, hr))
+                    visit(hr);
+        }
+        for(auto &seg : cold) {
+            const char* p = seg.bytes.data();
+            int borrow = 0;
+            for(uint32_t k = 0; k < seg.count; k++) {
+                HistoryRecord hr;
+                hr.copy = store->copyAt(static_cast<uint32_t>(getVarint(p)));
+                borrow += static_cast<int>(getSigned(p));
+                hr.borrowDate = borrow;
+                hr.dueDate = borrow + static_cast<int>(getSigned(p));
+                hr.returnDate = borrow + static_cast<int>(getSigned(p));
+                uint64_t fine = getVarint(p);
+                if(fine & 1) {
+                    memcpy(&hr.fineIncurred, p, sizeof(double));
+                    p += sizeof(double);
+                } else {
+                    hr.fineIncurred = static_cast<double>(fine >> 1) / 100;
+                }
+                visit(hr);
+            }
+        }
+        for(auto &hr : tail)
+            visit(hr);
+    }
+
+    // Bytes held by this history, for memory reports.
+    size_t memoryBytes() const {
+        size_t bytes = tail.capacity() * sizeof(HistoryRecord) + cold.capacity() * sizeof(ColdSegment);
+        for(auto &seg : cold)
+            bytes += seg.bytes.capacity();
+        return bytes;
+    }
+};
+
+class Library; // Forward declaration needed for Account::deserialize
+
+class Account {
+public:
+    vector<BorrowInfo> borrowedBooks;
+    AccountHistory history;
+    double fines; // outstanding total fine
+
+    Account() : fines(0), earliestDue(NO_DUE_DATE) {}
+
+    void addBorrowedBook(BookCopy* copy, int borrowDate, int dueDate) {
+         borrowedBooks.push_back({copy, borrowDate, dueDate});
+         earliestDue = min(earliestDue, dueDate);
+    }
+
+    void clearBorrowedBooks() {
+         borrowedBooks.clear();
+         earliestDue = NO_DUE_DATE;
+    }
+
+    // The loan of copy on this account, or nullptr.
+    const BorrowInfo* findLoan(const BookCopy* copy) const {
+         for(auto &bi : borrowedBooks)
+              if(bi.copy == copy) return &bi;
+         return nullptr;
+    }
+
+    // The earliest loan of any copy of book on this account, or nullptr.
+    const BorrowInfo* findLoan(const Book* book) const {
+         for(auto &bi : borrowedBooks)
+              if(bi.copy->book() == book) return &bi;
+         return nullptr;
+    }
+
+    // Ends the loan of copy, charging finePerDay for each day overdue and
+    // recording it in the history. Returns false if the copy was not
+    // borrowed on this account.
+    bool returnBorrowedBook(BookCopy* copy, int returnDate, int finePerDay) {
+         auto it = find_if(borrowedBooks.begin(), borrowedBooks.end(),
+               [copy](const BorrowInfo &bi){ return bi.copy == copy; });
+         if(it != borrowedBooks.end()){
+              int due = it->dueDate;
+              int overdue = (returnDate > due) ? (returnDate - due) : 0;
+              double fine = overdue * finePerDay;
+              fines += fine;
+              history.push_back({copy, it->borrowDate, due, returnDate, fine});
+              borrowedBooks.erase(it);
+              if(due == earliestDue) {
+                   earliestDue = NO_DUE_DATE;
+                   for(auto &bi : borrowedBooks)
+                        earliestDue = min(earliestDue, bi.dueDate);
+              }
+              return true;
+         }
+         return false;
+    }
+
+    void listBorrowedBooks() const {
+         if(borrowedBooks.empty()){
+            cout << "No books currently borrowed.\n";
+            return;
+         }
+         cout << "Currently Borrowed Books:\n";
+         for(auto &bi : borrowedBooks){
+             cout << "- " << bi.copy->book()->getTitle() << " (Borrowed on day " << bi.borrowDate 
+                  << ", Due on day " << bi.dueDate << ")\n";
+         }
+    }
+
+    void listHistory() const {
+         bool any = false;
+         history.forEach([&any](const HistoryRecord &hr) {
+             if(!any) cout << "Borrowing History:\n";
+             any = true;
+             cout << "- " << hr.copy->book()->getTitle() << " (Borrowed on day " << hr.borrowDate 
+                  << ", Due on day " << hr.dueDate << ", Returned on day " << hr.returnDate 
+                  << ", Fine: " << hr.fineIncurred << ")\n";
+         });
+         if(!any)
+            cout << "No borrowing history available.\n";
+    }
+
+    int getBorrowedCount() const {
+         return borrowedBooks.size();
+    }
+
+    // Only the earliest due date matters, so this is a single comparison.
+    bool hasOverdueExceeding(int currentDay, int extraDays) const {
+         return !borrowedBooks.empty() && currentDay - earliestDue > extraDays;
+    }
+
+    // Serialize account details to a string.
+    // Format: fines,borrowCount,borrowRecord1;borrowRecord2;...,historyCount,historyRecord1;historyRecord2;...
+    // Each borrowRecord: ISBN:borrowDate:dueDate[:copyNumber]
+    // Each historyRecord: ISBN:borrowDate:dueDate:returnDate:fineIncurred[:copyNumber]
+    // The copy number is left out for copy 1.
+    string serialize() const {
+         ostringstream oss;
+         oss << fines << "," << borrowedBooks.size() << ",";
+         for(size_t i = 0; i < borrowedBooks.size(); i++){
+             const BookCopy* copy = borrowedBooks[i].copy;
+             oss << copy->book()->getISBN() << ":" << borrowedBooks[i].borrowDate << ":" << borrowedBooks[i].dueDate;
+             if(copy->copyNumber() > 1) oss << ":" << copy->copyNumber();
+             if(i != borrowedBooks.size()-1) oss << ";";
+         }
+         // The history count is only known once the records are walked.
+         ostringstream records;
+         size_t historyCount = 0;
+         history.forEach([&records, &historyCount](const HistoryRecord &hr) {
+             if(historyCount++ > 0) records << ";";
+             records << hr.copy->book()->getISBN() << ":" << hr.borrowDate << ":" << hr.dueDate
+                     << ":" << hr.returnDate << ":" << hr.fineIncurred;
+             if(hr.copy->copyNumber() > 1) records << ":" << hr.copy->copyNumber();
+         });
+         oss << "," << historyCount << "," << records.str();
+         return oss.str();
+    }
+
+    // Deserialize account details from a string.
+    void deserialize(const string &data, Library &lib) { deserialize(TextSpan(data), lib); }
+    void deserialize(TextSpan data, Library &lib);
+    // With deferHistory, the older history records are left in data (see
+    // AccountHistory::deferOlder), which must then outlive the account.
+    void deserialize(TextSpan data, const IsbnResolver &books, bool deferHistory = false);
+
+private:
+    static const int NO_DUE_DATE = numeric_limits<int>::max();
+    // Earliest due date in borrowedBooks (NO_DUE_DATE if empty); kept up to
+    // date by addBorrowedBook/returnBorrowedBook, so loans must be added
+    // through those rather than by pushing to borrowedBooks directly.
+    int earliestDue;
+
+    template<class Resolve> void parseRecords(TextSpan data, Resolve resolve, const IsbnResolver* deferTo);
+};
+
+// ------------------------
+// Forward Declaration of Library
+// (Its full definition will come later.)
+class Library;
+
+// ------------------------
+// User Storage
+// ------------------------
+// Users come from one arena per concrete type instead of one heap block
+// each: objects are carved out of chunks of USER_ARENA_CHUNK, so a load
+// lays the users of a type out next to each other in file order, and the
+// slots of deleted users are reused before a new chunk is taken. Chunks
+// are kept until the program exits. The loaders create users on several
+// threads, so allocation takes a lock.
+const size_t USER_ARENA_CHUNK = 4096;
+
+template <class T>
+class UserArena {
+private:
+    typedef typename aligned_storage<sizeof(T), alignof(T)>::type Slot;
+    vector<Slot*> chunks;
+    size_t used; // slots handed out from the last chunk
+    vector<void*> freed;
+    mutex lock;
+
+    UserArena() : used(USER_ARENA_CHUNK) {}
+
+public:
+    // Never destroyed, as users may still be deleted during static
+    // destruction.
+    static UserArena& get() {
+        static UserArena* arena = new UserArena;
+        return *arena;
+    }
+
+    void* allocate(size_t size) {
+        if(size != sizeof(T)) return ::operator new(size); // a class derived from T
+        lock_guard<mutex> guard(lock);
+        if(!freed.empty()) {
+            void* p = freed.back();
+            freed.pop_back();
+            return p;
+        }
+        if(used == USER_ARENA_CHUNK) {
+            chunks.push_back(new Slot[USER_ARENA_CHUNK]);
+            used = 0;
+        }
+        return &chunks.back()[used++];
+    }
+
+    void release(void* p, size_t size) {
+        if(!p) return;
+        if(size != sizeof(T)) {
+            ::operator delete(p);
+            return;
+        }
+        lock_guard<mutex> guard(lock);
+        freed.push_back(p);
+    }
+};
+
+// ------------------------
+// Abstract Class User
+// ------------------------
+// Why a user may not borrow right now, independent of which book.
+enum BorrowDenial { BORROW_ALLOWED, DENY_LIMIT, DENY_FINES, DENY_OVERDUE, DENY_ROLE, DENY_UNAVAILABLE };
+
+// The concrete type of a user, kept in the user itself. The values are
+// also those of SnapUserType.
+enum UserRole : uint8_t { ROLE_STUDENT, ROLE_FACULTY, ROLE_LIBRARIAN, USER_ROLES };
+
+// The type name used in users.txt, the journal and the menus.
+const char* roleName(UserRole role) {
+    static const char* names[USER_ROLES] = {"Student", "Faculty", "Librarian"};
+    return names[role];
+}
+
+bool parseRole(TextSpan text, UserRole &role) {
+    for(int r = 0; r < USER_ROLES; r++)
+        if(text.equals(roleName(static_cast<UserRole>(r)))) {
+            role = static_cast<UserRole>(r);
+            return true;
+        }
+    return false;
+}
+
+// ------------------------
+// Borrowing Policies
+// ------------------------
+// The borrowing rules of each role, as a policy type. The rule check, the
+// loan period and the fine on return are written once over the policy,
+// so each role's rules compile down to constants with no virtual calls.
+// A new role (visiting scholars, alumni, ...) takes a policy, a UserRole,
+// a case in withPolicy and a Patron typedef, not another copy of the
+// borrowing code.
+const int NO_OVERDUE_LIMIT = -1;
+
+struct StudentPolicy {
+    static const UserRole role = ROLE_STUDENT;
+    static const bool mayBorrow = true;
+    static const int maxLoans = 3;
+    static const int loanDays = 15;
+    static const int finePerDay = FINE_PER_DAY;
+    static const bool finesBlockBorrowing = true;
+    static const int overdueLimitDays = NO_OVERDUE_LIMIT; // no new loans while one is more overdue than this
+};
+
+struct FacultyPolicy {
+    static const UserRole role = ROLE_FACULTY;
+    static const bool mayBorrow = true;
+    static const int maxLoans = 5;
+    static const int loanDays = 30;
+    static const int finePerDay = 0;
+    static const bool finesBlockBorrowing = false;
+    static const int overdueLimitDays = 60;
+};
+
+struct LibrarianPolicy {
+    static const UserRole role = ROLE_LIBRARIAN;
+    static const bool mayBorrow = false;
+    static const int maxLoans = 0;
+    static const int loanDays = 0;
+    static const int finePerDay = 0;
+    static const bool finesBlockBorrowing = false;
+    static const int overdueLimitDays = NO_OVERDUE_LIMIT;
+};
+
+// Why the account may not borrow right now under Policy, independent of
+// which book.
+template <class Policy>
+BorrowDenial borrowRules(const Account &account, int currentDay) {
+    if(!Policy::mayBorrow) return DENY_ROLE;
+    if(account.getBorrowedCount() >= Policy::maxLoans) return DENY_LIMIT;
+    if(Policy::finesBlockBorrowing && account.fines > 0) return DENY_FINES;
+    if(Policy::overdueLimitDays != NO_OVERDUE_LIMIT && account.hasOverdueExceeding(currentDay, Policy::overdueLimitDays))
+        return DENY_OVERDUE;
+    return BORROW_ALLOWED;
+}
+
+// Returns visit.apply<Policy>() for the policy of role. This switch is
+// the only place a role is mapped to its rules; it has no default, so a
+// new role without a policy is a -Wswitch warning rather than a student.
+template <class Visit>
+typename Visit::Result withPolicy(UserRole role, const Visit &visit) {
+    switch(role) {
+    case ROLE_STUDENT: return visit.template apply<StudentPolicy>();
+    case ROLE_FACULTY: return visit.template apply<FacultyPolicy>();
+    case ROLE_LIBRARIAN: return visit.template apply<LibrarianPolicy>();
+    case USER_ROLES: break;
+    }
+    // Users are only created with a valid role (see createUser), so this
+    // is a bug; carrying on would apply some other role's rules.
+    cout << "Unknown user role " << static_cast<int>(role) << ".\n";
+    abort();
+}
+
+struct BorrowRulesVisit {
+    typedef BorrowDenial Result;
+    const Account &account;
+    int currentDay;
+    template <class Policy> Result apply() const { return borrowRules<Policy>(account, currentDay); }
+};
+
+struct LoanDaysVisit {
+    typedef int Result;
+    template <class Policy> Result apply() const { return Policy::loanDays; }
+};
+
+struct FinePerDayVisit {
+    typedef int Result;
+    template <class Policy> Result apply() const { return Policy::finePerDay; }
+};
+
+struct OverdueLimitVisit {
+    typedef int Result;
+    template <class Policy> Result apply() const { return Policy::overdueLimitDays; }
+};
+
+class User {
+private: 
+    string password;
+protected:
+    int id;
+    string name;
+    Account account;
+    uint32_t saveSlot; // place in users.txt, see Library::saveData
+    const UserRole role;
+public:
+    User(UserRole role, int id, const string &name, const string &password)
+        : password(password), id(id), name(name), saveSlot(0), role(role) {}
+    virtual ~User() {}
+
+    int getId() const { return id; }
+    string getName() const { return name; }
+    void setName(const string &newName) { name = newName; }
+
+    string getPassword() const { return password; }
+    bool checkPassword(const string &pass) const { return pass == password; }
+    void setPassword(const string &newPass) { password = newPass; }
+
+    Account& getAccount() { return account; }
+
+    uint32_t getSaveSlot() const { return saveSlot; }
+    void setSaveSlot(uint32_t slot) { saveSlot = slot; }
+
+    UserRole getRole() const { return role; }
+    const char* getType() const { return roleName(role); }
+
+    virtual void borrowBook(Library &lib) = 0;
+    virtual void returnBook(Library &lib) = 0;
+    virtual void menu(Library &lib) = 0;
+
+    // Borrowing rules of the user's role (see the policies above) without
+    // any console I/O, shared by the menus, batch mode and the library.
+    BorrowDenial checkBorrowRules(int currentDay) const {
+        BorrowRulesVisit visit = {account, currentDay};
+        return withPolicy(role, visit);
+    }
+    int loanPeriod() const { return withPolicy(role, LoanDaysVisit()); }   // days until a new loan is due
+    int finePerDay() const { return withPolicy(role, FinePerDayVisit()); } // charged per day overdue on return
+    int overdueLimitDays() const { return withPolicy(role, OverdueLimitVisit()); } // see the policies
+};
+
+// ------------------------
+// Derived Classes Declarations
+// ------------------------
+// Students, faculty and any other role that borrows: one class over the
+// role's policy.
+template <class Policy>
+class Patron : public User {
+public:
+    Patron(int id, const string &name, const string &password) : User(Policy::role, id, name, password) {}
+    static void* operator new(size_t size) { return UserArena<Patron>::get().allocate(size); }
+    static void operator delete(void* p, size_t size) { UserArena<Patron>::get().release(p, size); }
+    virtual void borrowBook(Library &lib);
+    virtual void returnBook(Library &lib);
+    virtual void menu(Library &lib);
+};
+
+typedef Patron<StudentPolicy> Student;
+typedef Patron<FacultyPolicy> Faculty;
+
+class Librarian : public User {
+public:
+    Librarian(int id, const string &name, const string &password) : User(LibrarianPolicy::role, id, name, password) {}
+    static void* operator new(size_t size) { return UserArena<Librarian>::get().allocate(size); }
+    static void operator delete(void* p, size_t size) { UserArena<Librarian>::get().release(p, size); }
+    virtual void borrowBook(Library &lib);
+    virtual void returnBook(Library &lib);
+    virtual void menu(Library &lib);
+};
+
+// Builds a user of the given role, from the arena of its type.
+User* createUser(UserRole role, int id, const string &name, const string &password) {
+    switch(role) {
+    case ROLE_STUDENT: return new Student(id, name, password);
+    case ROLE_FACULTY: return new Faculty(id, name, password);
+    case ROLE_LIBRARIAN: return new Librarian(id, name, password);
+    default: return nullptr;
+    }
+}
+
+// Builds a user of the given type name ("Student", "Faculty", "Librarian");
+// returns nullptr for an unknown type.
+User* createUser(const string &type, int id, const string &name, const string &password) {
+    UserRole role;
+    return parseRole(TextSpan(type), role) ? createUser(role, id, name, password) : nullptr;
+}
+
+// ------------------------
+// Prefix Completion
+// ------------------------
+// Suggestions for what a reader has typed so far. Keys are titles or
+// authors normalized to lower case with punctuation and runs of spaces
+// folded into one space; each key carries the text to show and how many
+// books in the catalog have it. Keys live in one sorted array (key and
+// display text packed in an arena), so a prefix is a contiguous range; a
+// segment tree over the book counts picks the heaviest keys of that range
+// without visiting the rest. New keys collect in a small ordered map that
+// is merged into the array once it outgrows a fraction of it; a load
+// (clear() ... endBulkLoad()) appends unsorted and sorts once at the end.
+struct Completion {
+    string text;    // as first added, e.g. "The C Programming Language"
+    uint32_t books; // books in the catalog with this (normalized) text
+};
+
+const uint32_t NO_COMPLETION = 0xFFFFFFFFu;
+
+class CompletionIndex {
+private:
+    struct Entry {
+        uint32_t offset;  // key, then display text, in arena
+        uint32_t keyLen;
+        uint32_t textLen;
+    };
+    struct Pending {
+        string text;
+        uint32_t books;
+    };
+    string arena;
+    vector<Entry> entries;      // sorted by key
+    vector<uint32_t> weights;   // books per entry; 0 once every such book is gone
+    vector<uint32_t> tree;      // heaviest entry per node, leaves at cap..2*cap
+    size_t cap = 0;
+    size_t dead = 0;            // entries with weight 0
+    map<string, Pending> recent; // keys added since the last merge
+    bool bulk = false;           // after clear(): adds go unsorted into entries until endBulkLoad()
+
+    int compareKey(uint32_t i, const string &key) const {
+        return arena.compare(entries[i].offset, entries[i].keyLen, key);
+    }
+    bool hasPrefix(uint32_t i, const string &prefix) const {
+        return entries[i].keyLen >= prefix.size() && arena.compare(entries[i].offset, prefix.size(), prefix) == 0;
+    }
+    string displayOf(uint32_t i) const {
+        return arena.substr(entries[i].offset + entries[i].keyLen, entries[i].textLen);
+    }
+    uint32_t weightOf(uint32_t i) const { return i == NO_COMPLETION ? 0 : weights[i]; }
+
+    // Heavier first; equal weights in key order.
+    uint32_t pick(uint32_t a, uint32_t b) const {
+        uint32_t wa = weightOf(a), wb = weightOf(b);
+        if(wa != wb) return wa > wb ? a : b;
+        return a < b ? a : b;
+    }
+
+    uint32_t find(const string &key) const {
+        size_t lo = 0, hi = entries.size();
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(compareKey(mid, key) < 0) lo = mid + 1; else hi = mid;
+        }
+        return (lo < entries.size() && compareKey(lo, key) == 0) ? lo : NO_COMPLETION;
+    }
+
+    void setWeight(uint32_t i, uint32_t w) {
+        if((weights[i] == 0) != (w == 0)) dead += (w == 0) ? 1 : -1;
+        weights[i] = w;
+        for(size_t p = (i + cap) / 2; p >= 1; p /= 2)
+            tree[p] = pick(tree[2 * p], tree[2 * p + 1]);
+    }
+
+    uint32_t rangeBest(size_t lo, size_t hi) const {
+        uint32_t best = NO_COMPLETION;
+        for(lo += cap, hi += cap; lo < hi; lo /= 2, hi /= 2) {
+            if(lo & 1) best = pick(best, tree[lo++]);
+            if(hi & 1) best = pick(best, tree[--hi]);
+        }
+        return best;
+    }
+
+    void append(string &outArena, vector<Entry> &outEntries, vector<uint32_t> &outWeights,
+                const char* key, size_t keyLen, const char* text, size_t textLen, uint32_t books) {
+        outEntries.push_back(Entry{(uint32_t)outArena.size(), (uint32_t)keyLen, (uint32_t)textLen});
+        outArena.append(key, keyLen);
+        outArena.append(text, textLen);
+        outWeights.push_back(books);
+    }
+
+    // Folds the recent keys into the array and drops keys no book has.
+    void merge() {
+        string outArena;
+        vector<Entry> outEntries;
+        vector<uint32_t> outWeights;
+        outEntries.reserve(entries.size() - dead + recent.size());
+        outWeights.reserve(entries.size() - dead + recent.size());
+        auto r = recent.begin();
+        for(uint32_t i = 0; i < entries.size(); i++) {
+            if(weights[i] == 0) continue;
+            for(; r != recent.end() && compareKey(i, r->first) > 0; ++r)
+                append(outArena, outEntries, outWeights, r->first.data(), r->first.size(),
+                       r->second.text.data(), r->second.text.size(), r->second.books);
+            const Entry &e = entries[i];
+            append(outArena, outEntries, outWeights, arena.data() + e.offset, e.keyLen,
+                   arena.data() + e.offset + e.keyLen, e.textLen, weights[i]);
+        }
+        for(; r != recent.end(); ++r)
+            append(outArena, outEntries, outWeights, r->first.data(), r->first.size(),
+                   r->second.text.data(), r->second.text.size(), r->second.books);
+        arena.swap(outArena);
+        entries.swap(outEntries);
+        weights.swap(outWeights);
+        recent.clear();
+        dead = 0;
+        buildTree();
+    }
+
+    // Sorts the entries of a bulk load and folds equal keys into one. Ties
+    // keep the first text added (arena offsets grow in insertion order);
+    // the arena bytes of the folded duplicates stay until the next merge.
+    void sortBulk() {
+        const char* base = arena.data();
+        sort(entries.begin(), entries.end(), [base](const Entry &a, const Entry &b) {
+            int c = memcmp(base + a.offset, base + b.offset, min(a.keyLen, b.keyLen));
+            if(c != 0) return c < 0;
+            return a.keyLen != b.keyLen ? a.keyLen < b.keyLen : a.offset < b.offset;
+        });
+        size_t out = 0;
+        weights.clear();
+        for(size_t i = 0; i < entries.size(); ) {
+            size_t j = i + 1;
+            while(j < entries.size() && entries[j].keyLen == entries[i].keyLen &&
+                  memcmp(base + entries[j].offset, base + entries[i].offset, entries[i].keyLen) == 0) j++;
+            entries[out++] = entries[i];
+            weights.push_back((uint32_t)(j - i));
+            i = j;
+        }
+        entries.resize(out);
+        buildTree();
+    }
+
+    void buildTree() {
+        for(cap = 1; cap < entries.size(); cap *= 2) {}
+        tree.assign(2 * cap, NO_COMPLETION);
+        for(uint32_t i = 0; i < entries.size(); i++) tree[cap + i] = i;
+        for(size_t p = cap - 1; p >= 1; p--) tree[p] = pick(tree[2 * p], tree[2 * p + 1]);
+    }
+
+public:
+    // Lower-cases ASCII letters and folds everything that is not a letter,
+    // digit or UTF-8 byte into a single space. Keys drop a trailing space;
+    // a typed prefix keeps it, so "data " only matches whole words.
+    static string normalize(const string &text, bool keepTrailingSpace = false) {
+        string key;
+        key.reserve(text.size());
+        appendKey(text, key, keepTrailingSpace);
+        return key;
+    }
+
+    // Appends the normalized form of text to out; see normalize().
+    static void appendKey(const string &text, string &out, bool keepTrailingSpace) {
+        size_t start = out.size();
+        for(unsigned char c : text) {
+            if(c >= 'A' && c <= 'Z') out += (char)(c - 'A' + 'a');
+            else if((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80) out += (char)c;
+            else if(out.size() > start && out.back() != ' ') out += ' ';
+        }
+        if(!keepTrailingSpace && out.size() > start && out.back() == ' ') out.pop_back();
+    }
+
+    void add(const string &text) {
+        if(bulk) {
+            size_t offset = arena.size();
+            appendKey(text, arena, false);
+            if(arena.size() == offset) return;
+            entries.push_back(Entry{(uint32_t)offset, (uint32_t)(arena.size() - offset), (uint32_t)text.size()});
+            arena += text;
+            return;
+        }
+        string key = normalize(text);
+        if(key.empty()) return;
+        uint32_t i = find(key);
+        if(i != NO_COMPLETION) {
+            setWeight(i, weights[i] + 1);
+            return;
+        }
+        Pending &p = recent[key];
+        if(p.books++ == 0) p.text = text;
+        if(recent.size() > max<size_t>(1024, min<size_t>(entries.size() / 8, 16384))) merge();
+    }
+
+    void remove(const string &text) {
+        endBulkLoad();
+        string key = normalize(text);
+        if(key.empty()) return;
+        uint32_t i = find(key);
+        if(i != NO_COMPLETION) {
+            if(weights[i] > 0) setWeight(i, weights[i] - 1);
+            if(dead > 1024 && dead > entries.size() / 2) merge();
+            return;
+        }
+        auto it = recent.find(key);
+        if(it != recent.end() && --it->second.books == 0) recent.erase(it);
+    }
+
+    // Ends a bulk load; keys added since clear() are not suggested before.
+    void endBulkLoad() {
+        if(bulk) {
+            bulk = false;
+            sortBulk();
+        }
+    }
+
+    void clear() {
+        arena.clear();
+        entries.clear();
+        weights.clear();
+        tree.clear();
+        recent.clear();
+        cap = 0;
+        dead = 0;
+        bulk = true;
+    }
+
+    // The k keys starting with prefix that the most books share; ties in
+    // alphabetical order.
+    vector<Completion> complete(const string &typed, size_t k) const {
+        vector<Completion> result;
+        string prefix = normalize(typed, true);
+        if(prefix.empty() || k == 0) return result;
+        // Candidates from the recent map; it is kept small, so a prefix range
+        // of it is cheap to rank in full.
+        vector<pair<uint32_t, const pair<const string, Pending>*> > fresh;
+        for(auto it = recent.lower_bound(prefix);
+            it != recent.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+            fresh.push_back(make_pair(it->second.books, &*it));
+        auto freshOrder = [](const pair<uint32_t, const pair<const string, Pending>*> &a,
+                             const pair<uint32_t, const pair<const string, Pending>*> &b) {
+            return a.first != b.first ? a.first > b.first : a.second->first < b.second->first;
+        };
+        size_t keep = min(k, fresh.size());
+        partial_sort(fresh.begin(), fresh.begin() + keep, fresh.end(), freshOrder);
+        fresh.resize(keep);
+
+        // Prefix range of the array, then best-first over its sub-ranges.
+        size_t lo = 0, hi = entries.size();
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(compareKey(mid, prefix) < 0) lo = mid + 1; else hi = mid;
+        }
+        size_t end = lo;
+        for(size_t top = entries.size(); end < top; ) {
+            size_t mid = (end + top) / 2;
+            if(hasPrefix(mid, prefix)) end = mid + 1; else top = mid;
+        }
+        struct Span { uint32_t best; size_t lo, hi; };
+        auto spanOrder = [this](const Span &a, const Span &b) { return pick(a.best, b.best) == b.best; };
+        priority_queue<Span, vector<Span>, decltype(spanOrder)> spans(spanOrder);
+        auto split = [&](size_t from, size_t to) {
+            uint32_t best = from < to ? rangeBest(from, to) : NO_COMPLETION;
+            if(weightOf(best) > 0) spans.push(Span{best, from, to});
+        };
+        split(lo, end);
+        size_t f = 0;
+        while(result.size() < k && (!spans.empty() || f < fresh.size())) {
+            if(!spans.empty()) {
+                uint32_t i = spans.top().best;
+                bool freshFirst = f < fresh.size() &&
+                    (fresh[f].first > weights[i] || (fresh[f].first == weights[i] && compareKey(i, fresh[f].second->first) > 0));
+                if(!freshFirst) {
+                    Span s = spans.top();
+                    spans.pop();
+                    result.push_back(Completion{displayOf(i), weights[i]});
+                    split(s.lo, i);
+                    split(i + 1, s.hi);
+                    continue;
+                }
+            }
+            result.push_back(Completion{fresh[f].second->second.text, fresh[f].first});
+            f++;
+        }
+        return result;
+    }
+};
+
+// ------------------------
+// Book Search Index
+// ------------------------
+// Inverted trigram index over title, author and ISBN. Posting lists hold
+// per-book sequence numbers in ascending (insertion) order, so results come
+// back in catalog order. Every candidate is re-checked with string::find,
+// which keeps matches identical to a plain substring scan.
+enum SearchField { SEARCH_TITLE = 0, SEARCH_AUTHOR = 1, SEARCH_ISBN = 2 };
+
+// Ranked search scores every book by the words of its title and author:
+// each query word earns the points of its closest word in the book, and
+// the book's score is the sum. Prefixes count from 3 letters, one typo
+// (insert, delete, replace or swap of neighbours) from 4, two from 8.
+const uint32_t RANK_EXACT = 10, RANK_PREFIX = 8, RANK_ONE_TYPO = 6, RANK_TWO_TYPOS = 3;
+const size_t RANK_MIN_CHUNK = 1 << 16; // fewest books worth a scoring thread
+
+struct RankedMatch {
+    Book* book;
+    uint32_t score;
+};
+
+class BookSearchIndex {
+private:
+    typedef vector<uint32_t> Postings;
+    unordered_map<uint32_t, Postings> grams[3]; // one trigram table per field
+    unordered_map<const Book*, uint32_t> seqOf;
+    vector<Book*> bySeq; // nullptr once a book has been removed
+    CompletionIndex completions[2]; // title and author prefixes
+    // Word index for ranked search: each distinct normalized word of a
+    // title or author and the books holding it. Words stay in the
+    // vocabulary once their last book is gone (with no postings).
+    unordered_map<string, uint32_t> wordIds;
+    vector<string> words;
+    vector<Postings> wordBooks;
+
+    static string fieldText(const Book* book, int field) {
+        switch(field) {
+            case SEARCH_TITLE:  return book->getTitle();
+            case SEARCH_AUTHOR: return book->getAuthor();
+            default:            return book->getISBN();
+        }
+    }
+
+    static void distinctGrams(const string &text, vector<uint32_t> &out) {
+        out.clear();
+        for(size_t i = 0; i + 3 <= text.size(); i++) {
+            out.push_back((uint32_t)(unsigned char)text[i] << 16 |
+                          (uint32_t)(unsigned char)text[i + 1] << 8 |
+                          (uint32_t)(unsigned char)text[i + 2]);
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+
+    void indexText(uint32_t seq, int field, const string &text) {
+        vector<uint32_t> gs;
+        distinctGrams(text, gs);
+        for(uint32_t g : gs) {
+            Postings &p = grams[field][g];
+            // New books always carry the largest seq, so this is an append
+            // except when a renamed book is re-indexed.
+            p.insert(upper_bound(p.begin(), p.end(), seq), seq);
+        }
+    }
+
+    void unindexText(uint32_t seq, int field, const string &text) {
+        vector<uint32_t> gs;
+        distinctGrams(text, gs);
+        for(uint32_t g : gs) {
+            auto it = grams[field].find(g);
+            if(it == grams[field].end()) continue;
+            Postings &p = it->second;
+            auto pos = lower_bound(p.begin(), p.end(), seq);
+            if(pos != p.end() && *pos == seq) p.erase(pos);
+            if(p.empty()) grams[field].erase(it);
+        }
+    }
+
+    // Distinct normalized words of a title and author.
+    static void bookWords(const string &title, const string &author, vector<string> &out) {
+        out.clear();
+        string text;
+        text.reserve(title.size() + author.size() + 1);
+        CompletionIndex::appendKey(title, text, false);
+        text += ' ';
+        CompletionIndex::appendKey(author, text, false);
+        for(size_t start = 0, end; start < text.size(); start = end + 1) {
+            end = text.find(' ', start);
+            if(end == string::npos) end = text.size();
+            if(end > start) out.emplace_back(text, start, end - start);
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+
+    void indexWords(uint32_t seq, const string &title, const string &author) {
+        vector<string> ws;
+        bookWords(title, author, ws);
+        for(auto &w : ws) {
+            auto it = wordIds.find(w);
+            if(it == wordIds.end()) {
+                it = wordIds.insert(make_pair(w, (uint32_t)words.size())).first;
+                words.push_back(w);
+                wordBooks.push_back(Postings());
+            }
+            Postings &p = wordBooks[it->second];
+            p.insert(upper_bound(p.begin(), p.end(), seq), seq);
+        }
+    }
+
+    void unindexWords(uint32_t seq, const string &title, const string &author) {
+        vector<string> ws;
+        bookWords(title, author, ws);
+        for(auto &w : ws) {
+            auto it = wordIds.find(w);
+            if(it == wordIds.end()) continue;
+            Postings &p = wordBooks[it->second];
+            auto pos = lower_bound(p.begin(), p.end(), seq);
+            if(pos != p.end() && *pos == seq) p.erase(pos);
+        }
+    }
+
+    // Edit distance counting a swap of neighbouring letters as one edit, or
+    // limit + 1 as soon as it must exceed limit. Words over 63 letters only
+    // ever match exactly.
+    static int typoDistance(const string &a, const string &b, int limit) {
+        int la = a.size(), lb = b.size();
+        if(abs(la - lb) > limit || la > 63 || lb > 63) return limit + 1;
+        int rows[3][64];
+        for(int j = 0; j <= lb; j++) rows[0][j] = j;
+        for(int i = 1; i <= la; i++) {
+            int* cur = rows[i % 3];
+            const int* prev = rows[(i + 2) % 3];
+            const int* prev2 = rows[(i + 1) % 3];
+            cur[0] = i;
+            int best = i;
+            for(int j = 1; j <= lb; j++) {
+                int d = min(min(prev[j], cur[j - 1]) + 1, prev[j - 1] + (a[i - 1] != b[j - 1]));
+                if(i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+                    d = min(d, prev2[j - 2] + 1);
+                cur[j] = d;
+                best = min(best, d);
+            }
+            if(best > limit) return limit + 1;
+        }
+        return min(rows[la % 3][lb], limit + 1);
+    }
+
+    // Points a query word earns against one vocabulary word (0 for none).
+    static uint32_t wordScore(const string &query, const string &word) {
+        if(query == word) return RANK_EXACT;
+        if(query.size() >= 3 && word.size() > query.size() && word.compare(0, query.size(), query) == 0)
+            return RANK_PREFIX;
+        int limit = query.size() >= 8 ? 2 : query.size() >= 4 ? 1 : 0;
+        if(limit == 0) return 0;
+        int d = typoDistance(query, word, limit);
+        if(d > limit) return 0;
+        return d == 1 ? RANK_ONE_TYPO : RANK_TWO_TYPOS;
+    }
+
+    // One query word: the vocabulary words it matches and their points.
+    typedef vector<pair<const Postings*, uint32_t> > QueryTerm;
+
+    // Scores books with seq in [lo, hi) and keeps the best k in out.
+    void scoreRange(const vector<QueryTerm> &terms, uint32_t lo, uint32_t hi, size_t k,
+                    vector<pair<uint32_t, uint32_t> > &out) const {
+        vector<uint32_t> total(hi - lo, 0);
+        vector<uint16_t> best(hi - lo, 0);
+        vector<uint32_t> hit, touched;
+        for(auto &term : terms) {
+            touched.clear();
+            for(auto &m : term) {
+                const Postings &p = *m.first;
+                for(auto it = lower_bound(p.begin(), p.end(), lo); it != p.end() && *it < hi; ++it) {
+                    uint16_t &b = best[*it - lo];
+                    if(b == 0) touched.push_back(*it - lo);
+                    if(m.second > b) b = m.second;
+                }
+            }
+            for(uint32_t i : touched) {
+                if(total[i] == 0) hit.push_back(i);
+                total[i] += best[i];
+                best[i] = 0;
+            }
+        }
+        // Min-heap of the best k so far: (score, seq), lower seq wins ties.
+        auto worse = [](const pair<uint32_t, uint32_t> &a, const pair<uint32_t, uint32_t> &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        };
+        out.clear();
+        for(uint32_t i : hit) {
+            pair<uint32_t, uint32_t> cand(total[i], lo + i);
+            if(out.size() < k) {
+                out.push_back(cand);
+                push_heap(out.begin(), out.end(), worse);
+            } else if(worse(cand, out.front())) {
+                pop_heap(out.begin(), out.end(), worse);
+                out.back() = cand;
+                push_heap(out.begin(), out.end(), worse);
+            }
+        }
+    }
+
+public:
+    void add(Book* book) {
+        uint32_t seq = bySeq.size();
+        bySeq.push_back(book);
+        seqOf[book] = seq;
+        for(int f = 0; f < 3; f++)
+            indexText(seq, f, fieldText(book, f));
+        indexWords(seq, book->getTitle(), book->getAuthor());
+        completions[SEARCH_TITLE].add(book->getTitle());
+        completions[SEARCH_AUTHOR].add(book->getAuthor());
+    }
+
+    void remove(Book* book) {
+        auto it = seqOf.find(book);
+        if(it == seqOf.end()) return;
+        for(int f = 0; f < 3; f++)
+            unindexText(it->second, f, fieldText(book, f));
+        completions[SEARCH_TITLE].remove(book->getTitle());
+        completions[SEARCH_AUTHOR].remove(book->getAuthor());
+        unindexWords(it->second, book->getTitle(), book->getAuthor());
+        bySeq[it->second] = nullptr;
+        seqOf.erase(it);
+    }
+
+    // Re-index one field after it changed; oldText is its previous value.
+    void reindex(Book* book, int field, const string &oldText) {
+        auto it = seqOf.find(book);
+        if(it == seqOf.end()) return;
+        unindexText(it->second, field, oldText);
+        indexText(it->second, field, fieldText(book, field));
+        if(field != SEARCH_ISBN) {
+            completions[field].remove(oldText);
+            completions[field].add(fieldText(book, field));
+            bool title = (field == SEARCH_TITLE);
+            unindexWords(it->second, title ? oldText : book->getTitle(), title ? book->getAuthor() : oldText);
+            indexWords(it->second, book->getTitle(), book->getAuthor());
+        }
+    }
+
+    void clear() {
+        for(int f = 0; f < 3; f++) grams[f].clear();
+        completions[SEARCH_TITLE].clear();
+        completions[SEARCH_AUTHOR].clear();
+        wordIds.clear();
+        words.clear();
+        wordBooks.clear();
+        seqOf.clear();
+        bySeq.clear();
+    }
+
+    // Called by the loaders once every book has been added.
+    void endBulkLoad() {
+        completions[SEARCH_TITLE].endBulkLoad();
+        completions[SEARCH_AUTHOR].endBulkLoad();
+    }
+
+    // Title or author completions for a typed prefix (none for ISBN).
+    vector<Completion> complete(SearchField field, const string &prefix, size_t k) const {
+        if(field == SEARCH_ISBN) return vector<Completion>();
+        return completions[field].complete(prefix, k);
+    }
+
+    // The k books whose title and author best match the words of query,
+    // best first (catalog order among equal scores). Large catalogs are
+    // scored in up to `threads` slices of the book sequence at once.
+    vector<RankedMatch> rank(const string &query, size_t k, size_t threads) const {
+        vector<RankedMatch> result;
+        vector<string> qwords;
+        bookWords(query, "", qwords);
+        if(qwords.empty() || k == 0) return result;
+        vector<QueryTerm> terms(qwords.size());
+        for(size_t q = 0; q < qwords.size(); q++) {
+            for(size_t w = 0; w < words.size(); w++) {
+                if(wordBooks[w].empty()) continue;
+                uint32_t points = wordScore(qwords[q], words[w]);
+                if(points > 0) terms[q].push_back(make_pair(&wordBooks[w], points));
+            }
+        }
+
+        uint32_t count = bySeq.size();
+        size_t parts = max<size_t>(1, min(threads, count / RANK_MIN_CHUNK + 1));
+        vector<vector<pair<uint32_t, uint32_t> > > best(parts);
+        vector<thread> workers;
+        for(size_t c = 1; c < parts; c++)
+            workers.push_back(thread(&BookSearchIndex::scoreRange, this, cref(terms), (uint32_t)(count * c / parts),
+                                     (uint32_t)(count * (c + 1) / parts), k, ref(best[c])));
+        scoreRange(terms, 0, count / parts, k, best[0]);
+        for(auto &w : workers)
+            w.join();
+
+        vector<pair<uint32_t, uint32_t> > merged;
+        for(auto &b : best)
+            merged.insert(merged.end(), b.begin(), b.end());
+        sort(merged.begin(), merged.end(), [](const pair<uint32_t, uint32_t> &a, const pair<uint32_t, uint32_t> &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        for(size_t i = 0; i < merged.size() && result.size() < k; i++)
+            result.push_back(RankedMatch{bySeq[merged[i].second], merged[i].first});
+        return result;
+    }
+
+    vector<Book*> search(SearchField field, const string &query) const {
+        vector<Book*> result;
+        if(query.size() < 3) {
+            // Too short to carry a trigram; every book is a candidate.
+            for(auto book : bySeq) {
+                if(book && fieldText(book, field).find(query) != string::npos)
+                    result.push_back(book);
+            }
+            return result;
+        }
+        vector<uint32_t> gs;
+        distinctGrams(query, gs);
+        vector<const Postings*> lists;
+        for(uint32_t g : gs) {
+            auto it = grams[field].find(g);
+            if(it == grams[field].end()) return result;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const Postings* a, const Postings* b) { return a->size() < b->size(); });
+        Postings candidates = *lists[0];
+        for(size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+            const Postings &other = *lists[i];
+            candidates.erase(remove_if(candidates.begin(), candidates.end(),
+                [&other](uint32_t seq) { return !binary_search(other.begin(), other.end(), seq); }),
+                candidates.end());
+        }
+        for(uint32_t seq : candidates) {
+            Book* book = bySeq[seq];
+            if(book && fieldText(book, field).find(query) != string::npos)
+                result.push_back(book);
+        }
+        return result;
+    }
+};
+
+// ------------------------
+// Sorted Listing
+// ------------------------
+// The catalog in title, author, year or status order, a page at a time.
+// Each order is a permutation of the books, sorted when it is first asked
+// for and from then on kept sorted as books are added, removed or
+// renamed: a book is placed by binary search, so a change moves part of
+// the array instead of sorting it again. The status order is the title
+// order grouped by status. One Fenwick tree per status counts the books
+// of that status up to each place in the title order, so a borrow or
+// return that changes a book's status is two point updates, and the n-th
+// book of a status is found by descending its tree.
+enum SortOrder { SORT_TITLE = 0, SORT_AUTHOR = 1, SORT_YEAR = 2, SORT_STATUS = 3 };
+
+const char* sortOrderName(SortOrder order) {
+    static const char* names[] = {"title", "author", "year", "status"};
+    return names[order];
+}
+
+const uint32_t NO_PLACE = 0xFFFFFFFFu; // a book not in BookListing's title order
+
+const size_t LIST_PAGE_SIZE = 10; // books per page of the interactive listing
+
+// Status changes are queued per stripe of books and folded into the
+// status counts in batches of this many, or when the status order is read.
+const size_t STATUS_STRIPES = 64;
+const size_t STATUS_BATCH = 256;
+
+class BookListing {
+private:
+    vector<Book*> orders[3]; // by title, author and year, once built
+    bool built[3] = {false, false, false};
+    // Status counts over the title order. Borrowers run with the catalog
+    // lock held shared: each records its change in listed (a book's place
+    // is only written under its own lock) and queues the move under the
+    // mutex of its stripe, so borrowers of different stripes do not
+    // contend. statusLock guards the trees and is only taken to fold in a
+    // full batch or to read the order. Adding or removing a book (catalog
+    // lock held exclusively) shifts the places and recounts the trees.
+    struct StatusMove {
+        uint32_t place;
+        uint8_t from, to;
+    };
+    bool statusBuilt = false;
+    mutable mutex statusLock;
+    mutable mutex stripeLocks[STATUS_STRIPES];
+    mutable vector<StatusMove> moves[STATUS_STRIPES];
+    vector<uint32_t> places;           // catalog row -> place in the title order
+    vector<uint8_t> listed;            // status each place is counted under
+    mutable vector<uint32_t> trees[3]; // per status, 1-based
+    mutable size_t totals[3] = {0, 0, 0};
+
+    // Byte order with ASCII letters folded to lower case.
+    static int compareFolded(TextSpan a, TextSpan b) {
+        size_t n = min(a.size(), b.size());
+        for(size_t i = 0; i < n; i++) {
+            unsigned char x = a.begin[i], y = b.begin[i];
+            if(x >= 'A' && x <= 'Z') x += 'a' - 'A';
+            if(y >= 'A' && y <= 'Z') y += 'a' - 'A';
+            if(x != y) return x < y ? -1 : 1;
+        }
+        return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+    }
+
+    // Ties go by title, then by catalog row, so every book has one place.
+    struct Before {
+        SortOrder order;
+        bool operator()(const Book* a, const Book* b) const {
+            if(order == SORT_YEAR && a->getYear() != b->getYear()) return a->getYear() < b->getYear();
+            int c = (order == SORT_AUTHOR) ? compareFolded(a->authorText(), b->authorText()) : 0;
+            if(c == 0) c = compareFolded(a->titleText(), b->titleText());
+            return c != 0 ? c < 0 : a->catalogRow() < b->catalogRow();
+        }
+    };
+
+    void bump(int status, size_t place, int delta) const {
+        vector<uint32_t> &tree = trees[status];
+        for(size_t i = place + 1; i < tree.size(); i += i & (0 - i))
+            tree[i] += delta;
+        totals[status] += delta;
+    }
+
+    // Place in the title order of the n-th book (from 0) with status.
+    size_t nth(int status, size_t n) const {
+        const vector<uint32_t> &tree = trees[status];
+        size_t place = 0, step = 1;
+        while(step * 2 < tree.size()) step *= 2;
+        for(; step > 0; step /= 2) {
+            if(place + step < tree.size() && tree[place + step] <= n) {
+                place += step;
+                n -= tree[place];
+            }
+        }
+        return place;
+    }
+
+    // Folds the queued moves of stripe into the trees; called with
+    // statusLock and the stripe's mutex held.
+    void applyMoves(size_t stripe) const {
+        for(auto &m : moves[stripe]) {
+            bump(m.from, m.place, -1);
+            bump(m.to, m.place, 1);
+        }
+        moves[stripe].clear();
+    }
+
+    // Brings the trees up to date; called with statusLock held.
+    void applyAllMoves() const {
+        for(size_t k = 0; k < STATUS_STRIPES; k++) {
+            lock_guard<mutex> guard(stripeLocks[k]);
+            applyMoves(k);
+        }
+    }
+
+    // Counts the trees from listed in one linear pass.
+    void countTrees() {
+        size_t n = listed.size();
+        for(int s = 0; s < 3; s++) {
+            trees[s].assign(n + 1, 0);
+            totals[s] = 0;
+        }
+        for(size_t i = 0; i < n; i++) {
+            trees[listed[i]][i + 1]++;
+            totals[listed[i]]++;
+        }
+        for(int s = 0; s < 3; s++) {
+            for(size_t i = 1; i <= n; i++) {
+                size_t parent = i + (i & (0 - i));
+                if(parent <= n) trees[s][parent] += trees[s][i];
+            }
+        }
+    }
+
+    void buildStatus() {
+        const vector<Book*> &byTitle = orders[SORT_TITLE];
+        size_t n = byTitle.size();
+        uint32_t rows = 0;
+        for(auto book : byTitle)
+            rows = max(rows, book->catalogRow() + 1);
+        places.assign(rows, NO_PLACE);
+        listed.resize(n);
+        for(size_t i = 0; i < n; i++) {
+            places[byTitle[i]->catalogRow()] = i;
+            listed[i] = byTitle[i]->getStatus();
+        }
+        for(size_t k = 0; k < STATUS_STRIPES; k++)
+            moves[k].clear();
+        countTrees();
+        statusBuilt = true;
+    }
+
+    // Places from `from` on move by delta; used as a book enters or leaves
+    // the title order at that place.
+    void shiftPlaces(uint32_t from, int delta) {
+        for(auto &p : places)
+            if(p != NO_PLACE && p >= from) p += delta;
+    }
+
+public:
+    bool isBuilt(SortOrder order) const { return order == SORT_STATUS ? statusBuilt : built[order]; }
+
+    // Sorts books into order unless that is done already. Called with
+    // catalogLock held exclusively.
+    void build(SortOrder order, const vector<Book*> &books) {
+        if(order == SORT_STATUS) {
+            build(SORT_TITLE, books);
+            if(!statusBuilt) buildStatus();
+            return;
+        }
+        if(built[order]) return;
+        orders[order] = books;
+        sort(orders[order].begin(), orders[order].end(), Before{order});
+        built[order] = true;
+    }
+
+    // Keep the built orders in step with the catalog; called with
+    // catalogLock held exclusively. A book being renamed is removed
+    // before the change and added back after it.
+    void add(Book* book) {
+        size_t place = 0;
+        for(int o = 0; o < 3; o++) {
+            if(!built[o]) continue;
+            vector<Book*> &v = orders[o];
+            auto it = lower_bound(v.begin(), v.end(), book, Before{static_cast<SortOrder>(o)});
+            if(o == SORT_TITLE) place = it - v.begin();
+            v.insert(it, book);
+        }
+        if(!statusBuilt) return;
+        lock_guard<mutex> guard(statusLock);
+        applyAllMoves();
+        shiftPlaces(place, 1);
+        uint32_t row = book->catalogRow();
+        if(row >= places.size()) places.resize(row + 1, NO_PLACE);
+        places[row] = place;
+        listed.insert(listed.begin() + place, book->getStatus());
+        countTrees();
+    }
+
+    void remove(Book* book) {
+        for(int o = 0; o < 3; o++) {
+            if(!built[o]) continue;
+            vector<Book*> &v = orders[o];
+            auto it = lower_bound(v.begin(), v.end(), book, Before{static_cast<SortOrder>(o)});
+            if(it != v.end() && *it == book) v.erase(it);
+        }
+        uint32_t row = book->catalogRow();
+        if(!statusBuilt || row >= places.size() || places[row] == NO_PLACE) return;
+        lock_guard<mutex> guard(statusLock);
+        applyAllMoves();
+        uint32_t place = places[row];
+        places[row] = NO_PLACE;
+        shiftPlaces(place + 1, -1);
+        listed.erase(listed.begin() + place);
+        countTrees();
+    }
+
+    // Recounts a book whose copies changed status; called with the book's
+    // lock held.
+    void statusChanged(const Book* book) {
+        if(!statusBuilt) return;
+        uint32_t row = book->catalogRow();
+        if(row >= places.size() || places[row] == NO_PLACE) return; // removed
+        uint32_t place = places[row];
+        uint8_t now = book->getStatus();
+        if(listed[place] == now) return;
+        StatusMove m = {place, listed[place], now};
+        listed[place] = now;
+        size_t stripe = row % STATUS_STRIPES;
+        unique_lock<mutex> queue(stripeLocks[stripe]);
+        moves[stripe].push_back(m);
+        if(moves[stripe].size() < STATUS_BATCH) return;
+        // Fold the batch in; statusLock goes first, as everywhere else.
+        queue.unlock();
+        lock_guard<mutex> guard(statusLock);
+        queue.lock();
+        applyMoves(stripe);
+    }
+
+    // Up to count books of a built order from place offset on. Returns
+    // how many books the order holds. Called with catalogLock held.
+    size_t page(SortOrder order, size_t offset, size_t count, vector<Book*> &out) const {
+        out.clear();
+        const vector<Book*> &v = orders[order == SORT_STATUS ? SORT_TITLE : order];
+        if(order != SORT_STATUS) {
+            for(size_t i = offset; i < v.size() && out.size() < count; i++)
+                out.push_back(v[i]);
+            return v.size();
+        }
+        lock_guard<mutex> guard(statusLock);
+        applyAllMoves();
+        for(size_t i = offset; i < v.size() && out.size() < count; i++) {
+            size_t n = i;
+            int status = 0;
+            while(n >= totals[status])
+                n -= totals[status++];
+            out.push_back(v[nth(status, n)]);
+        }
+        return v.size();
+    }
+
+    // Drops every order; the loaders call this before filling the catalog.
+    void clear() {
+        for(int o = 0; o < 3; o++) {
+            orders[o].clear();
+            built[o] = false;
+        }
+        statusBuilt = false;
+        places.clear();
+        listed.clear();
+        for(int s = 0; s < 3; s++) trees[s].clear();
+        for(size_t k = 0; k < STATUS_STRIPES; k++) moves[k].clear();
+    }
+};
+
+// ------------------------
+// Binary Snapshot Format
+// ------------------------
+// Layout (native byte order, every section 8-byte aligned up to the
+// borrow records):
+//   SnapshotHeader
+//   SnapBook[bookCount]         one per title (v4; before, one per copy)
+//   SnapUser[userCount]
+//   SnapHistory[historyCount]   grouped per user, in user order
+//   SnapBorrow[borrowCount]     grouped per user, in user order
+//   SnapHold[holdCount]         grouped per book, in book order (v3)
+//   SnapCopy[copyCount]         grouped per book, in book order (v4)
+//   string table (stringBytes)  titles, authors, publishers, ISBNs, names...
+// Accounts refer to copies by their index in SnapCopy[], not by ISBN.
+// Before v4 every SnapBook was a copy of its own, so that index is the
+// SnapBook index there.
+const char SNAPSHOT_MAGIC[8] = {'L', 'M', 'S', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t SNAPSHOT_VERSION = 4;      // v2 added journalSeq, v3 hold queues, v4 copies
+const size_t SNAPSHOT_V1_HEADER_SIZE = 40;
+const size_t SNAPSHOT_V2_HEADER_SIZE = 48;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const uint32_t SNAPSHOT_NO_BOOK = 0xFFFFFFFFu; // loan of a book no longer in the catalog
+
+enum SnapUserType { SNAP_STUDENT = 0, SNAP_FACULTY = 1, SNAP_LIBRARIAN = 2 };
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t bookCount;
+    uint32_t userCount;
+    uint32_t historyCount;
+    uint32_t borrowCount;
+    uint64_t stringBytes;
+    uint64_t journalSeq; // last journal record already folded into this snapshot
+    uint32_t holdCount;
+    uint32_t copyCount; // v4
+};
+
+struct StrRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapBook {
+    StrRef title, author, publisher, isbn;
+    int32_t year;
+    uint32_t copies; // v4: number of copies; before: status of the one copy
+};
+
+struct SnapCopy {
+    uint8_t status;
+};
+
+struct SnapUser {
+    int32_t id;
+    uint32_t type;
+    StrRef name, password;
+    double fines;
+    uint32_t historyCount;
+    uint32_t borrowCount;
+};
+
+struct SnapHistory {
+    uint32_t book;
+    int32_t borrowDate, dueDate, returnDate;
+    double fineIncurred;
+};
+
+struct SnapBorrow {
+    uint32_t book;
+    int32_t borrowDate, dueDate;
+};
+
+// A book's set-aside copies (ready = 1, day = last pickup day) come before
+// its waiting patrons (day = day the hold was placed). The set-aside
+// records go with the book's RESERVED copies in copy order.
+struct SnapHold {
+    uint32_t book;
+    int32_t userId;
+    int32_t day;
+    uint32_t ready;
+};
+
+// Builds the deduplicated string table while a snapshot is written.
+class StringTableBuilder {
+private:
+    string bytes;
+    unordered_map<string, StrRef> seen;
+public:
+    StrRef add(const string &s) {
+        auto it = seen.find(s);
+        if(it != seen.end()) return it->second;
+        StrRef ref = {static_cast<uint32_t>(bytes.size()), static_cast<uint32_t>(s.size())};
+        bytes += s;
+        seen.insert({s, ref});
+        return ref;
+    }
+    const string& data() const { return bytes; }
+};
+
+// ------------------------
+// User Directory
+// ------------------------
+// Where each user of the file the library was loaded from (users.txt or a
+// snapshot) is stored, so that a User and its Account are only built when
+// the user is first looked up. Startup then costs one small record per
+// user instead of parsing every account.
+//
+// For users.txt the directory is kept on disk next to it (users.txt.idx)
+// and reused while the size and modification time of users.txt match;
+// otherwise it is rebuilt by scanning the file for line starts. For a
+// snapshot it is computed from the fixed-size user records.
+const char USER_INDEX_MAGIC[8] = {'L', 'M', 'S', 'U', 'I', 'D', 'X', '1'};
+
+struct UserIndexHeader {
+    char magic[8];
+    uint64_t sourceSize;
+    int64_t sourceMtimeNs;
+    uint64_t count;
+};
+
+// Size and modification time of path, used to tell whether an index
+// still describes it.
+bool fileSignature(const string &path, uint64_t &size, int64_t &mtimeNs) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if(_stat64(path.c_str(), &st) != 0) return false;
+    mtimeNs = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return false;
+#ifdef __APPLE__
+    mtimeNs = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    size = st.st_size;
+    return true;
+}
+
+class UserDirectory {
+public:
+    enum SlotState : uint8_t { PENDING, LOADED, GONE };
+
+    // For users.txt, offset is the byte offset of the user's line; for a
+    // snapshot it is the index of the user's SnapUser record.
+    struct Entry {
+        int32_t id;
+        uint32_t reserved;
+        uint64_t offset;
+    };
+
+private:
+    MappedFile* source;       // snapshot sources
+    MappedFile* text;         // users.txt sources, one of textSources
+    vector<MappedFile*> textSources;
+    string path;
+    bool snapshot;
+    vector<Entry> entries;    // in file order, which is also the save order
+    vector<uint32_t> byId;    // positions in entries, ordered by id
+    vector<uint8_t> states;
+    size_t pending;
+    // Snapshot sources only.
+    const char* userRecs;
+    const char* historyRecs;
+    const char* borrowRecs;
+    const char* stringTable;
+    uint64_t stringBytes;
+    vector<uint64_t> firstHistory, firstBorrow;
+    vector<BookCopy*> snapCopies; // copy index -> copy
+
+    UserDirectory(const UserDirectory &);
+    UserDirectory& operator=(const UserDirectory &);
+
+    void sortById() {
+        byId.resize(entries.size());
+        bool sorted = true;
+        for(size_t i = 0; i < entries.size(); i++) {
+            byId[i] = static_cast<uint32_t>(i);
+            if(i > 0 && entries[i].id < entries[i - 1].id) sorted = false;
+        }
+        // Files written by this program usually list users by id already.
+        if(!sorted)
+            stable_sort(byId.begin(), byId.end(), [this](uint32_t a, uint32_t b) { return entries[a].id < entries[b].id; });
+    }
+
+    // Reads the index of text, a users.txt of the given size and mtime.
+    // The index is only a cache: if any entry does not point at the start
+    // of a line holding its id, or byId is not the entries in id order, it
+    // is treated as stale and the file is scanned instead.
+    bool readIndex(const string &indexFile, TextSpan text, uint64_t size, int64_t mtimeNs) {
+        MappedFile data(indexFile);
+        TextSpan raw = data.text();
+        UserIndexHeader header;
+        if(raw.size() < sizeof(header)) return false;
+        memcpy(&header, raw.begin, sizeof(header));
+        if(memcmp(header.magic, USER_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.sourceSize != size ||
+           header.sourceMtimeNs != mtimeNs ||
+           raw.size() != sizeof(header) + header.count * (sizeof(Entry) + sizeof(uint32_t)))
+            return false;
+        entries.resize(header.count);
+        byId.resize(header.count);
+        memcpy(entries.data(), raw.begin + sizeof(header), header.count * sizeof(Entry));
+        memcpy(byId.data(), raw.begin + sizeof(header) + header.count * sizeof(Entry), header.count * sizeof(uint32_t));
+        for(size_t i = 0; i < entries.size(); i++) {
+            uint64_t at = entries[i].offset;
+            if(at >= text.size() || (i > 0 && at <= entries[i - 1].offset) || (at > 0 && text.begin[at - 1] != '\n'))
+                return false;
+            TextSpan rest(text.begin + at, text.end), line, idField;
+            int id;
+            if(!nextLine(rest, line) || !nextField(line, '|', idField) || !parseInt(idField, id) || id != entries[i].id)
+                return false;
+        }
+        // Strictly ordered by (id, position), so also a permutation.
+        for(size_t i = 0; i < byId.size(); i++) {
+            if(byId[i] >= entries.size()) return false;
+            if(i > 0) {
+                int prev = entries[byId[i - 1]].id, cur = entries[byId[i]].id;
+                if(prev > cur || (prev == cur && byId[i - 1] >= byId[i])) return false;
+            }
+        }
+        return true;
+    }
+
+    // Only the first entry of an id (in file order) is ever read; the rest
+    // are gone from the start, so that removing that user cannot bring a
+    // later line with the same id back.
+    void dropRepeatedIds() {
+        for(size_t i = 1; i < byId.size(); i++)
+            if(entries[byId[i]].id == entries[byId[i - 1]].id)
+                setState(byId[i], GONE);
+    }
+
+    void writeIndex(const string &indexFile, uint64_t size, int64_t mtimeNs) const {
+        UserIndexHeader header;
+        memcpy(header.magic, USER_INDEX_MAGIC, sizeof(header.magic));
+        header.sourceSize = size;
+        header.sourceMtimeNs = mtimeNs;
+        header.count = entries.size();
+        string bytes;
+        bytes.reserve(sizeof(header) + entries.size() * (sizeof(Entry) + sizeof(uint32_t)));
+        bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        bytes.append(reinterpret_cast<const char*>(byId.data()), byId.size() * sizeof(uint32_t));
+        writeFileAtomically(indexFile, bytes); // only a cache; rebuilt next time if this fails
+    }
+
+public:
+    UserDirectory() : source(nullptr), text(nullptr), snapshot(false), pending(0), userRecs(nullptr),
+                      historyRecs(nullptr), borrowRecs(nullptr), stringTable(nullptr), stringBytes(0) {}
+    // Accounts read from a users.txt may still hold history records in it,
+    // so text sources are only closed along with the directory.
+    ~UserDirectory() {
+        clear();
+        for(auto src : textSources)
+            delete src;
+    }
+
+    void clear() {
+        delete source;
+        source = nullptr;
+        text = nullptr;
+        path.clear();
+        snapshot = false;
+        entries.clear();
+        byId.clear();
+        states.clear();
+        pending = 0;
+        firstHistory.clear();
+        firstBorrow.clear();
+        snapCopies.clear();
+    }
+
+    // Indexes the lines of a users.txt file. Returns false if it cannot be
+    // opened.
+    bool openText(const string &usersFile) {
+        MappedFile* data = new MappedFile(usersFile);
+        if(!data->isOpen()) {
+            delete data;
+            return false;
+        }
+        clear();
+        text = data;
+        textSources.push_back(data);
+        path = usersFile;
+        string indexFile = usersFile + ".idx";
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        bool known = fileSignature(usersFile, size, mtimeNs) && size == data->text().size();
+        if(!known || !readIndex(indexFile, data->text(), size, mtimeNs)) {
+            entries.clear();
+            byId.clear();
+            TextSpan text = data->text(), rest = text, line;
+            while(nextLine(rest, line)) {
+                int id;
+                TextSpan idField, fields = line;
+                if(nextField(fields, '|', idField) && parseInt(idField, id)) {
+                    Entry e = {id, 0, static_cast<uint64_t>(line.begin - text.begin)};
+                    entries.push_back(e);
+                }
+            }
+            sortById();
+            if(known)
+                writeIndex(indexFile, size, mtimeNs);
+        }
+        states.assign(entries.size(), PENDING);
+        pending = entries.size();
+        dropRepeatedIds();
+        return true;
+    }
+
+    // Takes over an open snapshot whose user section starts at userRecs.
+    // copies maps its copy indexes to the copies loaded from it. The
+    // caller has checked that the users' record counts add up to the
+    // header's.
+    void openSnapshot(MappedFile* data, const SnapshotHeader &header, const char* users, const char* history,
+                      const char* borrows, const char* strings, const vector<BookCopy*> &copies) {
+        clear();
+        source = data;
+        snapshot = true;
+        userRecs = users;
+        historyRecs = history;
+        borrowRecs = borrows;
+        stringTable = strings;
+        stringBytes = header.stringBytes;
+        snapCopies = copies;
+        entries.reserve(header.userCount);
+        firstHistory.reserve(header.userCount);
+        firstBorrow.reserve(header.userCount);
+        uint64_t nextHistory = 0, nextBorrow = 0;
+        for(uint32_t i = 0; i < header.userCount; i++) {
+            SnapUser su;
+            memcpy(&su, userRecs + i * sizeof(SnapUser), sizeof(su));
+            Entry e = {su.id, 0, i};
+            entries.push_back(e);
+            firstHistory.push_back(nextHistory);
+            firstBorrow.push_back(nextBorrow);
+            nextHistory += su.historyCount;
+            nextBorrow += su.borrowCount;
+        }
+        sortById();
+        states.assign(entries.size(), PENDING);
+        pending = entries.size();
+        dropRepeatedIds();
+    }
+
+    bool isSnapshot() const { return snapshot; }
+    const string& sourcePath() const { return path; }
+    // users.txt sources: the books its records resolve against.
+    size_t sourceBytes() const { return source ? source->text().size() : text ? text->text().size() : 0; }
+    size_t size() const { return entries.size(); }
+    size_t pendingCount() const { return pending; }
+    int idAt(size_t pos) const { return entries[pos].id; }
+    SlotState state(size_t pos) const { return static_cast<SlotState>(states[pos]); }
+
+    void setState(size_t pos, SlotState s) {
+        if(states[pos] == PENDING && s != PENDING) pending--;
+        states[pos] = s;
+    }
+
+    // Position of the first entry with this id, or -1.
+    long find(int id) const {
+        auto it = lower_bound(byId.begin(), byId.end(), id,
+                              [this](uint32_t pos, int key) { return entries[pos].id < key; });
+        return (it != byId.end() && entries[*it].id == id) ? static_cast<long>(*it) : -1;
+    }
+
+    bool isPending(int id) const {
+        long pos = find(id);
+        return pos >= 0 && states[pos] == PENDING;
+    }
+
+    // users.txt sources: the line of the entry at pos.
+    TextSpan lineAt(size_t pos) const {
+        TextSpan rest = text->text(), line;
+        rest.begin += entries[pos].offset;
+        nextLine(rest, line);
+        return line;
+    }
+
+    // Snapshot sources: the records of the entry at pos.
+    SnapUser userAt(size_t pos) const {
+        SnapUser su;
+        memcpy(&su, userRecs + entries[pos].offset * sizeof(SnapUser), sizeof(su));
+        return su;
+    }
+    SnapHistory historyAt(size_t pos, uint32_t k) const {
+        SnapHistory sh;
+        memcpy(&sh, historyRecs + (firstHistory[pos] + k) * sizeof(SnapHistory), sizeof(sh));
+        return sh;
+    }
+    SnapBorrow borrowAt(size_t pos, uint32_t k) const {
+        SnapBorrow sb;
+        memcpy(&sb, borrowRecs + (firstBorrow[pos] + k) * sizeof(SnapBorrow), sizeof(sb));
+        return sb;
+    }
+    BookCopy* copyAt(uint32_t index) const { return index < snapCopies.size() ? snapCopies[index] : nullptr; }
+    string str(StrRef r) const {
+        if((uint64_t)r.offset + r.length > stringBytes) return string();
+        return string(stringTable + r.offset, r.length);
+    }
+};
+
+// ------------------------
+// Write-Ahead Journal
+// ------------------------
+// Every mutation is appended as one line "seq|OP|field|..." and made
+// durable before the call that made it returns. A writer thread takes
+// whatever lines are queued and flushes them with one write + fsync
+// (group commit), so bursts of mutations share the cost of a flush.
+string journalEscape(const string &text) {
+    string out;
+    out.reserve(text.size());
+    for(char c : text) {
+        if(c == '\\') out += "\\\\";
+        else if(c == '|') out += "\\p";
+        else if(c == '\n') out += "\\n";
+        else if(c == '\r') out += "\\r";
+        else out += c;
+    }
+    return out;
+}
+
+string journalUnescape(TextSpan text) {
+    string out;
+    out.reserve(text.size());
+    for(const char* p = text.begin; p != text.end; p++) {
+        if(*p != '\\' || p + 1 == text.end) { out += *p; continue; }
+        char c = *++p;
+        out += (c == 'p') ? '|' : (c == 'n') ? '\n' : (c == 'r') ? '\r' : c;
+    }
+    return out;
+}
+
+class Journal {
+private:
+    string path;
+    FILE* file;
+    thread writer;
+    mutex lock;
+    condition_variable queued, flushed;
+    string pending;       // formatted records not yet handed to the writer
+    uint64_t nextSeq;     // sequence number of the next record
+    uint64_t durableSeq;  // every record up to this one is on disk
+    bool stopping;
+    bool failed;
+
+    Journal(const Journal &);
+    Journal& operator=(const Journal &);
+
+    void writerLoop() {
+        unique_lock<mutex> guard(lock);
+        while(true) {
+            queued.wait(guard, [this] { return stopping || !pending.empty(); });
+            if(pending.empty()) break; // stopping with nothing left to write
+            string batch;
+            batch.swap(pending);
+            uint64_t batchEnd = nextSeq - 1;
+            guard.unlock();
+            bool ok = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && syncFile(file);
+            guard.lock();
+            if(!ok) failed = true;
+            durableSeq = batchEnd;
+            flushed.notify_all();
+        }
+    }
+
+public:
+    Journal() : file(nullptr), nextSeq(1), durableSeq(0), stopping(false), failed(false) {}
+    ~Journal() { close(); }
+
+    bool isOpen() const { return file != nullptr; }
+    const string& getPath() const { return path; }
+
+    // Opens (or creates) the journal for appending; firstSeq is the
+    // sequence number the next record will get.
+    bool open(const string &journalPath, uint64_t firstSeq) {
+        close();
+        file = fopen(journalPath.c_str(), "ab");
+        if(!file) return false;
+        path = journalPath;
+        nextSeq = firstSeq;
+        durableSeq = firstSeq - 1;
+        stopping = false;
+        failed = false;
+        writer = thread(&Journal::writerLoop, this);
+        return true;
+    }
+
+    // Writes out everything still queued and closes the file.
+    void close() {
+        if(!file) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        queued.notify_one();
+        writer.join();
+        fclose(file);
+        file = nullptr;
+    }
+
+    // Queues one record and returns its sequence number without waiting.
+    uint64_t append(const string &body) {
+        lock_guard<mutex> guard(lock);
+        uint64_t seq = nextSeq++;
+        pending += to_string(seq);
+        pending += '|';
+        pending += body;
+        pending += '\n';
+        queued.notify_one();
+        return seq;
+    }
+
+    // Blocks until record seq is on disk. Returns false if a flush failed.
+    bool waitDurable(uint64_t seq) {
+        unique_lock<mutex> guard(lock);
+        flushed.wait(guard, [this, seq] { return durableSeq >= seq; });
+        return !failed;
+    }
+
+    bool commit(const string &body) { return waitDurable(append(body)); }
+
+    uint64_t lastSeq() {
+        lock_guard<mutex> guard(lock);
+        return nextSeq - 1;
+    }
+
+    // Moves the current segment aside to rotatedPath and continues in a
+    // fresh, empty segment with the same sequence numbering.
+    bool rotate(const string &rotatedPath) {
+        uint64_t next = nextSeq;
+        close();
+        if(rename(path.c_str(), rotatedPath.c_str()) != 0) {
+            open(path, next);
+            return false;
+        }
+        return open(path, next);
+    }
+
+    // Drops every record written so far; used once a snapshot covers them.
+    bool truncate() {
+        uint64_t next = nextSeq;
+        string p = path;
+        close();
+        remove(p.c_str());
+        return open(p, next);
+    }
+};
+
+// Journal records written since the last checkpoint before a background
+// compaction into a new snapshot is started.
+const size_t JOURNAL_COMPACT_THRESHOLD = 50000;
+
+// ------------------------
+// Locking Primitives
+// ------------------------
+// Reader-writer lock: any number of shared holders or one exclusive holder.
+// Readers are preferred, so a thread may take the shared side again while
+// already holding it.
+class RWLock {
+private:
+    mutex lock;
+    condition_variable released;
+    int readers;
+    bool writer;
+
+    RWLock(const RWLock &);
+    RWLock& operator=(const RWLock &);
+
+public:
+    RWLock() : readers(0), writer(false) {}
+
+    void lockShared() {
+        unique_lock<mutex> guard(lock);
+        released.wait(guard, [this] { return !writer; });
+        readers++;
+    }
+
+    void unlockShared() {
+        lock_guard<mutex> guard(lock);
+        if(--readers == 0) released.notify_all();
+    }
+
+    void lockExclusive() {
+        unique_lock<mutex> guard(lock);
+        released.wait(guard, [this] { return !writer && readers == 0; });
+        writer = true;
+    }
+
+    void unlockExclusive() {
+        lock_guard<mutex> guard(lock);
+        writer = false;
+        released.notify_all();
+    }
+};
+
+class ReadGuard {
+    RWLock &rw;
+public:
+    explicit ReadGuard(RWLock &l) : rw(l) { rw.lockShared(); }
+    ~ReadGuard() { rw.unlockShared(); }
+};
+
+class WriteGuard {
+    RWLock &rw;
+public:
+    explicit WriteGuard(RWLock &l) : rw(l) { rw.lockExclusive(); }
+    ~WriteGuard() { rw.unlockExclusive(); }
+};
+
+// A fixed set of mutexes shared out by hashing, so every book and account
+// gets a lock without storing one per object. A book's copies go by the
+// lock of their book.
+class LockStripes {
+public:
+    static const size_t STRIPES = 64;
+    static size_t stripeOf(const Book* book) { return (reinterpret_cast<uintptr_t>(book) >> 4) % STRIPES; }
+
+    mutex& forBook(const Book* book) { return stripes[stripeOf(book)]; }
+    mutex& forUser(int id) { return stripes[static_cast<unsigned>(id) % STRIPES]; }
+    mutex& at(size_t i) { return stripes[i]; }
+private:
+    mutex stripes[STRIPES];
+};
+
+// Holds two stripe locks at once (or one, if both map to the same stripe)
+// without risking lock-order deadlocks.
+class PairGuard {
+    mutex &first, &second;
+public:
+    PairGuard(mutex &a, mutex &b) : first(a), second(b) {
+        if(&first == &second) first.lock();
+        else std::lock(first, second);
+    }
+    ~PairGuard() {
+        first.unlock();
+        if(&second != &first) second.unlock();
+    }
+};
+
+// ------------------------
+// Due-Date Queue
+// ------------------------
+// Every active loan in the library, ordered by due date (then user and
+// copy), so overdue and due-soon reports touch only the loans they return
+// instead of walking every account.
+struct DueLoan {
+    int dueDate;
+    int userId;
+    BookCopy* copy;
+
+    bool operator<(const DueLoan &o) const {
+        if(dueDate != o.dueDate) return dueDate < o.dueDate;
+        if(userId != o.userId) return userId < o.userId;
+        return less<const BookCopy*>()(copy, o.copy);
+    }
+};
+
+class DueDateQueue {
+private:
+    multiset<DueLoan> loans;
+public:
+    void add(int userId, BookCopy* copy, int dueDate) {
+        DueLoan loan = {dueDate, userId, copy};
+        loans.insert(loan);
+    }
+
+    void remove(int userId, BookCopy* copy, int dueDate) {
+        DueLoan loan = {dueDate, userId, copy};
+        auto it = loans.find(loan);
+        if(it != loans.end()) loans.erase(it);
+    }
+
+    // Loans due on days [firstDay, lastDay], earliest first.
+    vector<DueLoan> dueBetween(int firstDay, int lastDay) const {
+        DueLoan from = {firstDay, numeric_limits<int>::min(), nullptr};
+        vector<DueLoan> result;
+        for(auto it = loans.lower_bound(from); it != loans.end() && it->dueDate <= lastDay; ++it)
+            result.push_back(*it);
+        return result;
+    }
+
+    size_t size() const { return loans.size(); }
+    void clear() { loans.clear(); }
+};
+
+// ------------------------
+// Hold Queues
+// ------------------------
+// Patrons waiting for a book whose copies are all out. When a copy comes
+// back it is set aside (RESERVED) for the first patron in line, who then
+// has HOLD_PICKUP_DAYS to borrow it before it passes to the next one.
+// Several copies of a book may be set aside at once, each for its own
+// patron.
+const int HOLD_PICKUP_DAYS = 3;
+
+enum HoldOutcome { HOLD_PLACED, HOLD_NOT_NEEDED, HOLD_DUPLICATE, HOLD_DENIED };
+
+struct Hold {
+    int userId;
+    int day; // day the hold was placed
+};
+
+// A copy set aside for userId.
+struct Pickup {
+    int userId;
+    int until;      // last day userId can collect it
+    BookCopy* copy;
+};
+
+struct HoldQueue {
+    deque<Hold> waiting;        // oldest first
+    unordered_set<int> members; // user ids in waiting
+    vector<Pickup> ready;       // copies set aside
+
+    bool empty() const { return ready.empty() && waiting.empty(); }
+    bool has(int userId) const { return pickupFor(userId) || members.count(userId) > 0; }
+
+    // The copy set aside for userId, or nullptr.
+    const Pickup* pickupFor(int userId) const {
+        for(auto &p : ready)
+            if(p.userId == userId) return &p;
+        return nullptr;
+    }
+
+    void push(int userId, int day) {
+        Hold h = {userId, day};
+        waiting.push_back(h);
+        members.insert(userId);
+    }
+
+    // Sets copy aside for the next patron in line, from day on. Returns
+    // false if nobody is waiting.
+    bool handOff(BookCopy* copy, int day) {
+        if(waiting.empty()) return false;
+        Pickup p = {waiting.front().userId, day + HOLD_PICKUP_DAYS - 1, copy};
+        members.erase(p.userId);
+        waiting.pop_front();
+        ready.push_back(p);
+        return true;
+    }
+
+    // Drops the pickup of copy by userId once it is collected. Returns
+    // false if copy was not set aside for userId.
+    bool collect(int userId, const BookCopy* copy) {
+        for(auto it = ready.begin(); it != ready.end(); ++it)
+            if(it->userId == userId && it->copy == copy) {
+                ready.erase(it);
+                return true;
+            }
+        return false;
+    }
+
+    // Passes uncollected copies down the line as of today, the one that
+    // lapsed first first. Each patron gets a full window starting the day
+    // after the previous one lapsed, so the result does not depend on when
+    // this is called. Copies nobody is left waiting for are appended to
+    // released. Returns false if no pickup had lapsed.
+    bool expire(int today, vector<BookCopy*> &released) {
+        bool lapsed = false;
+        while(true) {
+            size_t next = ready.size();
+            for(size_t i = 0; i < ready.size(); i++)
+                if(ready[i].until < today && (next == ready.size() || ready[i].until < ready[next].until))
+                    next = i;
+            if(next == ready.size()) return lapsed;
+            lapsed = true;
+            Pickup &p = ready[next];
+            if(waiting.empty()) {
+                released.push_back(p.copy);
+                ready.erase(ready.begin() + next);
+                continue;
+            }
+            p.userId = waiting.front().userId;
+            p.until += HOLD_PICKUP_DAYS;
+            members.erase(p.userId);
+            waiting.pop_front();
+        }
+    }
+
+    // The pickups in copy order, as they are saved.
+    vector<Pickup> pickupsByCopy() const {
+        vector<Pickup> sorted(ready);
+        sort(sorted.begin(), sorted.end(),
+             [](const Pickup &a, const Pickup &b) { return a.copy->copyNumber() < b.copy->copyNumber(); });
+        return sorted;
+    }
+
+    // Passes the copies set aside for userId, who is leaving, down the line
+    // as if their pickups had lapsed, except that the next patron may
+    // collect at once. Copies nobody is waiting for are appended to
+    // released. Returns false if nothing was set aside for userId.
+    bool passOnPickups(int userId, vector<BookCopy*> &released) {
+        bool found = false;
+        for(size_t i = 0; i < ready.size();) {
+            Pickup &p = ready[i];
+            if(p.userId != userId) {
+                i++;
+                continue;
+            }
+            found = true;
+            if(waiting.empty()) {
+                released.push_back(p.copy);
+                ready.erase(ready.begin() + i);
+                continue;
+            }
+            p.userId = waiting.front().userId;
+            p.until += HOLD_PICKUP_DAYS;
+            members.erase(p.userId);
+            waiting.pop_front();
+            i++;
+        }
+        return found;
+    }
+
+    // Drops userId from the line (a copy already set aside for them still
+    // lapses normally). Returns false if they were not waiting.
+    bool removeWaiting(int userId) {
+        if(!members.erase(userId)) return false;
+        for(auto it = waiting.begin(); it != waiting.end(); ++it)
+            if(it->userId == userId) {
+                waiting.erase(it);
+                break;
+            }
+        return true;
+    }
+};
+
+// Hold queues by book, split into the same stripes as the book locks so
+// that a book's queue is guarded by that book's stripe lock.
+class HoldTable {
+private:
+    unordered_map<Book*, HoldQueue> shards[LockStripes::STRIPES];
+public:
+    HoldQueue* find(Book* book) {
+        auto &shard = shards[LockStripes::stripeOf(book)];
+        auto it = shard.find(book);
+        return (it != shard.end()) ? &it->second : nullptr;
+    }
+    HoldQueue& get(Book* book) { return shards[LockStripes::stripeOf(book)][book]; }
+    void erase(Book* book) { shards[LockStripes::stripeOf(book)].erase(book); }
+
+    // The queues guarded by stripe i.
+    unordered_map<Book*, HoldQueue>& stripe(size_t i) { return shards[i]; }
+
+    void clear() {
+        for(auto &shard : shards)
+            shard.clear();
+    }
+};
+
+// ------------------------
+// Fine Accrual
+// ------------------------
+// Active loans flattened into contiguous arrays for the nightly accrual
+// pass. Loans are grouped by account: the loans of userIds[u] are
+// [firstLoan[u], firstLoan[u + 1]).
+struct LoanColumns {
+    vector<int> userIds;
+    vector<uint32_t> firstLoan;
+    vector<int32_t> dueDates;
+    vector<int32_t> dailyRates; // fine per day overdue of the borrower's role
+};
+
+// Overdue-day histogram buckets: 1-7, 8-14, 15-30, 31-60, 61-90, over 90.
+const int ACCRUAL_BUCKETS = 6;
+const char* const ACCRUAL_BUCKET_NAMES[ACCRUAL_BUCKETS] = {"1-7", "8-14", "15-30", "31-60", "61-90", "91+"};
+
+struct FineAccrual {
+    vector<int64_t> accruedByUser; // parallel to LoanColumns::userIds
+    vector<int32_t> accruedByLoan; // parallel to LoanColumns::dueDates
+    int64_t totalAccrued;
+    uint64_t overdueLoans;
+    uint64_t histogram[ACCRUAL_BUCKETS];
+};
+
+// Computes the fines every active loan has accrued as of day (what it
+// would be charged if returned then), per loan, per account and in total,
+// along with a histogram of days overdue. The per-loan loop is branch-free
+// over int32 arrays so the compiler can vectorize it (-O3, or -O2
+// -ftree-vectorize); the per-account sums then read contiguous ranges of
+// its output.
+void accrueFines(const LoanColumns &loans, int day, FineAccrual &out) {
+    size_t n = loans.dueDates.size();
+    out.accruedByLoan.resize(n);
+    const int32_t* due = loans.dueDates.data();
+    const int32_t* rate = loans.dailyRates.data();
+    int32_t* fine = out.accruedByLoan.data();
+    int64_t total = 0;
+    uint64_t atLeast1 = 0, atLeast8 = 0, atLeast15 = 0, atLeast31 = 0, atLeast61 = 0, atLeast91 = 0;
+    for(size_t i = 0; i < n; i++) {
+        int32_t overdue = day - due[i];
+        overdue = overdue > 0 ? overdue : 0;
+        int32_t f = overdue * rate[i];
+        fine[i] = f;
+        total += f;
+        atLeast1 += overdue >= 1;
+        atLeast8 += overdue >= 8;
+        atLeast15 += overdue >= 15;
+        atLeast31 += overdue >= 31;
+        atLeast61 += overdue >= 61;
+        atLeast91 += overdue >= 91;
+    }
+    out.totalAccrued = total;
+    out.overdueLoans = atLeast1;
+    uint64_t atLeast[ACCRUAL_BUCKETS + 1] = {atLeast1, atLeast8, atLeast15, atLeast31, atLeast61, atLeast91, 0};
+    for(int b = 0; b < ACCRUAL_BUCKETS; b++)
+        out.histogram[b] = atLeast[b] - atLeast[b + 1];
+
+    size_t users = loans.userIds.size();
+    out.accruedByUser.assign(users, 0);
+    for(size_t u = 0; u < users; u++) {
+        int64_t sum = 0;
+        for(uint32_t i = loans.firstLoan[u]; i < loans.firstLoan[u + 1]; i++)
+            sum += fine[i];
+        out.accruedByUser[u] = sum;
+    }
+}
+
+// ------------------------
+// Incremental Text Saves
+// ------------------------
+// saveData writes books.txt and users.txt in segments of
+// SAVE_SEGMENT_RECORDS consecutive slots (catalog rows for books, save
+// slots for users). SaveLayout remembers where each segment ended in the
+// file it last wrote, with a dirty flag per segment that the library sets
+// whenever a record in it changes. The next save to the same, unmodified
+// file copies the clean segments over from the old file and only formats
+// the dirty ones, and skips the write altogether if nothing changed. The
+// file is still replaced as a whole through AtomicFileWriter.
+const uint32_t SAVE_SEGMENT_RECORDS = 64;
+
+class SaveLayout {
+private:
+    string path;
+    uint64_t fileSize;
+    int64_t fileMtimeNs;
+    bool valid;
+    vector<uint64_t> ends;  // end offset of each segment in the file
+    atomic<uint8_t>* dirty; // one flag per segment, set concurrently by borrowers
+
+    SaveLayout(const SaveLayout &);
+    SaveLayout& operator=(const SaveLayout &);
+
+public:
+    SaveLayout() : fileSize(0), fileMtimeNs(0), valid(false), dirty(nullptr) {}
+    ~SaveLayout() { delete[] dirty; }
+
+    // Forgets the last save, so that the next one writes every segment.
+    void reset() { valid = false; }
+
+    void markDirty(uint32_t slot) {
+        size_t seg = slot / SAVE_SEGMENT_RECORDS;
+        if(valid && seg < ends.size())
+            dirty[seg].store(1, memory_order_relaxed);
+    }
+
+    // True if file is the one last saved and has not been changed since.
+    bool describes(const string &file) const {
+        uint64_t size;
+        int64_t mtimeNs;
+        return valid && file == path && fileSignature(file, size, mtimeNs) && size == fileSize &&
+               mtimeNs == fileMtimeNs;
+    }
+
+    // Saves segments [0, segments) to file, calling
+    // writeSegment(segment, out) for the ones that have to be formatted.
+    // Called with no concurrent markDirty. Returns false, leaving file and
+    // the layout as they were, if the file could not be written.
+    template <class WriteSegment>
+    bool save(const string &file, size_t segments, WriteSegment writeSegment) {
+        bool reuse = describes(file);
+        if(reuse && segments == ends.size()) {
+            bool changed = false;
+            for(size_t s = 0; s < segments && !changed; s++)
+                changed = dirty[s].load(memory_order_relaxed) != 0;
+            if(!changed) return true;
+        }
+        // The mapping stays readable after the new file is renamed over it.
+        MappedFile old(reuse ? file : string());
+        reuse = reuse && old.isOpen() && old.text().size() == fileSize;
+        AtomicFileWriter out(file);
+        if(!out.isOpen()) return false;
+        vector<uint64_t> written(segments);
+        for(size_t s = 0; s < segments; s++) {
+            if(reuse && s < ends.size() && !dirty[s].load(memory_order_relaxed)) {
+                uint64_t from = s == 0 ? 0 : ends[s - 1];
+                out.append(old.text().begin + from, ends[s] - from);
+            } else {
+                writeSegment(s, out);
+            }
+            written[s] = out.size();
+        }
+        if(!out.commit()) return false;
+
+        if(segments != ends.size()) {
+            delete[] dirty;
+            dirty = segments ? new atomic<uint8_t>[segments]() : nullptr;
+        }
+        for(size_t s = 0; s < segments; s++)
+            dirty[s].store(0, memory_order_relaxed);
+        ends.swap(written);
+        path = file;
+        valid = fileSignature(file, fileSize, fileMtimeNs);
+        return true;
+    }
+};
+
+// ------------------------
+// Sharded Text Files
+// ------------------------
+// An optional layout for large libraries: the books are spread over
+// several files in the books.txt format by a hash of the ISBN, the users
+// over several files in the users.txt format by ID range, and a manifest
+// (library.shards) lists them:
+//   LMS-SHARDS 1
+//   generation 3
+//   book library.3.books.0.txt
+//   user library.3.users.0.txt 1000      (the lowest ID in the shard)
+// Shard paths are relative to the manifest's directory. A save writes a
+// complete new generation next to the old one, switches over by
+// replacing the manifest and then deletes the old generation, so readers
+// never see a mix of the two. Shards are read and written concurrently.
+const char* const SHARD_MANIFEST = "library.shards";
+const uint32_t DEFAULT_SHARDS = 8;
+
+struct ShardManifest {
+    uint64_t generation;
+    vector<string> bookFiles, userFiles;
+    vector<int> userFirstIds; // by user shard
+    ShardManifest() : generation(0) {}
+};
+
+// The shard a book belongs in.
+uint32_t bookShardOf(uint64_t isbnCode, uint32_t shards) {
+    return static_cast<uint32_t>(((isbnCode * 0x9E3779B97F4A7C15ULL) >> 32) % shards);
+}
+
+// Path of a file named in the manifest at manifestPath.
+string shardPath(const string &manifestPath, const string &name) {
+    size_t slash = manifestPath.find_last_of("/\\");
+    return slash == string::npos ? name : manifestPath.substr(0, slash + 1) + name;
+}
+
+// Reads a manifest. Returns false if there is none; a file that is not a
+// manifest is reported as well.
+bool readShardManifest(const string &path, ShardManifest &m) {
+    MappedFile file(path);
+    if(!file.isOpen()) return false;
+    TextSpan rest = file.text(), line;
+    bool header = nextLine(rest, line) && line.equals("LMS-SHARDS 1");
+    while(header && nextLine(rest, line)) {
+        TextSpan key, name, first;
+        int id;
+        if(!nextField(line, ' ', key) || !nextField(line, ' ', name)) {
+            header = false;
+        } else if(key.equals("generation")) {
+            m.generation = strtoull(name.str().c_str(), nullptr, 10);
+        } else if(key.equals("book")) {
+            m.bookFiles.push_back(name.str());
+        } else if(key.equals("user") && nextField(line, ' ', first) && parseInt(first, id)) {
+            m.userFiles.push_back(name.str());
+            m.userFirstIds.push_back(id);
+        } else {
+            header = false;
+        }
+    }
+    // User shards split the IDs into ranges in order.
+    for(size_t s = 1; header && s < m.userFirstIds.size(); s++)
+        header = m.userFirstIds[s] > m.userFirstIds[s - 1];
+    if(!header || m.bookFiles.empty() || m.userFiles.empty()) {
+        cout << path << " is not a shard manifest.\n";
+        return false;
+    }
+    return true;
+}
+
+bool writeShardManifest(const string &path, const ShardManifest &m) {
+    string text = "LMS-SHARDS 1\ngeneration " + to_string(m.generation) + "\n";
+    for(auto &name : m.bookFiles)
+        text += "book " + name + "\n";
+    for(size_t i = 0; i < m.userFiles.size(); i++)
+        text += "user " + m.userFiles[i] + " " + to_string(m.userFirstIds[i]) + "\n";
+    return writeFileAtomically(path, text);
+}
+
+// Runs task(0) .. task(tasks - 1) on up to `threads` threads (0 for one
+// per core), each thread taking the next task as it finishes one.
+template <class Task>
+void runParallel(size_t tasks, size_t threads, Task task) {
+    if(threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = min(threads, tasks);
+    atomic<size_t> next(0);
+    auto worker = [&next, tasks, &task]() {
+        for(size_t t = next++; t < tasks; t = next++)
+            task(t);
+    };
+    vector<thread> workers;
+    for(size_t i = 1; i < threads; i++)
+        workers.push_back(thread(worker));
+    worker();
+    for(auto &w : workers)
+        w.join();
+}
+
+// ------------------------
+// Library Class Definition
+// ------------------------
+class Library {
+private:
+    // Book data lives in the columnar store, whose Book and BookCopy views
+    // keep their addresses while the catalog grows; BorrowInfo/HistoryRecord
+    // keep raw BookCopy* into it. Removed books stay in the store as retired
+    // rows, since history records of past loans may still point at them.
+    // Each ISBN is one book with one or more copies.
+    CatalogStore catalog;
+    vector<Book*> books; // the books currently in the catalog, in order
+    unordered_map<uint64_t, Book*> isbnIndex; // ISBN code -> book
+    // ISBN code -> the first book removed under it since the catalog was
+    // loaded. Accounts read later, and history records left in users.txt,
+    // resolve through both maps (accountBooks), so that they still find
+    // the books they were written against.
+    unordered_map<uint64_t, Book*> removedIsbns;
+    IsbnResolver accountBooks;
+    BookSearchIndex searchIndex;
+    // Sorted orders for paged listing, built on first use (see listBooks).
+    mutable BookListing listing;
+    vector<User*> users; // stored as pointers
+    unordered_map<int, User*> userIndex; // user ID -> user
+    // Users of the loaded file whose accounts have not been read yet; they
+    // join users/userIndex when first looked up (see findUserById).
+    UserDirectory directory;
+    // Removed users are kept alive as well, as another session may still
+    // hold a pointer to them.
+    vector<User*> retiredUsers;
+    // Active loans of all users by due date; updated together with the
+    // accounts, under its own mutex since borrowers of different books
+    // reach it concurrently.
+    DueDateQueue dueQueue;
+    mutable mutex dueLock;
+    // Hold queues by book, each guarded by its book's stripe lock.
+    HoldTable holds;
+    // What the last saveData wrote, so that the next one only formats the
+    // books and users changed since (see SaveLayout). Books are marked by
+    // catalog row, users by save slot; nextUserSlot goes to the next user
+    // added.
+    SaveLayout bookLayout, userLayout;
+    uint32_t nextUserSlot;
+
+    // Locking: catalogLock is held shared by every lookup and circulation
+    // operation and exclusively by anything that adds, removes or renames
+    // books and users, or reads the whole library at once (snapshots,
+    // saveData). Loans and fines are guarded by the stripe locks of the book
+    // and account involved, so borrowers of different books do not contend;
+    // the lock of a book also guards the status of its copies.
+    // Loading (loadData, loadSnapshot, openJournal) happens before the
+    // library is shared and takes no locks.
+    mutable RWLock catalogLock;
+    mutable LockStripes bookLocks;
+    mutable LockStripes accountLocks;
+
+    // Persistence state: the snapshot the journal is checkpointed into and
+    // the last journal record already reflected in memory.
+    Journal journal;
+    string snapshotFile;
+    uint64_t baseSeq;
+    atomic<size_t> recordsSinceCheckpoint;
+    thread compactor;
+    atomic<bool> compacting;
+    mutex compactionLock; // serializes starting compactions and checkpoints
+    bool waitForEachRecord; // false while batch work defers durability to flushJournal()
+
+    // Queues a mutation in the journal, if one is open, and returns its
+    // sequence number (0 without a journal). Called with the locks of the
+    // mutation held so that records of one book or account keep their order.
+    uint64_t logMutation(const string &body) {
+        if(!journal.isOpen()) return 0;
+        recordsSinceCheckpoint++;
+        return journal.append(body);
+    }
+
+    // Finishes a mutation once its locks are released: waits for its
+    // journal record to be durable and starts a compaction when due.
+    void settle(uint64_t seq) {
+        if(seq != 0 && waitForEachRecord && !journal.waitDurable(seq))
+            cout << "Warning: could not write to journal " << journal.getPath() << ".\n";
+        if(recordsSinceCheckpoint < JOURNAL_COMPACT_THRESHOLD || compacting) return;
+        unique_lock<mutex> guard(compactionLock, try_to_lock);
+        if(guard.owns_lock() && recordsSinceCheckpoint >= JOURNAL_COMPACT_THRESHOLD)
+            compactInBackground();
+    }
+
+    // Marks a book's or user's line in the text files as changed.
+    void touchBook(const Book* book) { bookLayout.markDirty(book->catalogRow()); }
+    void touchUser(const User* user) { userLayout.markDirty(user->getSaveSlot()); }
+
+    // Sets a copy's status and moves its book in the status listing if
+    // the book's own status changed. Called with the book's lock held.
+    void setCopyStatus(BookCopy* copy, BookStatus status) {
+        copy->setStatus(status);
+        listing.statusChanged(copy->book());
+        touchBook(copy->book());
+    }
+
+    // Marks the copy borrowed and records the loan; the caller holds the
+    // book and account locks.
+    uint64_t lend(User* user, BookCopy* copy, int borrowDate, int dueDate) {
+        Book* book = copy->book();
+        HoldQueue* q = refreshHolds(book, borrowDate);
+        if(q) {
+            // A patron still in line who gets a copy that came in meanwhile
+            // leaves the line too, or a second copy would be set aside.
+            q->collect(user->getId(), copy);
+            q->removeWaiting(user->getId());
+            if(q->empty())
+                holds.erase(book);
+        }
+        setCopyStatus(copy, BORROWED);
+        user->getAccount().addBorrowedBook(copy, borrowDate, dueDate);
+        touchUser(user);
+        {
+            lock_guard<mutex> due(dueLock);
+            dueQueue.add(user->getId(), copy, dueDate);
+        }
+        return logMutation("BORROW|" + to_string(user->getId()) + "|" + journalEscape(book->getISBN()) + "|" +
+                           to_string(borrowDate) + "|" + to_string(dueDate) + "|" + to_string(copy->copyNumber()));
+    }
+
+    // Ends the user's loan of copy, which is due on dueDate, and sets the
+    // copy aside for the first patron waiting for its book, if any. The
+    // caller holds the book and account locks.
+    uint64_t giveBack(User* user, BookCopy* copy, int dueDate, int returnDate) {
+        int finePerDay = user->finePerDay();
+        user->getAccount().returnBorrowedBook(copy, returnDate, finePerDay);
+        touchUser(user);
+        {
+            lock_guard<mutex> due(dueLock);
+            dueQueue.remove(user->getId(), copy, dueDate);
+        }
+        setCopyStatus(copy, AVAILABLE);
+        HoldQueue* q = refreshHolds(copy->book(), returnDate);
+        if(q && q->handOff(copy, returnDate))
+            setCopyStatus(copy, RESERVED);
+        return logMutation("RETURN|" + to_string(user->getId()) + "|" + journalEscape(copy->book()->getISBN()) + "|" +
+                           to_string(returnDate) + "|" + (finePerDay == 0 ? "1" : "0") + "|" +
+                           to_string(copy->copyNumber()));
+    }
+
+    // Passes uncollected copies of book down its hold line as of day and
+    // puts the ones nobody is waiting for back on the shelf. Returns the
+    // book's queue, or nullptr if nobody is waiting. Called with the
+    // book's lock held.
+    HoldQueue* refreshHolds(Book* book, int day) {
+        HoldQueue* q = holds.find(book);
+        if(!q) return nullptr;
+        vector<BookCopy*> released;
+        if(q->expire(day, released))
+            touchBook(book);
+        for(auto copy : released)
+            setCopyStatus(copy, AVAILABLE);
+        if(q->empty()) {
+            holds.erase(book);
+            return nullptr;
+        }
+        return q;
+    }
+
+    // Adds a copy to the catalog, and its book first if the ISBN is new;
+    // a known ISBN keeps the book's title, author and so on. Called with
+    // catalogLock held exclusively, or while loading.
+    BookCopy* insertCopy(const BookRecord &rec) {
+        uint64_t code = catalog.encodeISBN(rec.isbn);
+        auto it = isbnIndex.find(code);
+        Book* book;
+        if(it != isbnIndex.end()) {
+            book = it->second;
+        } else {
+            book = catalog.addTitle(rec);
+            books.push_back(book);
+            isbnIndex.insert({code, book});
+            searchIndex.add(book);
+            listing.add(book);
+        }
+        BookCopy* copy = catalog.addCopy(book, rec.status);
+        listing.statusChanged(book);
+        touchBook(book);
+        return copy;
+    }
+
+    // The fields of one books.txt line, pointing into the file.
+    struct BookLine {
+        TextSpan title, author, publisher, isbn, statuses, holds;
+        int year;
+    };
+
+    // Splits a books.txt line; returns false if it is malformed. One
+    // status digit per copy; older files have one line per copy, and lines
+    // repeating an ISBN add copies to its book.
+    static bool parseBookLine(TextSpan line, BookLine &out) {
+        TextSpan yearStr;
+        if(!nextField(line, ',', out.title) || !nextField(line, ',', out.author) ||
+           !nextField(line, ',', out.publisher) || !nextField(line, ',', yearStr) || !nextField(line, ',', out.isbn) ||
+           !nextField(line, ',', out.statuses) || !parseInt(yearStr, out.year) || out.statuses.empty())
+            return false;
+        for(const char* p = out.statuses.begin; p != out.statuses.end; p++)
+            if(*p < '0' || *p > '0' + RESERVED) return false;
+        out.holds = line;
+        return true;
+    }
+
+    // Adds the copies and holds of a parsed books.txt line; the caller
+    // calls matchLoadedPickups once every line is in.
+    void addBookLine(const BookLine &line) {
+        BookRecord rec(line.title.str(), line.author.str(), line.publisher.str(), line.year, line.isbn.str());
+        BookCopy* copy = nullptr;
+        for(const char* p = line.statuses.begin; p != line.statuses.end; p++) {
+            rec.status = static_cast<BookStatus>(*p - '0');
+            copy = insertCopy(rec);
+        }
+        TextSpan rest = line.holds, hold;
+        while(nextField(rest, ';', hold)) {
+            TextSpan userField;
+            bool ready = !hold.empty() && *hold.begin == '*';
+            if(ready) hold.begin++;
+            int userId, day;
+            if(!nextField(hold, ':', userField) || !parseInt(userField, userId) || !parseInt(hold, day))
+                continue;
+            restoreHold(copy->book(), userId, day, ready);
+        }
+    }
+
+    // Adds a hold read from a file to book's queue; set-aside entries get
+    // their copies from matchLoadedPickups.
+    void restoreHold(Book* book, int userId, int day, bool ready) {
+        HoldQueue &q = holds.get(book);
+        if(q.has(userId)) return;
+        if(ready) {
+            Pickup p = {userId, day, nullptr};
+            q.ready.push_back(p);
+        } else {
+            q.push(userId, day);
+        }
+    }
+
+    // Files list a book's set-aside entries in the order of its RESERVED
+    // copies; pairs them up once all books are loaded. Unmatched entries
+    // are dropped and unmatched copies go back on the shelf.
+    void matchLoadedPickups() {
+        for(size_t i = 0; i < LockStripes::STRIPES; i++) {
+            vector<Book*> emptied;
+            for(auto &entry : holds.stripe(i)) {
+                HoldQueue &q = entry.second;
+                size_t matched = 0;
+                entry.first->forEachCopy([this, &q, &matched](BookCopy* copy) {
+                    if(copy->getStatus() != RESERVED) return;
+                    if(matched < q.ready.size()) q.ready[matched++].copy = copy;
+                    else setCopyStatus(copy, AVAILABLE);
+                });
+                q.ready.resize(matched);
+                if(q.empty()) emptied.push_back(entry.first);
+            }
+            for(auto book : emptied)
+                holds.erase(book);
+        }
+    }
+
+    // Prints one line per loan with the borrower and the book.
+    void printLoans(const vector<DueLoan> &loans, int today, const string &none, const string &heading) const {
+        if(loans.empty()) {
+            cout << none << "\n";
+            return;
+        }
+        ReadGuard guard(catalogLock);
+        cout << "\n--- " << heading << " ---\n";
+        for(auto &loan : loans) {
+            auto it = userIndex.find(loan.userId);
+            const Book* book = loan.copy->book();
+            cout << "ID: " << loan.userId << " | Name: " << (it != userIndex.end() ? it->second->getName() : "?")
+                 << " | \"" << book->getTitle() << "\" (ISBN " << book->getISBN();
+            if(book->copyCount() > 1) cout << ", copy " << loan.copy->copyNumber();
+            cout << ") | Due on day " << loan.dueDate;
+            if(loan.dueDate < today) cout << " (" << today - loan.dueDate << " days overdue)";
+            cout << "\n";
+        }
+        cout << loans.size() << " loan(s).\n";
+    }
+
+    bool writeSnapshot(const string &file) {
+        if(!writeFileAtomically(file, buildSnapshot(journal.isOpen() ? journal.lastSeq() : baseSeq))) {
+            cout << "Error writing snapshot " << file << ".\n";
+            return false;
+        }
+        cout << "Library saved to snapshot " << file << "\n";
+        return true;
+    }
+
+    // Adds a user to the in-memory indexes without journaling it. Returns
+    // false if the id is taken.
+    bool insertUser(User* user) {
+        if(directory.isPending(user->getId()) || !userIndex.insert({user->getId(), user}).second)
+            return false;
+        users.push_back(user);
+        user->setSaveSlot(nextUserSlot++);
+        touchUser(user);
+        lock_guard<mutex> due(dueLock);
+        for(auto &bi : user->getAccount().borrowedBooks)
+            dueQueue.add(user->getId(), bi.copy, bi.dueDate);
+        return true;
+    }
+
+    // Builds the user at directory position pos from the snapshot records.
+    User* readSnapshotUser(size_t pos) const {
+        SnapUser su = directory.userAt(pos);
+        if(su.type >= USER_ROLES) return nullptr;
+        User* user = createUser(static_cast<UserRole>(su.type), su.id, directory.str(su.name), directory.str(su.password));
+        Account &acc = user->getAccount();
+        acc.fines = su.fines;
+        acc.history.reserve(su.historyCount);
+        acc.borrowedBooks.reserve(su.borrowCount);
+        for(uint32_t k = 0; k < su.historyCount; k++) {
+            SnapHistory sh = directory.historyAt(pos, k);
+            BookCopy* c = directory.copyAt(sh.book);
+            if(c)
+                acc.history.push_back({c, sh.borrowDate, sh.dueDate, sh.returnDate, sh.fineIncurred});
+        }
+        for(uint32_t k = 0; k < su.borrowCount; k++) {
+            SnapBorrow sb = directory.borrowAt(pos, k);
+            BookCopy* c = directory.copyAt(sb.book);
+            if(c)
+                acc.addBorrowedBook(c, sb.borrowDate, sb.dueDate);
+        }
+        return user;
+    }
+
+    // Reads the user at directory position pos. Only reads the directory
+    // and the catalog, so several entries may be read at once.
+    // The directory has checked that the entry is a line with its id; a
+    // line that does not parse is skipped, as loadData always has. Older
+    // history records stay in the directory's users.txt until read.
+    User* readPendingUser(size_t pos) const {
+        if(directory.isSnapshot())
+            return readSnapshotUser(pos);
+        return parseUserLine(directory.lineAt(pos), accountBooks, true);
+    }
+
+    // Adds a user read from directory position pos to the library.
+    User* admitPendingUser(size_t pos, User* user) {
+        directory.setState(pos, UserDirectory::LOADED);
+        if(user && !insertUser(user)) { // the id was taken by a user added since
+            delete user;
+            user = nullptr;
+        }
+        if(!user)
+            directory.setState(pos, UserDirectory::GONE);
+        return user;
+    }
+
+    // Called with catalogLock held exclusively (or before the library is
+    // shared), as are the functions below.
+    User* loadPendingUser(size_t pos) {
+        return admitPendingUser(pos, readPendingUser(pos));
+    }
+
+    // Reads every account not read yet and drops the directory, leaving
+    // users in file order followed by the users added since. Large
+    // users.txt files are parsed on several threads, each taking a run of
+    // entries; the users are then added in file order.
+    void loadAllUsersLocked() {
+        if(directory.size() == 0) return;
+        size_t count = directory.size();
+        vector<User*> parsed(count, nullptr);
+        auto readRange = [this, &parsed](size_t first, size_t last) {
+            for(size_t pos = first; pos < last; pos++)
+                if(directory.state(pos) == UserDirectory::PENDING)
+                    parsed[pos] = readPendingUser(pos);
+        };
+        size_t cores = max(1u, thread::hardware_concurrency());
+        size_t parts = directory.isSnapshot() ? 1 : min(cores, directory.sourceBytes() / LOADER_MIN_CHUNK + 1);
+        vector<thread> workers;
+        for(size_t c = 1; c < parts; c++)
+            workers.push_back(thread(readRange, count * c / parts, count * (c + 1) / parts));
+        readRange(0, count / parts);
+        for(auto &w : workers)
+            w.join();
+        for(size_t pos = 0; pos < count; pos++)
+            if(directory.state(pos) == UserDirectory::PENDING)
+                admitPendingUser(pos, parsed[pos]);
+
+        vector<User*> ordered;
+        ordered.reserve(users.size());
+        for(size_t pos = 0; pos < count; pos++)
+            if(directory.state(pos) == UserDirectory::LOADED)
+                ordered.push_back(userIndex[directory.idAt(pos)]);
+        for(auto user : users)
+            if(!fromDirectory(user))
+                ordered.push_back(user);
+        users.swap(ordered);
+        directory.clear();
+    }
+
+    // True if user was read from the directory (rather than added since).
+    bool fromDirectory(const User* user) const {
+        long pos = directory.find(user->getId());
+        return pos >= 0 && directory.state(pos) == UserDirectory::LOADED;
+    }
+
+public:
+    Library() : accountBooks(catalog, isbnIndex, removedIsbns), nextUserSlot(0), snapshotFile("library.snap"), baseSeq(0), recordsSinceCheckpoint(0), compacting(false),
+                waitForEachRecord(true) {}
+    ~Library() {
+        if(compactor.joinable())
+            compactor.join();
+        journal.close();
+        for(auto user : users)
+            delete user;
+        for(auto user : retiredUsers)
+            delete user;
+    }
+    
+    bool isBooksEmpty() const { ReadGuard guard(catalogLock); return books.empty(); }
+    bool isUsersEmpty() const { ReadGuard guard(catalogLock); return users.empty() && directory.pendingCount() == 0; }
+
+    // Book Methods
+    // Adds a copy of a book. A book whose ISBN is already in the catalog
+    // gets one more copy; otherwise the book is added with this one.
+    Book* addBook(const BookRecord &rec) {
+        Book* b;
+        uint64_t seq;
+        {
+            WriteGuard guard(catalogLock);
+            BookCopy* copy = insertCopy(rec);
+            b = copy->book();
+            seq = logMutation("ADDBOOK|" + journalEscape(b->getTitle()) + "|" + journalEscape(b->getAuthor()) + "|" +
+                              journalEscape(b->getPublisher()) + "|" + to_string(b->getYear()) + "|" +
+                              journalEscape(b->getISBN()) + "|" + to_string(copy->getStatus()));
+        }
+        settle(seq);
+        return b;
+    }
+
+    void removeBook(const string &isbn) {
+        uint64_t seq = 0;
+        bool removed = false;
+        {
+            WriteGuard guard(catalogLock);
+            uint64_t code;
+            auto it = isbnIndex.end();
+            if(catalog.findISBNCode(TextSpan(isbn), code))
+                it = isbnIndex.find(code);
+            if(it != isbnIndex.end()){
+                Book* book = it->second;
+                touchBook(book);
+                searchIndex.remove(book);
+                listing.remove(book);
+                holds.erase(book);
+                catalog.retire(book); // with all its copies
+                books.erase(find(books.begin(), books.end(), book));
+                removedIsbns.insert(*it); // keeps an earlier one
+                isbnIndex.erase(it);
+                seq = logMutation("DELBOOK|" + journalEscape(isbn));
+                removed = true;
+            }
+        }
+        settle(seq);
+        if(removed)
+            cout << "Book with ISBN " << isbn << " removed.\n";
+        else
+            cout << "Book not found.\n";
+    }
+
+    Book* findBookByISBN(const string &isbn) const {
+        StatTimer timer(STAT_FIND_BOOK);
+        ReadGuard guard(catalogLock);
+        return IsbnResolver(catalog, isbnIndex).find(TextSpan(isbn));
+    }
+
+    // Reads how many copies of a book are in under its lock, for callers
+    // outside the circulation methods.
+    uint32_t availableCopies(const Book* book) const {
+        ReadGuard guard(catalogLock);
+        lock_guard<mutex> bookGuard(bookLocks.forBook(book));
+        return book->availableCopies();
+    }
+
+    // Updates title and author of a book; empty strings keep the old value.
+    void updateBook(Book* book, const string &newTitle, const string &newAuthor) {
+        uint64_t seq = 0;
+        {
+            WriteGuard guard(catalogLock);
+            // The book's fields are guarded by its lock like its copies.
+            lock_guard<mutex> bookGuard(bookLocks.forBook(book));
+            // Sorted by the old values until the edit; a book removed in
+            // the meantime stays out.
+            auto current = isbnIndex.find(book->isbnCode());
+            bool listed = current != isbnIndex.end() && current->second == book;
+            if(listed) listing.remove(book);
+            if(!newTitle.empty()) {
+                string oldTitle = book->getTitle();
+                book->setTitle(newTitle);
+                searchIndex.reindex(book, SEARCH_TITLE, oldTitle);
+            }
+            if(!newAuthor.empty()) {
+                string oldAuthor = book->getAuthor();
+                book->setAuthor(newAuthor);
+                searchIndex.reindex(book, SEARCH_AUTHOR, oldAuthor);
+            }
+            if(listed) listing.add(book);
+            touchBook(book);
+            if(!newTitle.empty() || !newAuthor.empty())
+                seq = logMutation("EDITBOOK|" + journalEscape(book->getISBN()) + "|" + journalEscape(newTitle) + "|" + journalEscape(newAuthor));
+        }
+        settle(seq);
+    }
+
+    // Circulation: every change to loans and fines goes through these so
+    // that it is journaled. Each runs under the locks of the account and
+    // book it touches.
+
+    // Checks the user's borrowing rules and the book's availability and
+    // lends a copy, all under the same locks, so two patrons racing for
+    // the last copy cannot both get it. A copy set aside for the user is
+    // lent first; otherwise the next copy on the book's available chain.
+    BorrowDenial tryCheckout(User* user, Book* book, int borrowDate) {
+        StatTimer timer(STAT_BORROW);
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            PairGuard entities(accountLocks.forUser(user->getId()), bookLocks.forBook(book));
+            BorrowDenial denial = user->checkBorrowRules(borrowDate);
+            if(denial != BORROW_ALLOWED) return denial;
+            HoldQueue* q = refreshHolds(book, borrowDate);
+            const Pickup* setAside = q ? q->pickupFor(user->getId()) : nullptr;
+            BookCopy* copy = setAside ? setAside->copy : book->freeCopy();
+            if(!copy) return DENY_UNAVAILABLE;
+            seq = lend(user, copy, borrowDate, borrowDate + user->loanPeriod());
+        }
+        settle(seq);
+        return BORROW_ALLOWED;
+    }
+
+    // Lends the copy without checking any rules; used by journal replay.
+    void checkoutBook(User* user, BookCopy* copy, int borrowDate, int dueDate) {
+        StatTimer timer(STAT_BORROW);
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            PairGuard entities(accountLocks.forUser(user->getId()), bookLocks.forBook(copy->book()));
+            seq = lend(user, copy, borrowDate, dueDate);
+        }
+        settle(seq);
+    }
+
+    // Returns the user's earliest loan of a copy of book. Returns false
+    // (and changes nothing) if the user had not borrowed the book.
+    bool checkinBook(User* user, Book* book, int returnDate) {
+        StatTimer timer(STAT_RETURN);
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            PairGuard entities(accountLocks.forUser(user->getId()), bookLocks.forBook(book));
+            const BorrowInfo* loan = user->getAccount().findLoan(book);
+            if(!loan)
+                return false;
+            seq = giveBack(user, loan->copy, loan->dueDate, returnDate);
+        }
+        settle(seq);
+        return true;
+    }
+
+    // Returns one particular copy; used by journal replay.
+    bool checkinCopy(User* user, BookCopy* copy, int returnDate) {
+        StatTimer timer(STAT_RETURN);
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            PairGuard entities(accountLocks.forUser(user->getId()), bookLocks.forBook(copy->book()));
+            const BorrowInfo* loan = user->getAccount().findLoan(copy);
+            if(!loan)
+                return false;
+            seq = giveBack(user, copy, loan->dueDate, returnDate);
+        }
+        settle(seq);
+        return true;
+    }
+
+    void payFines(User* user) {
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            lock_guard<mutex> account(accountLocks.forUser(user->getId()));
+            user->getAccount().fines = 0;
+            touchUser(user);
+            seq = logMutation("PAY|" + to_string(user->getId()));
+        }
+        settle(seq);
+    }
+
+    // Puts user at the back of book's hold line. Only the book's and the
+    // account's locks are taken, so patrons queueing for different books
+    // do not contend.
+    HoldOutcome placeHold(User* user, Book* book, int day) {
+        uint64_t seq;
+        {
+            ReadGuard guard(catalogLock);
+            PairGuard entities(accountLocks.forUser(user->getId()), bookLocks.forBook(book));
+            if(user->checkBorrowRules(day) == DENY_ROLE) return HOLD_DENIED;
+            HoldQueue* q = refreshHolds(book, day);
+            if(book->availableCopies() > 0) return HOLD_NOT_NEEDED;
+            if(user->getAccount().findLoan(book) || (q && q->has(user->getId()))) return HOLD_DUPLICATE;
+            holds.get(book).push(user->getId(), day);
+            touchBook(book);
+            seq = logMutation("HOLD|" + to_string(user->getId()) + "|" + journalEscape(book->getISBN()) + "|" +
+                              to_string(day));
+        }
+        settle(seq);
+        return HOLD_PLACED;
+    }
+
+    // Lapses every uncollected copy as of today, so that copy statuses
+    // are current. Holds also lapse on their own whenever their book is
+    // borrowed, returned or held, so this needs no journal record.
+    void expireHolds(int today) {
+        ReadGuard guard(catalogLock);
+        for(size_t i = 0; i < LockStripes::STRIPES; i++) {
+            lock_guard<mutex> stripe(bookLocks.at(i));
+            vector<Book*> queued;
+            for(auto &entry : holds.stripe(i))
+                queued.push_back(entry.first);
+            for(auto book : queued)
+                refreshHolds(book, today);
+        }
+    }
+
+    // Prints the user's borrowing history. Records still in users.txt are
+    // resolved through the catalog's ISBN maps as they are printed, hence
+    // catalogLock; the account's lock keeps a return from adding to the
+    // history meanwhile.
+    void listHistory(User* user) const {
+        ReadGuard guard(catalogLock);
+        lock_guard<mutex> account(accountLocks.forUser(user->getId()));
+        user->getAccount().listHistory();
+    }
+
+    void listHolds(const User* user, int today) {
+        vector<pair<Book*, HoldQueue> > mine;
+        {
+            ReadGuard guard(catalogLock);
+            for(size_t i = 0; i < LockStripes::STRIPES; i++) {
+                lock_guard<mutex> stripe(bookLocks.at(i));
+                vector<Book*> queued;
+                for(auto &entry : holds.stripe(i))
+                    if(entry.second.has(user->getId()))
+                        queued.push_back(entry.first);
+                for(auto book : queued) {
+                    HoldQueue* q = refreshHolds(book, today);
+                    if(q && q->has(user->getId()))
+                        mine.push_back({book, *q});
+                }
+            }
+        }
+        if(mine.empty()) {
+            cout << "No holds placed.\n";
+            return;
+        }
+        cout << "Holds:\n";
+        for(auto &h : mine) {
+            cout << "- " << h.first->getTitle();
+            if(const Pickup* p = h.second.pickupFor(user->getId())) {
+                cout << " (ready for pickup until day " << p->until << ")\n";
+                continue;
+            }
+            size_t position = 1;
+            while(h.second.waiting[position - 1].userId != user->getId())
+                position++;
+            cout << " (number " << position << " in line)\n";
+        }
+    }
+
+    // One page of the catalog in the given order: up to count books from
+    // place offset on. Returns the number of books in the catalog. The
+    // first request for an order sorts the catalog under the exclusive
+    // lock; later ones read the order as it has been kept.
+    size_t listBooks(SortOrder order, size_t offset, size_t count, vector<Book*> &page) const {
+        {
+            ReadGuard guard(catalogLock);
+            if(listing.isBuilt(order)) return listing.page(order, offset, count, page);
+        }
+        WriteGuard guard(catalogLock);
+        listing.build(order, books);
+        return listing.page(order, offset, count, page);
+    }
+
+    // Pages through the catalog in an order the reader picks. Each page is
+    // formatted into one buffer and written out at once.
+    void listBooks() const {
+        int option;
+        cout << "\nSort books by:\n1. Title\n2. Author\n3. Year\n4. Status\nEnter choice: ";
+        cin >> option;
+        cin.ignore();
+        if(option < 1 || option > 4) {
+            cout << "Invalid choice.\n";
+            return;
+        }
+        SortOrder order = static_cast<SortOrder>(option - 1);
+        vector<Book*> page;
+        size_t pageNo = 0;
+        while(true) {
+            size_t total = listBooks(order, pageNo * LIST_PAGE_SIZE, LIST_PAGE_SIZE, page);
+            if(total == 0) {
+                cout << "No books in the library.\n";
+                return;
+            }
+            size_t pages = (total + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE;
+            if(pageNo >= pages) { // books were removed meanwhile
+                pageNo = pages - 1;
+                continue;
+            }
+            ostringstream out;
+            out << "\n--- Library Books by " << sortOrderName(order) << ", page " << pageNo + 1 << " of " << pages
+                << " ---\n";
+            {
+                ReadGuard guard(catalogLock);
+                for(auto book : page) {
+                    {
+                        lock_guard<mutex> bookGuard(bookLocks.forBook(book));
+                        book->printDetails(out);
+                    }
+                    out << "-------------------------\n";
+                }
+            }
+            if(pageNo + 1 < pages)
+                out << "Enter for the next page, a page number, or q to stop: ";
+            cout << out.str() << flush;
+            if(pageNo + 1 == pages) return;
+            string reply;
+            int number;
+            if(!getline(cin, reply) || reply == "q") return;
+            if(reply.empty()) pageNo++;
+            else if(parseInt(TextSpan(reply), number) && number >= 1) pageNo = number - 1;
+            else return;
+        }
+    }
+
+    void searchBooks() {
+        int option;
+        cout << "\nSearch Books by:\n1. Title\n2. Author\n3. ISBN\n4. Title and author, best matches first (typos allowed)\nEnter choice: ";
+        cin >> option;
+        cin.ignore();
+        string query;
+        if(option == 4) {
+            cout << "Enter search words: ";
+            getline(cin, query);
+            vector<RankedMatch> ranked = rankBooks(query, 10);
+            ReadGuard guard(catalogLock);
+            for(auto &m : ranked) {
+                {
+                    lock_guard<mutex> bookGuard(bookLocks.forBook(m.book));
+                    m.book->printDetails();
+                }
+                cout << "Relevance: " << m.score << "\n";
+                cout << "-------------------------\n";
+            }
+            if(ranked.empty())
+                cout << "No matching books found.\n";
+            return;
+        }
+        if(option == 1 || option == 2)
+            cout << "Enter search query (end with '?' for suggestions): ";
+        else
+            cout << "Enter search query: ";
+        getline(cin, query);
+        if((option == 1 || option == 2) && !query.empty() && query.back() == '?') {
+            vector<Completion> hints = suggestBooks(static_cast<SearchField>(option - 1),
+                                                    query.substr(0, query.size() - 1), 8);
+            if(hints.empty()) {
+                cout << "No suggestions.\n";
+                return;
+            }
+            for(size_t i = 0; i < hints.size(); i++) {
+                cout << i + 1 << ". " << hints[i].text;
+                if(hints[i].books > 1) cout << " (" << hints[i].books << " books)";
+                cout << "\n";
+            }
+            cout << "Pick a suggestion (0 to cancel): ";
+            int choice = 0;
+            cin >> choice;
+            cin.ignore();
+            if(choice < 1 || choice > (int)hints.size()) return;
+            query = hints[choice - 1].text;
+        }
+        vector<Book*> matches;
+        if(option >= 1 && option <= 3)
+            matches = findBooks(static_cast<SearchField>(option - 1), query);
+        ReadGuard guard(catalogLock);
+        for(auto book : matches) {
+            {
+                lock_guard<mutex> bookGuard(bookLocks.forBook(book));
+                book->printDetails();
+            }
+            cout << "-------------------------\n";
+        }
+        if(matches.empty())
+            cout << "No matching books found.\n";
+    }
+
+    // Substring search over one field, returning matches in catalog order.
+    vector<Book*> findBooks(SearchField field, const string &query) const {
+        StatTimer timer(STAT_SEARCH);
+        ReadGuard guard(catalogLock);
+        return searchIndex.search(field, query);
+    }
+
+    // The k books whose title and author best match the words of query,
+    // allowing for small typos; scored on up to `threads` threads (0 for
+    // one per core).
+    vector<RankedMatch> rankBooks(const string &query, size_t k, size_t threads = 0) const {
+        StatTimer timer(STAT_RANKED_SEARCH);
+        ReadGuard guard(catalogLock);
+        if(threads == 0) threads = max(1u, thread::hardware_concurrency());
+        return searchIndex.rank(query, k, threads);
+    }
+
+    // Up to k titles or authors starting with prefix (case and punctuation
+    // ignored), the ones most books share first.
+    vector<Completion> suggestBooks(SearchField field, const string &prefix, size_t k) const {
+        StatTimer timer(STAT_SUGGEST);
+        ReadGuard guard(catalogLock);
+        return searchIndex.complete(field, prefix, k);
+    }
+
+    // User Methods
+    void addUser(User *user) {
+        uint64_t seq;
+        {
+            WriteGuard guard(catalogLock);
+            if(!insertUser(user)) {
+                cout << "User with ID " << user->getId() << " already exists. Cannot add duplicate.\n";
+                delete user;
+                return;
+            }
+            seq = logMutation(string("ADDUSER|") + user->getType() + "|" + to_string(user->getId()) + "|" +
+                              journalEscape(user->getName()) + "|" + journalEscape(user->getPassword()));
+        }
+        settle(seq);
+    }
+
+    // Users not read yet are loaded from the directory on first lookup.
+    User* findUserById(int id) {
+        StatTimer timer(STAT_FIND_USER);
+        {
+            ReadGuard guard(catalogLock);
+            auto it = userIndex.find(id);
+            if(it != userIndex.end()) return it->second;
+            if(!directory.isPending(id)) return nullptr;
+        }
+        WriteGuard guard(catalogLock);
+        auto it = userIndex.find(id);
+        if(it != userIndex.end()) return it->second; // loaded meanwhile
+        long pos = directory.find(id);
+        return (pos >= 0 && directory.state(pos) == UserDirectory::PENDING) ? loadPendingUser(pos) : nullptr;
+    }
+
+    // Reads every account that has not been looked up yet. Reports over
+    // the whole library call this first.
+    void loadAllUsers() {
+        {
+            ReadGuard guard(catalogLock);
+            if(directory.size() == 0) return;
+        }
+        WriteGuard guard(catalogLock);
+        loadAllUsersLocked();
+    }
+
+    void removeUser(int id) {
+        uint64_t seq = 0;
+        bool removed = false;
+        {
+            WriteGuard guard(catalogLock);
+            auto idx = userIndex.find(id);
+            long pos = directory.find(id);
+            if(idx == userIndex.end() && pos >= 0 && directory.state(pos) == UserDirectory::PENDING &&
+               loadPendingUser(pos))
+                idx = userIndex.find(id);
+            if(idx != userIndex.end()){
+                User* user = idx->second;
+                if(fromDirectory(user))
+                    directory.setState(pos, UserDirectory::GONE);
+                touchUser(user);
+                userIndex.erase(idx);
+                users.erase(find(users.begin(), users.end(), user));
+                retiredUsers.push_back(user);
+                {
+                    lock_guard<mutex> due(dueLock);
+                    for(auto &bi : user->getAccount().borrowedBooks)
+                        dueQueue.remove(id, bi.copy, bi.dueDate);
+                }
+                // Leave every line; copies set aside for the user go to the
+                // next patron or back on the shelf.
+                vector<Book*> emptied;
+                for(size_t i = 0; i < LockStripes::STRIPES; i++)
+                    for(auto &entry : holds.stripe(i)) {
+                        HoldQueue &q = entry.second;
+                        vector<BookCopy*> released;
+                        bool changed = q.removeWaiting(id);
+                        if(q.passOnPickups(id, released)) changed = true;
+                        for(auto copy : released)
+                            setCopyStatus(copy, AVAILABLE);
+                        if(changed) touchBook(entry.first);
+                        if(q.empty()) emptied.push_back(entry.first);
+                    }
+                for(auto book : emptied)
+                    holds.erase(book);
+                seq = logMutation("DELUSER|" + to_string(id));
+                removed = true;
+            }
+        }
+        settle(seq);
+        if(removed)
+            cout << "User with ID " << id << " removed.\n";
+        else
+            cout << "User not found.\n";
+    }
+
+    void updateUser(int id) {
+        User* user = findUserById(id);
+        if(user) {
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "Enter new name for user with ID " << id << ": ";
+            string newName;
+            getline(cin, newName);
+            renameUser(user, newName);
+            cout << "User updated successfully.\n";
+        } else {
+            cout << "User not found.\n";
+        }
+    }
+
+    void renameUser(User* user, const string &newName) {
+        uint64_t seq;
+        {
+            WriteGuard guard(catalogLock);
+            user->setName(newName);
+            touchUser(user);
+            seq = logMutation("RENAMEUSER|" + to_string(user->getId()) + "|" + journalEscape(newName));
+        }
+        settle(seq);
+    }
+
+    void listUsers() {
+        loadAllUsers();
+        ReadGuard guard(catalogLock);
+        if(users.empty()){
+            cout << "No users registered.\n";
+            return;
+        }
+        cout << "\n--- Registered Users ---\n";
+        for(auto user : users) {
+            cout << "ID: " << user->getId() << " | Name: " << user->getName() << "\n";
+        }
+    }
+
+    // Flattens every active loan into columns for accrueFines, with the
+    // library locked so that no loan changes meanwhile.
+    void collectLoans(LoanColumns &out) {
+        WriteGuard guard(catalogLock);
+        loadAllUsersLocked();
+        out = LoanColumns();
+        for(auto user : users) {
+            const Account &acc = user->getAccount();
+            if(acc.borrowedBooks.empty()) continue;
+            int32_t rate = user->finePerDay();
+            out.userIds.push_back(user->getId());
+            out.firstLoan.push_back(out.dueDates.size());
+            for(auto &bi : acc.borrowedBooks) {
+                out.dueDates.push_back(bi.dueDate);
+                out.dailyRates.push_back(rate);
+            }
+        }
+        out.firstLoan.push_back(out.dueDates.size());
+    }
+
+    // Loans due on days [firstDay, lastDay], earliest first.
+    vector<DueLoan> loansDueBetween(int firstDay, int lastDay) {
+        loadAllUsers(); // the queue only holds loans of accounts read so far
+        lock_guard<mutex> due(dueLock);
+        return dueQueue.dueBetween(firstDay, lastDay);
+    }
+
+    // Loans whose due date has passed (returning them today incurs a fine).
+    vector<DueLoan> overdueLoans(int today) {
+        return loansDueBetween(numeric_limits<int>::min(), today - 1);
+    }
+
+    void listOverdueLoans(int today) {
+        printLoans(overdueLoans(today), today, "No loans are overdue.", "Overdue Loans");
+    }
+
+    void listLoansDueWithin(int today, int days) {
+        printLoans(loansDueBetween(today, today + days), today,
+                   "No loans are due in the next " + to_string(days) + " days.",
+                   "Loans Due in the Next " + to_string(days) + " Days");
+    }
+
+    // Binary Snapshot Functions
+    // Writes the whole library to a single binary snapshot file.
+    bool saveSnapshot(const string &file) {
+        WriteGuard guard(catalogLock);
+        return writeSnapshot(file);
+    }
+
+    // Serializes the library into the snapshot layout in memory. The
+    // caller must keep the library from changing (see saveSnapshot).
+    // Accounts not read yet from a snapshot are copied record by record
+    // without building their User objects.
+    string buildSnapshot(uint64_t journalSeq) {
+        StatTimer timer(STAT_BUILD_SNAPSHOT);
+        if(!directory.isSnapshot())
+            loadAllUsersLocked();
+        StringTableBuilder strings;
+        unordered_map<const BookCopy*, uint32_t> copyIndex;
+        vector<SnapBook> snapBooks;
+        vector<SnapCopy> snapCopies;
+        snapBooks.reserve(books.size());
+        for(auto book : books) {
+            SnapBook sb = {strings.add(book->getTitle()), strings.add(book->getAuthor()),
+                           strings.add(book->getPublisher()), strings.add(book->getISBN()),
+                           book->getYear(), book->copyCount()};
+            snapBooks.push_back(sb);
+            book->forEachCopy([&copyIndex, &snapCopies](const BookCopy* copy) {
+                copyIndex.insert({copy, static_cast<uint32_t>(snapCopies.size())});
+                SnapCopy sc = {static_cast<uint8_t>(copy->getStatus())};
+                snapCopies.push_back(sc);
+            });
+        }
+        auto indexOf = [&copyIndex](const BookCopy* c) {
+            auto it = copyIndex.find(c);
+            return (it != copyIndex.end()) ? it->second : SNAPSHOT_NO_BOOK;
+        };
+        vector<SnapUser> snapUsers;
+        vector<SnapHistory> snapHistory;
+        vector<SnapBorrow> snapBorrows;
+        snapUsers.reserve(users.size() + directory.pendingCount());
+        auto addUserRecords = [&](User* user) {
+            Account &acc = user->getAccount();
+            SnapUser su = {user->getId(), static_cast<uint32_t>(user->getRole()),
+                           strings.add(user->getName()), strings.add(user->getPassword()), acc.fines,
+                           0, static_cast<uint32_t>(acc.borrowedBooks.size())};
+            size_t firstHistory = snapHistory.size();
+            acc.history.forEach([&](const HistoryRecord &hr) {
+                SnapHistory sh = {indexOf(hr.copy), hr.borrowDate, hr.dueDate, hr.returnDate, hr.fineIncurred};
+                snapHistory.push_back(sh);
+            });
+            su.historyCount = static_cast<uint32_t>(snapHistory.size() - firstHistory);
+            snapUsers.push_back(su);
+            for(auto &bi : acc.borrowedBooks) {
+                SnapBorrow sb = {indexOf(bi.copy), bi.borrowDate, bi.dueDate};
+                snapBorrows.push_back(sb);
+            }
+        };
+        // Same records readSnapshotUser would keep, with the copy indexes
+        // renumbered for this snapshot.
+        auto copyPendingRecords = [&](size_t pos) {
+            SnapUser su = directory.userAt(pos);
+            if(su.type >= USER_ROLES) return;
+            uint32_t historyCount = su.historyCount, borrowCount = su.borrowCount;
+            su.name = strings.add(directory.str(su.name));
+            su.password = strings.add(directory.str(su.password));
+            su.historyCount = su.borrowCount = 0;
+            for(uint32_t k = 0; k < historyCount; k++) {
+                SnapHistory sh = directory.historyAt(pos, k);
+                BookCopy* c = directory.copyAt(sh.book);
+                if(!c) continue;
+                sh.book = indexOf(c);
+                snapHistory.push_back(sh);
+                su.historyCount++;
+            }
+            for(uint32_t k = 0; k < borrowCount; k++) {
+                SnapBorrow sb = directory.borrowAt(pos, k);
+                BookCopy* c = directory.copyAt(sb.book);
+                if(!c) continue;
+                sb.book = indexOf(c);
+                snapBorrows.push_back(sb);
+                su.borrowCount++;
+            }
+            snapUsers.push_back(su);
+        };
+        // Users keep the order of the file they came from, followed by the
+        // users added since.
+        for(size_t pos = 0; pos < directory.size(); pos++) {
+            if(directory.state(pos) == UserDirectory::PENDING)
+                copyPendingRecords(pos);
+            else if(directory.state(pos) == UserDirectory::LOADED)
+                addUserRecords(userIndex[directory.idAt(pos)]);
+        }
+        for(auto user : users)
+            if(!fromDirectory(user))
+                addUserRecords(user);
+        vector<SnapHold> snapHolds;
+        for(uint32_t i = 0; i < books.size(); i++) {
+            HoldQueue* q = holds.find(books[i]);
+            if(!q) continue;
+            for(auto &p : q->pickupsByCopy()) {
+                SnapHold sh = {i, p.userId, p.until, 1};
+                snapHolds.push_back(sh);
+            }
+            for(auto &h : q->waiting) {
+                SnapHold sh = {i, h.userId, h.day, 0};
+                snapHolds.push_back(sh);
+            }
+        }
+        SnapshotHeader header;
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.bookCount = snapBooks.size();
+        header.userCount = snapUsers.size();
+        header.historyCount = snapHistory.size();
+        header.borrowCount = snapBorrows.size();
+        header.stringBytes = strings.data().size();
+        header.journalSeq = journalSeq;
+        header.holdCount = snapHolds.size();
+        header.copyCount = snapCopies.size();
+
+        string image;
+        image.reserve(sizeof(header) + snapBooks.size() * sizeof(SnapBook) + snapUsers.size() * sizeof(SnapUser) +
+                      snapHistory.size() * sizeof(SnapHistory) + snapBorrows.size() * sizeof(SnapBorrow) +
+                      snapHolds.size() * sizeof(SnapHold) + snapCopies.size() * sizeof(SnapCopy) +
+                      strings.data().size());
+        image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        image.append(reinterpret_cast<const char*>(snapBooks.data()), snapBooks.size() * sizeof(SnapBook));
+        image.append(reinterpret_cast<const char*>(snapUsers.data()), snapUsers.size() * sizeof(SnapUser));
+        image.append(reinterpret_cast<const char*>(snapHistory.data()), snapHistory.size() * sizeof(SnapHistory));
+        image.append(reinterpret_cast<const char*>(snapBorrows.data()), snapBorrows.size() * sizeof(SnapBorrow));
+        image.append(reinterpret_cast<const char*>(snapHolds.data()), snapHolds.size() * sizeof(SnapHold));
+        image.append(reinterpret_cast<const char*>(snapCopies.data()), snapCopies.size() * sizeof(SnapCopy));
+        image.append(strings.data());
+        return image;
+    }
+
+    // Replaces the library contents with a snapshot. Returns false (and
+    // leaves the library untouched) if the file is missing or invalid.
+    bool loadSnapshot(const string &file) {
+        StatTimer timer(STAT_LOAD_SNAPSHOT);
+        MappedFile* snapshot = new MappedFile(file);
+        if(!snapshot->isOpen() || !readSnapshot(snapshot, file)) {
+            delete snapshot;
+            return false;
+        }
+        return true;
+    }
+
+    // Loads the books of an open snapshot and hands its user section to
+    // the directory, which then owns the mapping.
+    bool readSnapshot(MappedFile* snapshot, const string &file) {
+        TextSpan raw = snapshot->text();
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        if(raw.size() < SNAPSHOT_V1_HEADER_SIZE) return false;
+        memcpy(&header, raw.begin, SNAPSHOT_V1_HEADER_SIZE);
+        if(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+           header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+            cout << file << " is not a library snapshot.\n";
+            return false;
+        }
+        if(header.version < 1 || header.version > SNAPSHOT_VERSION) {
+            cout << "Unsupported snapshot version " << header.version << " in " << file << ".\n";
+            return false;
+        }
+        size_t headerSize = (header.version == 1) ? SNAPSHOT_V1_HEADER_SIZE :
+                            (header.version == 2) ? SNAPSHOT_V2_HEADER_SIZE : sizeof(header);
+        if(raw.size() < headerSize) return false;
+        memcpy(&header, raw.begin, headerSize);
+        uint64_t expected = headerSize + (uint64_t)header.bookCount * sizeof(SnapBook) +
+                            (uint64_t)header.userCount * sizeof(SnapUser) +
+                            (uint64_t)header.historyCount * sizeof(SnapHistory) +
+                            (uint64_t)header.borrowCount * sizeof(SnapBorrow) +
+                            (uint64_t)header.holdCount * sizeof(SnapHold) +
+                            (uint64_t)header.copyCount * sizeof(SnapCopy) + header.stringBytes;
+        if(raw.size() != expected) {
+            cout << "Snapshot " << file << " is truncated or corrupt.\n";
+            return false;
+        }
+        const char* p = raw.begin + headerSize;
+        const char* bookRecs = p;
+        const char* userRecs = bookRecs + header.bookCount * sizeof(SnapBook);
+        const char* historyRecs = userRecs + header.userCount * sizeof(SnapUser);
+        const char* borrowRecs = historyRecs + header.historyCount * sizeof(SnapHistory);
+        const char* holdRecs = borrowRecs + header.borrowCount * sizeof(SnapBorrow);
+        const char* copyRecs = holdRecs + header.holdCount * sizeof(SnapHold);
+        const char* stringTable = copyRecs + header.copyCount * sizeof(SnapCopy);
+        auto str = [stringTable, &header](StrRef r) {
+            if((uint64_t)r.offset + r.length > header.stringBytes) return string();
+            return string(stringTable + r.offset, r.length);
+        };
+        auto bookAt = [bookRecs](uint32_t i) {
+            SnapBook sb;
+            memcpy(&sb, bookRecs + i * sizeof(SnapBook), sizeof(sb));
+            return sb;
+        };
+        if(header.version >= 4) {
+            uint64_t copies = 0;
+            for(uint32_t i = 0; i < header.bookCount; i++)
+                copies += bookAt(i).copies;
+            if(copies != header.copyCount) {
+                cout << "Snapshot " << file << " is truncated or corrupt.\n";
+                return false;
+            }
+        }
+        // Each user's history and loan records follow the previous user's,
+        // so the counts in the user records must add up to the header's.
+        uint64_t historyTotal = 0, borrowTotal = 0;
+        for(uint32_t i = 0; i < header.userCount; i++) {
+            SnapUser su;
+            memcpy(&su, userRecs + i * sizeof(SnapUser), sizeof(su));
+            historyTotal += su.historyCount;
+            borrowTotal += su.borrowCount;
+        }
+        if(historyTotal != header.historyCount || borrowTotal != header.borrowCount) {
+            cout << "Snapshot " << file << " is truncated or corrupt.\n";
+            return false;
+        }
+
+        for(auto book : books)
+            catalog.retire(book);
+        books.clear();
+        isbnIndex.clear();
+        removedIsbns.clear();
+        searchIndex.clear();
+        listing.clear();
+        bookLayout.reset();
+        userLayout.reset();
+        holds.clear();
+        for(auto user : users)
+            delete user;
+        users.clear();
+        userIndex.clear();
+        dueQueue.clear();
+
+        // Before v4 each SnapBook is a single copy, and copies of one ISBN
+        // come together as one book here.
+        books.reserve(header.bookCount);
+        vector<Book*> byIndex(header.bookCount, nullptr);
+        vector<BookCopy*> copies;
+        copies.reserve(header.version >= 4 ? header.copyCount : header.bookCount);
+        uint64_t nextCopy = 0;
+        for(uint32_t i = 0; i < header.bookCount; i++) {
+            SnapBook sb = bookAt(i);
+            BookRecord rec(str(sb.title), str(sb.author), str(sb.publisher), sb.year, str(sb.isbn));
+            uint32_t count = (header.version >= 4) ? sb.copies : 1;
+            for(uint32_t k = 0; k < count; k++) {
+                if(header.version >= 4) {
+                    SnapCopy sc;
+                    memcpy(&sc, copyRecs + nextCopy++ * sizeof(SnapCopy), sizeof(sc));
+                    rec.status = static_cast<BookStatus>(sc.status);
+                } else {
+                    rec.status = static_cast<BookStatus>(sb.copies);
+                }
+                copies.push_back(insertCopy(rec));
+                byIndex[i] = copies.back()->book();
+            }
+        }
+        {
+            WriteGuard guard(catalogLock);
+            searchIndex.endBulkLoad();
+        }
+        for(uint32_t i = 0; i < header.holdCount; i++) {
+            SnapHold sh;
+            memcpy(&sh, holdRecs + i * sizeof(SnapHold), sizeof(sh));
+            if(sh.book < byIndex.size() && byIndex[sh.book])
+                restoreHold(byIndex[sh.book], sh.userId, sh.day, sh.ready != 0);
+        }
+        matchLoadedPickups();
+        // Accounts are read when their users are first looked up.
+        directory.openSnapshot(snapshot, header, userRecs, historyRecs, borrowRecs, stringTable, copies);
+        baseSeq = header.journalSeq;
+        cout << "Library loaded from snapshot " << file << "\n";
+        return true;
+    }
+
+    // Journal Functions
+    // Replays journal records newer than what is already loaded, folds
+    // them into a fresh snapshot, and opens the journal for this session.
+    void openJournal(const string &journalFile, const string &snapshot) {
+        snapshotFile = snapshot;
+        string rotated = journalFile + ".old";
+        streambuf* saved = cout.rdbuf();
+        ostringstream sink;
+        cout.rdbuf(sink.rdbuf()); // replayed operations print as they did live
+        size_t replayed = replayJournal(rotated) + replayJournal(journalFile);
+        cout.rdbuf(saved);
+        if(replayed > 0) {
+            cout << "Recovered " << replayed << " journaled change(s).\n";
+            if(!writeFileAtomically(snapshotFile, buildSnapshot(baseSeq))) {
+                // Keep the journal; it is replayed again next time, and
+                // closeJournal() must not delete it before a checkpoint.
+                cout << "Warning: could not write snapshot " << snapshotFile << ".\n";
+                journal.open(journalFile, baseSeq + 1);
+                recordsSinceCheckpoint = replayed;
+                return;
+            }
+        }
+        remove(rotated.c_str());
+        remove(journalFile.c_str());
+        journal.open(journalFile, baseSeq + 1);
+    }
+
+    // Applies the records of one journal segment that are newer than
+    // baseSeq. Stops at the first torn or malformed record.
+    size_t replayJournal(const string &journalFile) {
+        MappedFile data(journalFile);
+        if(!data.isOpen()) return 0;
+        TextSpan rest = data.text(), line;
+        size_t applied = 0;
+        while(memchr(rest.begin, '\n', rest.size()) && nextLine(rest, line)) {
+            TextSpan seqField, op;
+            uint64_t seq;
+            if(!nextField(line, '|', seqField) || !parseUInt64(seqField, seq) || !nextField(line, '|', op))
+                break;
+            if(seq <= baseSeq) continue;
+            bool trailingEmpty = !line.empty() && line.end[-1] == '|';
+            vector<string> f;
+            TextSpan field;
+            while(nextField(line, '|', field))
+                f.push_back(journalUnescape(field));
+            if(trailingEmpty)
+                f.push_back(""); // e.g. EDITBOOK that keeps the author
+            if(!applyJournalRecord(op, f))
+                break;
+            baseSeq = seq;
+            applied++;
+        }
+        return applied;
+    }
+
+    bool applyJournalRecord(TextSpan op, const vector<string> &f) {
+        auto num = [](const string &s) { int v = 0; parseInt(TextSpan(s), v); return v; };
+        // BORROW and RETURN end with the copy number; records written before
+        // books had several copies leave it out, meaning copy 1.
+        auto copyOf = [this, &num, &f](const string &isbn, size_t field) -> BookCopy* {
+            Book* book = findBookByISBN(isbn);
+            return book ? book->copy(f.size() > field ? num(f[field]) : 1) : nullptr;
+        };
+        if(op.equals("BORROW") && (f.size() == 4 || f.size() == 5)) {
+            User* user = findUserById(num(f[0]));
+            BookCopy* copy = copyOf(f[1], 4);
+            if(user && copy) checkoutBook(user, copy, num(f[2]), num(f[3]));
+        } else if(op.equals("RETURN") && (f.size() == 4 || f.size() == 5)) {
+            User* user = findUserById(num(f[0]));
+            BookCopy* copy = copyOf(f[1], 4);
+            if(user && copy) checkinCopy(user, copy, num(f[2])); // f[3] (fine exempt) follows from the role
+        } else if(op.equals("HOLD") && f.size() == 3) {
+            User* user = findUserById(num(f[0]));
+            Book* book = findBookByISBN(f[1]);
+            if(user && book) placeHold(user, book, num(f[2]));
+        } else if(op.equals("PAY") && f.size() == 1) {
+            User* user = findUserById(num(f[0]));
+            if(user) payFines(user);
+        } else if(op.equals("ADDBOOK") && f.size() == 6) {
+            addBook(BookRecord(f[0], f[1], f[2], num(f[3]), f[4], static_cast<BookStatus>(num(f[5]))));
+        } else if(op.equals("DELBOOK") && f.size() == 1) {
+            removeBook(f[0]);
+        } else if(op.equals("EDITBOOK") && f.size() == 3) {
+            Book* book = findBookByISBN(f[0]);
+            if(book) updateBook(book, f[1], f[2]);
+        } else if(op.equals("ADDUSER") && f.size() == 4) {
+            User* user = createUser(f[0], num(f[1]), f[2], f[3]);
+            if(user) addUser(user);
+        } else if(op.equals("DELUSER") && f.size() == 1) {
+            removeUser(num(f[0]));
+        } else if(op.equals("RENAMEUSER") && f.size() == 2) {
+            User* user = findUserById(num(f[0]));
+            if(user) renameUser(user, f[1]);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Folds the journal into a new snapshot. Only the in-memory image is
+    // built on this thread, with the library locked; writing it runs on a
+    // worker while new records go to a fresh journal segment. Called with
+    // compactionLock held.
+    void compactInBackground() {
+        if(compacting || !journal.isOpen()) return;
+        if(compactor.joinable())
+            compactor.join();
+        string rotated = journal.getPath() + ".old";
+        if(ifstream(rotated).good()) return; // an earlier compaction failed; keep both segments
+        string image;
+        {
+            WriteGuard guard(catalogLock);
+            image = buildSnapshot(journal.lastSeq());
+            if(!journal.rotate(rotated)) return;
+            recordsSinceCheckpoint = 0;
+        }
+        compacting = true;
+        compactor = thread([this](string snapshotImage, string snapshotPath, string rotatedPath) {
+            if(writeFileAtomically(snapshotPath, snapshotImage))
+                remove(rotatedPath.c_str());
+            compacting = false;
+        }, std::move(image), snapshotFile, rotated);
+    }
+
+    // Writes a snapshot covering every journaled change and empties the
+    // journal. Used at exit instead of rewriting the text files.
+    bool checkpoint() {
+        lock_guard<mutex> compaction(compactionLock);
+        if(compactor.joinable())
+            compactor.join();
+        WriteGuard guard(catalogLock);
+        if(!writeSnapshot(snapshotFile))
+            return false;
+        if(journal.isOpen()) {
+            remove((journal.getPath() + ".old").c_str());
+            journal.truncate();
+        }
+        recordsSinceCheckpoint = 0;
+        return true;
+    }
+
+    // In deferred mode mutations only queue their journal record; the
+    // writer still flushes them in groups, and flushJournal() waits for
+    // everything queued so far.
+    void setDeferredDurability(bool deferred) { waitForEachRecord = !deferred; }
+
+    bool flushJournal() {
+        return !journal.isOpen() || journal.waitDurable(journal.lastSeq());
+    }
+
+    // Closes the journal, deleting it only when a snapshot already covers
+    // every record in it.
+    void closeJournal() {
+        if(!journal.isOpen()) return;
+        string path = journal.getPath();
+        journal.close();
+        if(recordsSinceCheckpoint == 0)
+            remove(path.c_str());
+    }
+
+    // Persistence Functions
+
+    // One books.txt line (with its newline) for book, into line. Only reads
+    // the library, so several lines may be formatted at once.
+    void formatBookLine(Book* book, string &line) {
+        line = book->getTitle() + "," + book->getAuthor() + "," + book->getPublisher() + "," +
+               to_string(book->getYear()) + "," + book->getISBN() + ",";
+        book->forEachCopy([&line](const BookCopy* copy) { line += char('0' + copy->getStatus()); });
+        // Hold line, if any: ",*user:lastPickupDay;user:dayPlaced;...",
+        // set-aside copies first, in the order of the RESERVED copies.
+        if(HoldQueue* q = holds.find(book)) {
+            line += ",";
+            const char* sep = "";
+            for(auto &p : q->pickupsByCopy()) {
+                line += sep + string("*") + to_string(p.userId) + ":" + to_string(p.until);
+                sep = ";";
+            }
+            for(auto &h : q->waiting) {
+                line += sep + to_string(h.userId) + ":" + to_string(h.day);
+                sep = ";";
+            }
+        }
+        line += "\n";
+    }
+
+    // One users.txt line: id|name|password|type|accountData
+    static string formatUserLine(User* user) {
+        return to_string(user->getId()) + "|" + user->getName() + "|" + user->getPassword() + "|" + user->getType() +
+               "|" + user->getAccount().serialize() + "\n";
+    }
+
+    // Each file is replaced atomically, and only the books and users
+    // changed since the last save to it are formatted again (see
+    // SaveLayout); the first save after loading writes everything.
+    void saveData(const string &booksFile = "books.txt", const string &usersFile = "users.txt") {
+        StatTimer timer(STAT_SAVE_TEXT);
+        WriteGuard guard(catalogLock);
+        loadAllUsersLocked(); // the users not read yet are written too
+        // Save books to books.txt, one line per book with the status of
+        // each copy as one digit: "title,author,publisher,year,isbn,0120"
+        auto bookSegment = [this](size_t seg, AtomicFileWriter &out) {
+            auto byRow = [](const Book* b, uint32_t row) { return b->catalogRow() < row; };
+            uint32_t last = static_cast<uint32_t>((seg + 1) * SAVE_SEGMENT_RECORDS);
+            string line;
+            for(auto it = lower_bound(books.begin(), books.end(), static_cast<uint32_t>(seg * SAVE_SEGMENT_RECORDS), byRow);
+                it != books.end() && (*it)->catalogRow() < last; ++it) {
+                formatBookLine(*it, line);
+                out.append(line);
+            }
+        };
+        size_t bookSegments = books.empty() ? 0 : books.back()->catalogRow() / SAVE_SEGMENT_RECORDS + 1;
+        if(bookLayout.save(booksFile, bookSegments, bookSegment))
+            cout << "Books saved to " << booksFile << "\n";
+        else
+            cout << "Error writing " << booksFile << ".\n";
+
+        // Save users to users.txt in format:
+        // id|name|password|type|accountData
+        // Users are kept in save slot order; a full save numbers them afresh.
+        if(!userLayout.describes(usersFile)) {
+            for(size_t i = 0; i < users.size(); i++)
+                users[i]->setSaveSlot(static_cast<uint32_t>(i));
+            nextUserSlot = static_cast<uint32_t>(users.size());
+        }
+        auto userSegment = [this](size_t seg, AtomicFileWriter &out) {
+            auto bySlot = [](const User* u, uint32_t slot) { return u->getSaveSlot() < slot; };
+            uint32_t last = static_cast<uint32_t>((seg + 1) * SAVE_SEGMENT_RECORDS);
+            for(auto it = lower_bound(users.begin(), users.end(), static_cast<uint32_t>(seg * SAVE_SEGMENT_RECORDS), bySlot);
+                it != users.end() && (*it)->getSaveSlot() < last; ++it) {
+                out.append(formatUserLine(*it));
+            }
+        };
+        size_t userSegments = nextUserSlot == 0 ? 0 : (nextUserSlot - 1) / SAVE_SEGMENT_RECORDS + 1;
+        if(userLayout.save(usersFile, userSegments, userSegment))
+            cout << "Users saved to " << usersFile << "\n";
+        else
+            cout << "Error writing " << usersFile << ".\n";
+    }
+
+    // Both files are memory-mapped and parsed in place; only the strings
+    // that end up inside Book/User objects are allocated.
+    void loadData(const string &booksFile = "books.txt", const string &usersFile = "users.txt") {
+        StatTimer timer(STAT_LOAD_TEXT);
+        // Load books
+        MappedFile bookData(booksFile);
+        if(bookData.isOpen()){
+            for(auto book : books)
+                catalog.retire(book);
+            books.clear();
+            isbnIndex.clear();
+        removedIsbns.clear();
+            searchIndex.clear();
+            listing.clear();
+            bookLayout.reset();
+            userLayout.reset();
+            holds.clear();
+            baseSeq = 0;
+            TextSpan rest = bookData.text(), line;
+            BookLine parsed;
+            while(nextLine(rest, line))
+                if(parseBookLine(line, parsed))
+                    addBookLine(parsed);
+            matchLoadedPickups();
+            {
+                WriteGuard guard(catalogLock);
+                searchIndex.endBulkLoad();
+            }
+            cout << "Books loaded from " << booksFile << "\n";
+        }
+        // Load users: only the directory of users.txt is read here; each
+        // account is parsed when its user is first looked up.
+        if(directory.openText(usersFile)){
+            for(auto user : users)
+                delete user;
+            users.clear();
+            userIndex.clear();
+            dueQueue.clear();
+            cout << "Users loaded from " << usersFile << "\n";
+        }
+    }
+
+    // Writes the library in the sharded layout (see ShardManifest) with
+    // the given number of book and user shards, formatting the shards on
+    // up to `threads` threads (0 for one per core).
+    bool saveShards(const string &manifest, uint32_t bookShards, uint32_t userShards, size_t threads = 0) {
+        StatTimer timer(STAT_SAVE_TEXT);
+        WriteGuard guard(catalogLock);
+        loadAllUsersLocked();
+        bookShards = max(bookShards, 1u);
+        userShards = static_cast<uint32_t>(max<size_t>(1, min<size_t>(userShards, users.size())));
+        ShardManifest old, next;
+        bool replacing = readShardManifest(manifest, old);
+        next.generation = old.generation + 1;
+        size_t slash = manifest.find_last_of("/\\");
+        string stem = manifest.substr(slash == string::npos ? 0 : slash + 1);
+        stem = stem.substr(0, stem.find_last_of('.'));
+        string prefix = stem + "." + to_string(next.generation) + ".";
+
+        vector<vector<Book*> > bookParts(bookShards);
+        for(auto book : books)
+            bookParts[bookShardOf(book->isbnCode(), bookShards)].push_back(book);
+        vector<User*> byId(users);
+        sort(byId.begin(), byId.end(), [](const User* a, const User* b) { return a->getId() < b->getId(); });
+        for(uint32_t s = 0; s < bookShards; s++)
+            next.bookFiles.push_back(prefix + "books." + to_string(s) + ".txt");
+        for(uint32_t s = 0; s < userShards; s++) {
+            next.userFiles.push_back(prefix + "users." + to_string(s) + ".txt");
+            next.userFirstIds.push_back(byId.empty() ? 0 : byId[byId.size() * s / userShards]->getId());
+        }
+
+        atomic<bool> failed(false);
+        runParallel(bookShards + userShards, threads, [&](size_t t) {
+            AtomicFileWriter out(shardPath(manifest, t < bookShards ? next.bookFiles[t] : next.userFiles[t - bookShards]));
+            if(t < bookShards) {
+                string line;
+                for(auto book : bookParts[t]) {
+                    formatBookLine(book, line);
+                    out.append(line);
+                }
+            } else {
+                size_t s = t - bookShards;
+                for(size_t i = byId.size() * s / userShards; i < byId.size() * (s + 1) / userShards; i++)
+                    out.append(formatUserLine(byId[i]));
+            }
+            if(!out.commit()) failed = true;
+        });
+        if(failed || !writeShardManifest(manifest, next)) {
+            for(auto &name : next.bookFiles)
+                remove(shardPath(manifest, name).c_str());
+            for(auto &name : next.userFiles)
+                remove(shardPath(manifest, name).c_str());
+            cout << "Error writing shards for " << manifest << ".\n";
+            return false;
+        }
+        if(replacing) {
+            for(auto &name : old.bookFiles)
+                remove(shardPath(manifest, name).c_str());
+            for(auto &name : old.userFiles)
+                remove(shardPath(manifest, name).c_str());
+        }
+        cout << "Library saved to " << bookShards << " book and " << userShards << " user shards listed in "
+             << manifest << "\n";
+        return true;
+    }
+
+    // Loads the sharded layout written by saveShards. Shards are parsed on
+    // up to `threads` threads (0 for one per core); books and users are
+    // then added in shard order on this one, as the catalog and its
+    // indexes take one writer. Returns false, leaving the library as it
+    // was, if there is no manifest, a shard cannot be read or a user shard
+    // holds an ID outside its range (user shard s holds the IDs from
+    // userFirstIds[s] up to the next shard's first ID).
+    bool loadShards(const string &manifest, size_t threads = 0) {
+        StatTimer timer(STAT_LOAD_TEXT);
+        ShardManifest m;
+        if(!readShardManifest(manifest, m)) return false;
+        size_t bookShards = m.bookFiles.size(), userShards = m.userFiles.size();
+        vector<MappedFile*> files;
+        for(size_t s = 0; s < bookShards + userShards; s++) {
+            string path = shardPath(manifest, s < bookShards ? m.bookFiles[s] : m.userFiles[s - bookShards]);
+            files.push_back(new MappedFile(path));
+            if(!files.back()->isOpen()) {
+                cout << "Could not open shard " << path << ".\n";
+                for(auto f : files)
+                    delete f;
+                return false;
+            }
+        }
+
+        // The user shards are only checked against their ranges here; they
+        // are parsed once the catalog they refer to is in place.
+        vector<vector<BookLine> > bookLines(bookShards);
+        vector<char> outOfRange(userShards, 0);
+        runParallel(bookShards + userShards, threads, [&](size_t t) {
+            TextSpan rest = files[t]->text(), line;
+            if(t >= bookShards) {
+                size_t s = t - bookShards;
+                TextSpan idField;
+                int id;
+                while(!outOfRange[s] && nextLine(rest, line))
+                    if(nextField(line, '|', idField) && parseInt(idField, id) &&
+                       (id < m.userFirstIds[s] || (s + 1 < userShards && id >= m.userFirstIds[s + 1])))
+                        outOfRange[s] = 1;
+                return;
+            }
+            BookLine parsed;
+            while(nextLine(rest, line))
+                if(parseBookLine(line, parsed))
+                    bookLines[t].push_back(parsed);
+        });
+        for(size_t s = 0; s < userShards; s++) {
+            if(outOfRange[s]) {
+                cout << "User shard " << shardPath(manifest, m.userFiles[s]) << " holds IDs outside its range in "
+                     << manifest << ".\n";
+                for(auto f : files)
+                    delete f;
+                return false;
+            }
+        }
+        for(auto book : books)
+            catalog.retire(book);
+        books.clear();
+        isbnIndex.clear();
+        removedIsbns.clear();
+        searchIndex.clear();
+        listing.clear();
+        bookLayout.reset();
+        userLayout.reset();
+        holds.clear();
+        for(auto user : users)
+            delete user;
+        users.clear();
+        userIndex.clear();
+        dueQueue.clear();
+        directory.clear();
+        baseSeq = 0;
+        for(auto &shard : bookLines)
+            for(auto &line : shard)
+                addBookLine(line);
+        matchLoadedPickups();
+        {
+            WriteGuard guard(catalogLock);
+            searchIndex.endBulkLoad();
+        }
+
+        // Accounts only read the catalog, so they are parsed concurrently.
+        vector<vector<User*> > parsedUsers(userShards);
+        IsbnResolver resolver(catalog, isbnIndex);
+        runParallel(userShards, threads, [&](size_t s) {
+            TextSpan rest = files[bookShards + s]->text(), line;
+            while(nextLine(rest, line))
+                if(User* user = parseUserLine(line, resolver))
+                    parsedUsers[s].push_back(user);
+        });
+        for(auto &shard : parsedUsers)
+            for(auto user : shard)
+                if(!insertUser(user)) // a repeated id; the first one wins
+                    delete user;
+        for(auto f : files)
+            delete f;
+        cout << "Library loaded from " << manifest << "\n";
+        return true;
+    }
+
+    // Smallest share of users.txt worth handing to a loader thread.
+    static const size_t LOADER_MIN_CHUNK = 1 << 20;
+
+    // Parses one users.txt line into a new User, or returns nullptr if the
+    // line is malformed. deferHistory is passed on to Account::deserialize.
+    static User* parseUserLine(TextSpan line, const IsbnResolver &books, bool deferHistory = false) {
+        TextSpan parts[5], field;
+        size_t count = 0;
+        while(nextField(line, '|', field)) {
+            if(count < 5) parts[count] = field;
+            count++;
+        }
+        int id;
+        UserRole role;
+        if(count != 5 || !parseInt(parts[0], id) || !parseRole(parts[3], role)) return nullptr;
+        User* user = createUser(role, id, parts[1].str(), parts[2].str());
+        user->getAccount().deserialize(parts[4], books, deferHistory);
+        return user;
+    }
+};
+
+// ------------------------
+// Account::deserialize Implementation
+// ------------------------
+template<class Resolve> void Account::parseRecords(TextSpan data, Resolve resolve, const IsbnResolver* deferTo) {
+    TextSpan parts[5], field, rest = data;
+    size_t count = 0;
+    while(nextField(rest, ',', field)) {
+         if(count < 5) parts[count] = field;
+         count++;
+    }
+    // serialize() ends with an empty history list when there is no
+    // history, so keep that trailing empty field.
+    if(count == 4 && !data.empty() && data.end[-1] == ',') parts[count++] = TextSpan(data.end, data.end);
+    if(count < 5) return; // invalid format
+    int borrowCount = 0, historyCount = 0;
+    if(!parseDouble(parts[0], fines) || !parseInt(parts[1], borrowCount) || !parseInt(parts[3], historyCount))
+         return;
+    clearBorrowedBooks();
+    if(borrowCount > 0) {
+         TextSpan records = parts[2], rec;
+         while(nextField(records, ';', rec)) {
+              TextSpan recParts[4], f;
+              size_t n = 0;
+              while(nextField(rec, ':', f)) {
+                   if(n < 4) recParts[n] = f;
+                   n++;
+              }
+              int bDate, dDate;
+              if((n == 3 || n == 4) && parseInt(recParts[1], bDate) && parseInt(recParts[2], dDate)) {
+                  BookCopy* c = resolveCopy(resolve, recParts[0], n == 4 ? &recParts[3] : nullptr);
+                  if(c)
+                     addBorrowedBook(c, bDate, dDate);
+              }
+         }
+    }
+    history.clear();
+    if(historyCount > 0) {
+         TextSpan records = parts[4], rec;
+         if(deferTo)
+              records = history.deferOlder(records, deferTo);
+         HistoryRecord hr;
+         while(nextField(records, ';', rec))
+              if(parseHistoryRecord(rec, resolve, hr))
+                   history.push_back(hr);
+    }
+}
+
+void Account::deserialize(TextSpan data, Library &lib) {
+    StatTimer timer(STAT_DESERIALIZE);
+    parseRecords(data, [&lib](TextSpan isbn) { return lib.findBookByISBN(isbn.str()); }, nullptr);
+}
+
+void Account::deserialize(TextSpan data, const IsbnResolver &books, bool deferHistory) {
+    StatTimer timer(STAT_DESERIALIZE);
+    parseRecords(data, [&books](TextSpan isbn) { return books.find(isbn); }, deferHistory ? &books : nullptr);
+}
+
+// ------------------------
+// Derived Classes Member Function Definitions
+// ------------------------
+
+// Offers a place in the hold line after a borrow failed because the book
+// is out; shared by the Student and Faculty menus.
+void offerHold(Library &lib, User* user, Book* book, int currentDay) {
+    cout << "Place a hold? You will be notified in your account details when a copy is set aside for you (Y/N): ";
+    char answer;
+    cin >> answer;
+    if(answer != 'Y' && answer != 'y') return;
+    switch(lib.placeHold(user, book, currentDay)) {
+        case HOLD_PLACED:
+            cout << "Hold placed on \"" << book->getTitle() << "\".\n";
+            break;
+        case HOLD_NOT_NEEDED:
+            cout << "The book has just become available; please borrow it instead.\n";
+            break;
+        case HOLD_DUPLICATE:
+            cout << "You already have this book or a hold on it.\n";
+            break;
+        default:
+            cout << "You cannot place holds.\n";
+    }
+}
+
+// Students and faculty
+template <class Policy>
+void Patron<Policy>::borrowBook(Library &lib) {
+    int currentDay = time(0) / (24 * 3600);
+    auto permitted = [](BorrowDenial denial) -> bool {
+        switch(denial) {
+            case DENY_LIMIT:
+                 cout << "Borrowing limit reached (max " << Policy::maxLoans << " books allowed).\n";
+                 return false;
+            case DENY_FINES:
+                 cout << "Please clear outstanding fines before borrowing.\n";
+                 return false;
+            case DENY_OVERDUE:
+                 cout << "You have a book overdue by more than " << Policy::overdueLimitDays
+                      << " days. Cannot borrow new books.\n";
+                 return false;
+            case DENY_UNAVAILABLE:
+                 cout << "Book is currently not available.\n";
+                 return false;
+            default: return true;
+        }
+    };
+    if(!permitted(checkBorrowRules(currentDay)))
+         return;
+    cout << "Enter ISBN of the book to borrow: ";
+    string isbn;
+    cin >> isbn;
+    Book* book = lib.findBookByISBN(isbn);
+    if(book == nullptr) {
+         cout << "Book not found.\n";
+         return;
+    }
+    // The rules are checked again together with availability, under the
+    // book's lock, as another session may have borrowed it meanwhile.
+    BorrowDenial denial = lib.tryCheckout(this, book, currentDay);
+    if(!permitted(denial)) {
+         if(denial == DENY_UNAVAILABLE)
+              offerHold(lib, this, book, currentDay);
+         return;
+    }
+    cout << "Book \"" << book->getTitle() << "\" borrowed successfully"
+         << ". Due after " << Policy::loanDays << " days" << ".\n";
+}
+
+template <class Policy>
+void Patron<Policy>::returnBook(Library &lib) {
+    cout << "Enter ISBN of the book to return: ";
+    string isbn;
+    cin >> isbn;
+    Book* book = lib.findBookByISBN(isbn);
+    if(book == nullptr) {
+         cout << "Book not found.\n";
+         return;
+    }
+    int currentDay = time(0) / (24 * 3600);
+    if(!lib.checkinBook(this, book, currentDay)) {
+         cout << "Error: Book not found in your borrowed list.\n";
+         return;
+    }
+    cout << "Book \"" << book->getTitle() << "\" returned successfully" << ".\n";
+}
+
+// Roles that are never fined have no Pay Fines entry; the entries after
+// it move up by one.
+template <class Policy>
+void Patron<Policy>::menu(Library &lib) {
+    const bool fined = Policy::finePerDay > 0;
+    const int logout = fined ? 7 : 6;
+    int choice;
+    do {
+        cout << "\n===== " << roleName(Policy::role) << " Menu =====\n";
+        cout << "1. Borrow Book\n2. Return Book\n3. View Account Details\n";
+        if(fined) cout << "4. Pay Fines\n";
+        cout << logout - 2 << ". List All Books\n" << logout - 1 << ". Search Books\n" << logout << ". Logout\n";
+        cout << "Enter your choice: ";
+        cin >> choice;
+        switch(!fined && choice >= 4 ? choice + 1 : choice) {
+            case 1: borrowBook(lib); break;
+            case 2: returnBook(lib); break;
+            case 3:
+                account.listBorrowedBooks();
+                lib.listHolds(this, time(0) / (24 * 3600));
+                lib.listHistory(this);
+                cout << "Outstanding Fines: " << account.fines << " rupees\n";
+                break;
+            case 4: 
+                if(account.fines > 0) {
+                    cout << "Paying fine of " << account.fines << " rupees.\n";
+                    lib.payFines(this);
+                } else {
+                    cout << "No outstanding fines.\n";
+                }
+                break;
+            case 5: lib.listBooks(); break;
+            case 6: lib.searchBooks(); break;
+            case 7: cout << "Logging out...\n"; break;
+            default: cout << "Invalid choice. Please try again.\n";
+        }
+    } while(choice != logout);
+}
+
+// Librarian
+void Librarian::borrowBook(Library &) {
+    cout << "Librarians cannot borrow books.\n";
+}
+
+void Librarian::returnBook(Library &) {
+    cout << "Librarians do not borrow books.\n";
+}
+
+void Librarian::menu(Library &lib) {
+    int choice;
+    do {
+        cout << "\n===== Librarian Menu =====\n";
+        cout << "1. Add Book\n2. Remove Book\n3. Update Book\n4. Add User\n5. Remove User\n6. Update User\n7. List Books\n8. List Users\n9. Search Books\n"
+             << "10. Overdue Loans\n11. Loans Due Soon\n12. Operation Statistics\n13. Logout\n";
+        cout << "Enter your choice: ";
+        cin >> choice;
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        switch(choice) {
+            case 1: {
+                string title, author, publisher, isbn;
+                int year;
+                cout << "Enter book title: ";
+                getline(cin, title);
+                cout << "Enter author: ";
+                getline(cin, author);
+                cout << "Enter publisher: ";
+                getline(cin, publisher);
+                cout << "Enter publication year: ";
+                cin >> year;
+                cout << "Enter ISBN: ";
+                cin >> isbn;
+                BookRecord newBook(title, author, publisher, year, isbn, AVAILABLE);
+                lib.addBook(newBook);
+                cout << "Book added successfully.\n";
+                break;
+            }
+            case 2: {
+                cout << "Enter ISBN of the book to remove: ";
+                string isbn;
+                cin >> isbn;
+                lib.removeBook(isbn);
+                break;
+            }
+            case 3: {
+                cout << "Enter ISBN of the book to update: ";
+                string isbn;
+                cin >> isbn;
+                Book* book = lib.findBookByISBN(isbn);
+                if(book == nullptr) {
+                    cout << "Book not found.\n";
+                    break;
+                }
+                cin.ignore();
+                cout << "Enter new title (or press enter to keep \"" << book->getTitle() << "\"): ";
+                string newTitle;
+                getline(cin, newTitle);
+                cout << "Enter new author (or press enter to keep \"" << book->getAuthor() << "\"): ";
+                string newAuthor;
+                getline(cin, newAuthor);
+                lib.updateBook(book, newTitle, newAuthor);
+                cout << "Book updated successfully.\n";
+                break;
+            }
+            case 4: {
+                cout << "Enter type of user to add (1. Student, 2. Faculty): ";
+                int type;
+                cin >> type;
+                int uid;
+                cout << "Enter new user ID: ";
+                cin >> uid;
+                if(lib.findUserById(uid) != nullptr) {
+                    cout << "User with ID " << uid << " already exists. Cannot add duplicate.\n";
+                    break;
+                }
+                cin.ignore();
+                cout << "Enter user name: ";
+                string uname;
+                getline(cin, uname);
+                cout << "Enter user password: ";
+                string pass;
+                getline(cin, pass);
+                if(type == 1) {
+                    lib.addUser(new Student(uid, uname, pass));
+                    cout << "Student added successfully.\n";
+                } else if(type == 2) {
+                    lib.addUser(new Faculty(uid, uname, pass));
+                    cout << "Faculty added successfully.\n";
+                } else {
+                    cout << "Invalid type.\n";
+                }
+                break;
+            }
+            case 5: {
+                cout << "Enter user ID to remove: ";
+                int uid;
+                cin >> uid;
+                lib.removeUser(uid);
+                break;
+            }
+            case 6: {
+                cout << "Enter user ID to update: ";
+                int uid;
+                cin >> uid;
+                lib.updateUser(uid);
+                break;
+            }
+            case 7: lib.listBooks(); break;
+            case 8: lib.listUsers(); break;
+            case 9: lib.searchBooks(); break;
+            case 10: lib.listOverdueLoans(time(0) / (24 * 3600)); break;
+            case 11: {
+                cout << "Show loans due within how many days? ";
+                int days;
+                cin >> days;
+                lib.listLoansDueWithin(time(0) / (24 * 3600), max(days, 0));
+                break;
+            }
+            case 12:
+                cout << "\n--- Operation Statistics (this session) ---\n";
+                reportOpStats(cout);
+                break;
+            case 13: cout << "Logging out...\n"; break;
+            default: cout << "Invalid choice. Please try again.\n";
+        }
+    } while(choice != 13);
+}
+
+// ------------------------
+// New User Registration Helper
+// ------------------------
+void registerNewUser(Library &lib) {
+    cout << "\n--- New User Registration ---\n";
+    cout << "Select user type:\n1. Student\n2. Faculty\nEnter choice: ";
+    int type;
+    cin >> type;
+    int uid;
+    cout << "Enter a new User ID (number): ";
+    cin >> uid;
+    if(lib.findUserById(uid) != nullptr) {
+        cout << "User ID already exists. Registration aborted.\n";
+        return;
+    }
+    cin.ignore();
+    cout << "Enter your name: ";
+    string uname;
+    getline(cin, uname);
+    cout << "Enter your password: ";
+    string pass;
+    getline(cin, pass);
+    if(type == 1) {
+        lib.addUser(new Student(uid, uname, pass));
+        cout << "Student registered successfully!\n";
+    } else if(type == 2) {
+        lib.addUser(new Faculty(uid, uname, pass));
+        cout << "Faculty registered successfully!\n";
+    } else {
+        cout << "Invalid user type selected.\n";
+    }
+}
+
+// ------------------------
+// Startup Helper
+// ------------------------
+// Loads the persisted library (seeding a default catalog on first run)
+// and opens the journal; shared by the interactive menus and batch mode.
+void openLibrary(Library &lib) {
+    // The snapshot is the primary store once it exists; the text files
+    // (sharded, if there is a manifest) are only read to seed a library
+    // that has never been checkpointed.
+    if(!lib.loadSnapshot("library.snap") && !lib.loadShards(SHARD_MANIFEST))
+        lib.loadData(); // Attempt to load data from files
+
+    if(lib.isBooksEmpty()){
+        lib.addBook(BookRecord("The C++ Programming Language", "Bjarne Stroustrup", "Addison-Wesley", 2013, "9780321563842"));
+        lib.addBook(BookRecord("Effective C++", "Scott Meyers", "O'Reilly Media", 2005, "9780321334879"));
+        lib.addBook(BookRecord("Clean Code", "Robert C. Martin", "Prentice Hall", 2008, "9780132350884"));
+        lib.addBook(BookRecord("Design Patterns", "Erich Gamma et al.", "Addison-Wesley", 1994, "9780201633610"));
+        lib.addBook(BookRecord("The Pragmatic Programmer", "Andrew Hunt", "Addison-Wesley", 1999, "9780201616224"));
+        lib.addBook(BookRecord("Introduction to Algorithms", "Cormen et al.", "MIT Press", 2009, "9780262033848"));
+        lib.addBook(BookRecord("Head First Design Patterns", "Eric Freeman", "O'Reilly Media", 2004, "9780596007126"));
+        lib.addBook(BookRecord("C++ Primer", "Stanley B. Lippman", "Addison-Wesley", 2012, "9780321714114"));
+        lib.addBook(BookRecord("Modern Operating Systems", "Andrew S. Tanenbaum", "Pearson", 2014, "9780133591620"));
+        lib.addBook(BookRecord("Computer Networks", "Andrew S. Tanenbaum", "Pearson", 2010, "9780132126953"));
+    }
+    if(lib.isUsersEmpty()){
+        lib.addUser(new Student(101, "Alice", "pass123"));
+        lib.addUser(new Student(102, "Bob", "pass123"));
+        lib.addUser(new Student(103, "Charlie", "pass123"));
+        lib.addUser(new Student(104, "Diana", "pass123"));
+        lib.addUser(new Student(105, "Evan", "pass123"));
+        lib.addUser(new Faculty(201, "Prof. Xavier", "pass123"));
+        lib.addUser(new Faculty(202, "Prof. Yvonne", "pass123"));
+        lib.addUser(new Faculty(203, "Prof. Zach", "pass123"));
+        lib.addUser(new Librarian(301, "Librarian Linda", "libpass"));
+    }
+    // Changes from an interrupted session are replayed here; from now on
+    // every change is journaled as it happens.
+    lib.openJournal("library.journal", "library.snap");
+}
+
+// ------------------------
+// Batch Mode
+// Run with: ./library_system --batch [commandFile]   (stdin if omitted or "-")
+// ------------------------
+// One command per line, fields separated by '|'; blank lines and lines
+// starting with '#' are ignored. day defaults to today.
+//   borrow|userId|isbn[|day]
+//   return|userId|isbn[|day]
+//   pay|userId
+//   add-book|title|author|publisher|year|isbn
+//   remove-book|isbn
+//   add-user|Student or Faculty or Librarian|id|name|password
+//   remove-user|id
+// Commands are applied with the same rules as the menus but without
+// prompts or per-command output; a throughput summary is printed at the end.
+class BatchRunner {
+private:
+    Library &lib;
+    int today;
+    size_t applied;
+    map<string, size_t> rejects;
+
+    void reject(const string &reason) { rejects[reason]++; }
+
+    // The overdue limit comes from the user's policy, so users of roles
+    // with different limits are counted under different reasons.
+    static string denialReason(BorrowDenial d, const User* user) {
+        switch(d) {
+            case DENY_LIMIT:   return "borrowing limit reached";
+            case DENY_FINES:   return "outstanding fines";
+            case DENY_OVERDUE: return "book overdue more than " + to_string(user->overdueLimitDays()) + " days";
+            case DENY_ROLE:    return "user type cannot borrow";
+            case DENY_UNAVAILABLE: return "book not available";
+            default:           return "borrowing not allowed";
+        }
+    }
+
+    bool dayField(const vector<TextSpan> &f, size_t i, int &day) {
+        day = today;
+        return f.size() <= i || parseInt(f[i], day);
+    }
+
+    void run(const vector<TextSpan> &f) {
+        const TextSpan &cmd = f[0];
+        int id, year, day;
+        if(cmd.equals("borrow") && (f.size() == 3 || f.size() == 4)) {
+            if(!parseInt(f[1], id) || !dayField(f, 3, day)) return reject("malformed command");
+            User* user = lib.findUserById(id);
+            if(!user) return reject("unknown user");
+            Book* book = lib.findBookByISBN(f[2].str());
+            if(!book) return reject("unknown book");
+            BorrowDenial denial = lib.tryCheckout(user, book, day);
+            if(denial != BORROW_ALLOWED) return reject(denialReason(denial, user));
+        } else if(cmd.equals("return") && (f.size() == 3 || f.size() == 4)) {
+            if(!parseInt(f[1], id) || !dayField(f, 3, day)) return reject("malformed command");
+            User* user = lib.findUserById(id);
+            if(!user) return reject("unknown user");
+            Book* book = lib.findBookByISBN(f[2].str());
+            if(!book) return reject("unknown book");
+            if(!lib.checkinBook(user, book, day)) return reject("book not borrowed by user");
+        } else if(cmd.equals("hold") && (f.size() == 3 || f.size() == 4)) {
+            if(!parseInt(f[1], id) || !dayField(f, 3, day)) return reject("malformed command");
+            User* user = lib.findUserById(id);
+            if(!user) return reject("unknown user");
+            Book* book = lib.findBookByISBN(f[2].str());
+            if(!book) return reject("unknown book");
+            HoldOutcome outcome = lib.placeHold(user, book, day);
+            if(outcome == HOLD_NOT_NEEDED) return reject("book is available");
+            if(outcome == HOLD_DUPLICATE) return reject("already borrowed or held by user");
+            if(outcome == HOLD_DENIED) return reject("user type cannot borrow");
+        } else if(cmd.equals("expire-holds") && (f.size() == 1 || f.size() == 2)) {
+            if(!dayField(f, 1, day)) return reject("malformed command");
+            lib.expireHolds(day);
+        } else if(cmd.equals("pay") && f.size() == 2) {
+            if(!parseInt(f[1], id)) return reject("malformed command");
+            User* user = lib.findUserById(id);
+            if(!user) return reject("unknown user");
+            if(user->getAccount().fines <= 0) return reject("no outstanding fines");
+            lib.payFines(user);
+        } else if(cmd.equals("add-book") && f.size() == 6) {
+            if(!parseInt(f[4], year)) return reject("malformed command");
+            lib.addBook(BookRecord(f[1].str(), f[2].str(), f[3].str(), year, f[5].str(), AVAILABLE));
+        } else if(cmd.equals("remove-book") && f.size() == 2) {
+            if(!lib.findBookByISBN(f[1].str())) return reject("unknown book");
+            lib.removeBook(f[1].str());
+        } else if(cmd.equals("add-user") && f.size() == 5) {
+            if(!parseInt(f[2], id)) return reject("malformed command");
+            if(lib.findUserById(id)) return reject("duplicate user id");
+            User* user = createUser(f[1].str(), id, f[3].str(), f[4].str());
+            if(!user) return reject("unknown user type");
+            lib.addUser(user);
+        } else if(cmd.equals("remove-user") && f.size() == 2) {
+            if(!parseInt(f[1], id)) return reject("malformed command");
+            if(!lib.findUserById(id)) return reject("unknown user");
+            lib.removeUser(id);
+        } else {
+            return reject("malformed command");
+        }
+        applied++;
+    }
+
+public:
+    explicit BatchRunner(Library &library) : lib(library), today(time(0) / (24 * 3600)), applied(0) {}
+
+    void runAll(TextSpan commands) {
+        TextSpan rest = commands, line, field;
+        vector<TextSpan> fields;
+        size_t total = 0;
+        // Library methods report to cout as they would in the menus; keep
+        // that out of the batch output.
+        streambuf* saved = cout.rdbuf();
+        ostringstream sink;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        lib.setDeferredDurability(true);
+        cout.rdbuf(sink.rdbuf());
+        while(nextLine(rest, line)) {
+            if(line.empty() || *line.begin == '#') continue;
+            fields.clear();
+            bool trailingEmpty = line.end[-1] == '|';
+            while(nextField(line, '|', field))
+                fields.push_back(field);
+            if(trailingEmpty)
+                fields.push_back(TextSpan(line.end, line.end));
+            run(fields);
+            total++;
+            if(sink.tellp() > (1 << 20)) sink.str("");
+        }
+        cout.rdbuf(saved);
+        bool durable = lib.flushJournal();
+        lib.setDeferredDurability(false);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t rejected = total - applied;
+        cout << "\n--- Batch Summary ---\n";
+        cout << "Commands: " << total << " | Applied: " << applied << " | Rejected: " << rejected << "\n";
+        cout << fixed << setprecision(3) << "Elapsed: " << seconds << " s | Throughput: "
+             << setprecision(0) << (seconds > 0 ? total / seconds : 0.0) << " ops/sec\n";
+        for(auto &r : rejects)
+            cout << "  rejected (" << r.first << "): " << r.second << "\n";
+        if(!durable)
+            cout << "Warning: some changes could not be written to the journal.\n";
+    }
+};
+
+int runBatch(const string &source) {
+    string input;
+    MappedFile file(source == "-" ? string() : source);
+    if(source == "-") {
+        input.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+    } else if(!file.isOpen()) {
+        cout << "Could not open batch file " << source << ".\n";
+        return 1;
+    }
+    Library library;
+    openLibrary(library);
+    BatchRunner runner(library);
+    runner.runAll(source == "-" ? TextSpan(input) : file.text());
+    library.checkpoint();
+    library.closeJournal();
+    return 0;
+}
+
+// ------------------------
+// Nightly Fine Accrual
+// Run with: ./library_system --accrue [day] [top]
+// ------------------------
+// Prints the fines accrued on all unreturned loans as of day (default:
+// today): totals, a histogram of days overdue, and the top accounts.
+// Nothing is charged; fines are still applied when a book is returned.
+int runAccrual(const vector<string> &args) {
+    int day = !args.empty() ? atoi(args[0].c_str()) : time(0) / (24 * 3600);
+    size_t top = args.size() > 1 ? max(atoi(args[1].c_str()), 0) : 10;
+    Library library;
+    openLibrary(library);
+    LoanColumns loans;
+    library.collectLoans(loans);
+    FineAccrual accrual;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    accrueFines(loans, day, accrual);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    cout << "\n--- Fine Accrual (day " << day << ") ---\n";
+    cout << "Active loans: " << loans.dueDates.size() << " on " << loans.userIds.size() << " accounts\n";
+    cout << "Overdue loans: " << accrual.overdueLoans << "\n";
+    cout << "Accrued fines: " << accrual.totalAccrued << " rupees\n";
+    cout << "Days overdue:\n";
+    for(int b = 0; b < ACCRUAL_BUCKETS; b++)
+        cout << "    " << left << setw(8) << ACCRUAL_BUCKET_NAMES[b] << right << setw(12) << accrual.histogram[b] << "\n";
+    vector<size_t> order;
+    for(size_t u = 0; u < accrual.accruedByUser.size(); u++)
+        if(accrual.accruedByUser[u] > 0) order.push_back(u);
+    top = min(top, order.size());
+    partial_sort(order.begin(), order.begin() + top, order.end(), [&accrual](size_t a, size_t b) {
+        return accrual.accruedByUser[a] > accrual.accruedByUser[b];
+    });
+    if(top > 0) cout << "Top accounts by accrued fines:\n";
+    for(size_t k = 0; k < top; k++) {
+        User* user = library.findUserById(loans.userIds[order[k]]);
+        cout << "    ID " << loans.userIds[order[k]] << " (" << (user ? user->getName() : "?") << "): "
+             << accrual.accruedByUser[order[k]] << " rupees\n";
+    }
+    cout << "Computed in " << fixed << setprecision(2) << ms << " ms.\n";
+    library.closeJournal();
+    return 0;
+}
+
+// ------------------------
+// Synthetic Data Generator
+// Run with: ./library_system --generate books users history booksFile usersFile [seed] [--force]
+// ------------------------
+// Buffered text writer for the generator; avoids an ostream call per field.
+class OutputBuffer {
+private:
+    FILE* file;
+    string buffer;
+public:
+    explicit OutputBuffer(const string &path) : file(fopen(path.c_str(), "wb")) { buffer.reserve(1 << 20); }
+    ~OutputBuffer() {
+        flush();
+        if(file) fclose(file);
+    }
+    bool isOpen() const { return file != nullptr; }
+    void flush() {
+        if(file && !buffer.empty()) fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+    OutputBuffer& operator<<(const string &s) { buffer += s; return check(); }
+    OutputBuffer& operator<<(const char* s) { buffer += s; return check(); }
+    OutputBuffer& operator<<(char c) { buffer += c; return check(); }
+    OutputBuffer& operator<<(int v) { buffer += to_string(v); return check(); }
+    OutputBuffer& check() {
+        if(buffer.size() >= (1 << 20)) flush();
+        return *this;
+    }
+};
+
+string syntheticISBN(int index) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "978%010d", index);
+    return buf;
+}
+
+// Writes a synthetic books/users pair in the text format loadData reads.
+// Titles and authors are drawn from word and name lists, so authors and
+// publishers repeat the way they do in a real catalog. Active loans
+// respect each role's limit and mark their copy Borrowed. History depth
+// is exponentially distributed around historyPerUser, and history
+// borrows favour a small set of popular books.
+void writeSyntheticData(const string &booksFile, const string &usersFile,
+                        int bookCount, int userCount, int historyPerUser, unsigned seed) {
+    static const char* words[] = {"Data", "Systems", "Introduction", "Modern", "Advanced", "Algorithms",
+                                  "Networks", "Design", "Programming", "Theory", "Applied", "Principles",
+                                  "Computer", "Structures", "Operating", "Analysis", "Concepts", "Engineering",
+                                  "Software", "Database", "Distributed", "Compilers", "Machine", "Learning",
+                                  "Artificial", "Intelligence", "Graphics", "Security", "Practical", "Handbook",
+                                  "Foundations", "Patterns", "Architecture", "Parallel", "Numerical", "Methods"};
+    static const char* firstNames[] = {"Andrew", "Bjarne", "Thomas", "Scott", "Robert", "Donald", "Eric", "Stanley",
+                                       "Abraham", "Ian", "Michael", "Jon", "Brian", "Dennis", "Alfred", "Jeffrey",
+                                       "Ravi", "Niklaus", "Barbara", "Edsger", "Frances", "Grace", "Leslie", "Tim",
+                                       "Anita", "Radia", "Shafi", "Silvio", "Judea", "Yoshua", "Geoffrey", "Yann",
+                                       "Christos", "Mihalis", "Sanjeev", "Umesh", "Ashok", "Sartaj", "Kurt", "Herbert"};
+    static const char* lastNames[] = {"Tanenbaum", "Stroustrup", "Cormen", "Meyers", "Martin", "Knuth", "Freeman",
+                                      "Lippman", "Silberschatz", "Sommerville", "Sipser", "Kleinberg", "Kernighan",
+                                      "Ritchie", "Aho", "Ullman", "Sethi", "Wirth", "Liskov", "Dijkstra", "Allen",
+                                      "Hopper", "Lamport", "Berners-Lee", "Borg", "Perlman", "Goldwasser", "Micali",
+                                      "Pearl", "Bengio", "Hinton", "LeCun", "Papadimitriou", "Yannakakis", "Arora",
+                                      "Vazirani", "Chandra", "Sahni", "Mehlhorn", "Simon", "Patterson", "Hennessy",
+                                      "Russell", "Norvig", "Bishop", "Mitchell", "Forouzan", "Stallings", "Kurose",
+                                      "Ross"};
+    static const char* publishers[] = {"Addison-Wesley", "Pearson", "MIT Press", "O'Reilly Media", "Prentice Hall",
+                                       "McGraw-Hill", "Springer", "Wiley", "Cambridge University Press",
+                                       "Oxford University Press", "Morgan Kaufmann", "No Starch Press"};
+    const int wordCount = sizeof(words) / sizeof(words[0]);
+    const int firstCount = sizeof(firstNames) / sizeof(firstNames[0]);
+    const int lastCount = sizeof(lastNames) / sizeof(lastNames[0]);
+    const int publisherCount = sizeof(publishers) / sizeof(publishers[0]);
+    mt19937 rng(seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    exponential_distribution<double> depth(historyPerUser > 0 ? 1.0 / historyPerUser : 1.0);
+    vector<char> borrowed(bookCount, 0);
+    int today = time(0) / (24 * 3600);
+
+    OutputBuffer users(usersFile);
+    int nextLoan = 0;
+    string loans, past;
+    for(int u = 0; u < userCount; u++) {
+        bool librarian = (u % 1000 == 999);
+        bool faculty = !librarian && (u % 10 == 0);
+        int period = faculty ? 30 : 15;
+        users << (1000 + u) << "|Patron " << u << "|pass" << u << "|"
+              << (librarian ? "Librarian" : faculty ? "Faculty" : "Student") << "|";
+        loans.clear();
+        past.clear();
+        int loanCount = 0;
+        int wanted = librarian ? 0 : (int)(rng() % (faculty ? 6 : 4));
+        for(int k = 0; k < wanted && nextLoan < bookCount; k++, nextLoan++) {
+            int day = today - (int)(rng() % 40);
+            if(loanCount) loans += ';';
+            loans += syntheticISBN(nextLoan) + ":" + to_string(day) + ":" + to_string(day + period);
+            borrowed[nextLoan] = 1;
+            loanCount++;
+        }
+        int historyCount = (librarian || historyPerUser <= 0 || bookCount == 0) ? 0 : (int)min(depth(rng), 50.0 * historyPerUser);
+        double fines = 0;
+        int day = today - 30 * historyCount - 30;
+        for(int h = 0; h < historyCount; h++) {
+            day += 1 + (int)(rng() % 30);
+            int due = day + period;
+            int returned = day + (int)(rng() % (period + 10));
+            int fine = (!faculty && returned > due) ? (returned - due) * 10 : 0;
+            fines += fine;
+            int book = (int)(bookCount * pow(unit(rng), 3.0)) % bookCount; // skewed towards popular titles
+            if(h) past += ';';
+            past += syntheticISBN(book) + ":" + to_string(day) + ":" + to_string(due) + ":" +
+                    to_string(returned) + ":" + to_string(fine);
+        }
+        // Outstanding fines are whatever part of the history has not been paid.
+        int outstanding = (fines > 0 && rng() % 4 == 0) ? (int)fines : 0;
+        users << outstanding << "," << loanCount << "," << loans << "," << historyCount << "," << past << "\n";
+    }
+
+    OutputBuffer books(booksFile);
+    string title;
+    for(int i = 0; i < bookCount; i++) {
+        title = words[rng() % wordCount];
+        int extra = 1 + rng() % 3;
+        for(int w = 0; w < extra; w++) {
+            title += ' ';
+            title += words[rng() % wordCount];
+        }
+        // A few hundred thousand distinct authors at most, most of them prolific.
+        int author = (int)(pow(unit(rng), 2.0) * firstCount * lastCount);
+        books << title << " " << (i % 7 + 1) << "e," << firstNames[author % firstCount] << " "
+              << lastNames[author / firstCount % lastCount] << "," << publishers[rng() % publisherCount] << ","
+              << 1950 + (int)(rng() % 75) << "," << syntheticISBN(i) << "," << (borrowed[i] ? BORROWED : AVAILABLE) << "\n";
+    }
+}
+
+// The output files must be named, and existing files are only replaced
+// with --force, so that a generated data set never lands on the library's
+// own books.txt/users.txt by accident.
+int runGenerator(const vector<string> &options) {
+    vector<string> args;
+    bool force = false;
+    for(const string &a : options) {
+        if(a == "--force") force = true;
+        else args.push_back(a);
+    }
+    if(args.size() < 5) {
+        cout << "Usage: --generate books users history booksFile usersFile [seed] [--force]\n";
+        return 1;
+    }
+    int bookCount = atoi(args[0].c_str()), userCount = atoi(args[1].c_str()), history = atoi(args[2].c_str());
+    string booksFile = args[3];
+    string usersFile = args[4];
+    unsigned seed = args.size() > 5 ? (unsigned)atoi(args[5].c_str()) : 1;
+    if(!force) {
+        for(const string &file : {booksFile, usersFile}) {
+            if(ifstream(file).good()) {
+                cout << file << " already exists; add --force to overwrite it.\n";
+                return 1;
+            }
+        }
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    writeSyntheticData(booksFile, usersFile, bookCount, userCount, history, seed);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Wrote " << bookCount << " books to " << booksFile << " and " << userCount << " users to "
+         << usersFile << " in " << fixed << setprecision(1) << seconds << " s\n";
+    return 0;
+}
+
+// ------------------------
+// Benchmarks
+// Run with: ./library_system --bench [suite] [options]
+// ------------------------
+typedef chrono::steady_clock BenchClock;
+
+double nsSince(BenchClock::time_point start) {
+    return chrono::duration<double, nano>(BenchClock::now() - start).count();
+}
+
+// The original getline/stringstream loader, kept as the baseline that the
+// mmap loader in Library::loadData is measured against.
+void legacyLoadData(Library &lib, const string &booksFile, const string &usersFile) {
+    ifstream fin(booksFile);
+    string line;
+    while(getline(fin, line)){
+        stringstream ss(line);
+        string title, author, publisher, yearStr, isbn, statusStr;
+        if(getline(ss, title, ',') && getline(ss, author, ',') && getline(ss, publisher, ',') &&
+           getline(ss, yearStr, ',') && getline(ss, isbn, ',') && getline(ss, statusStr)){
+            for(size_t c = 0; c < statusStr.size() && statusStr[c] >= '0' && statusStr[c] <= '9'; c++)
+                lib.addBook(BookRecord(title, author, publisher, stoi(yearStr), isbn, static_cast<BookStatus>(statusStr[c] - '0')));
+        }
+    }
+    ifstream fin2(usersFile);
+    while(getline(fin2, line)){
+        vector<string> parts;
+        stringstream ss(line);
+        string token;
+        while(getline(ss, token, '|'))
+            parts.push_back(token);
+        if(parts.size() != 5) continue;
+        int id = stoi(parts[0]);
+        User* user = nullptr;
+        if(parts[3] == "Student") user = new Student(id, parts[1], parts[2]);
+        else if(parts[3] == "Faculty") user = new Faculty(id, parts[1], parts[2]);
+        else if(parts[3] == "Librarian") user = new Librarian(id, parts[1], parts[2]);
+        if(!user) continue;
+        Account &acc = user->getAccount();
+        vector<string> fields;
+        stringstream sa(parts[4]);
+        while(getline(sa, token, ','))
+            fields.push_back(token);
+        if(fields.size() == 4 && !parts[4].empty() && parts[4].back() == ',') fields.push_back("");
+        if(fields.size() >= 5) {
+            acc.fines = stod(fields[0]);
+            for(int pass = 0; pass < 2; pass++) {
+                stringstream sr(fields[pass == 0 ? 2 : 4]);
+                string rec;
+                while(getline(sr, rec, ';')) {
+                    vector<string> rp;
+                    stringstream sf(rec);
+                    string f;
+                    while(getline(sf, f, ':'))
+                        rp.push_back(f);
+                    Book* b = rp.empty() ? nullptr : lib.findBookByISBN(rp[0]);
+                    size_t fields = (pass == 0) ? 3 : 5;
+                    BookCopy* c = b ? b->copy(rp.size() > fields ? stoi(rp[fields]) : 1) : nullptr;
+                    if(!c) continue;
+                    if(pass == 0 && (rp.size() == 3 || rp.size() == 4))
+                        acc.addBorrowedBook(c, stoi(rp[1]), stoi(rp[2]));
+                    else if(pass == 1 && (rp.size() == 5 || rp.size() == 6))
+                        acc.history.push_back({c, stoi(rp[1]), stoi(rp[2]), stoi(rp[3]), stod(rp[4])});
+                }
+            }
+        }
+        lib.addUser(user);
+    }
+}
+
+string readWholeFile(const string &path) {
+    ifstream fin(path, ios::binary);
+    return string(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+}
+
+// Times startup on a synthetic data set with the legacy stream loader, the
+// mmap loader and the binary snapshot, and checks all three produce the
+// same library state. The mmap and snapshot times include reading every
+// account; the lazy times are what startup costs before any lookup.
+void benchLoad() {
+    cout << "\n--- Startup (loadData) benchmark ---\n";
+    const string booksFile = "bench_books.txt", usersFile = "bench_users.txt";
+    const int bookCount = 200000, userCount = 50000, historyPerUser = 20;
+    writeSyntheticData(booksFile, usersFile, bookCount, userCount, historyPerUser, 7);
+    cout << bookCount << " books, " << userCount << " users, " << historyPerUser << " history records each\n";
+
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    double legacyMs, mmapMs, snapshotMs, lazyTextMs, lazySnapshotMs;
+    {
+        Library lib;
+        BenchClock::time_point start = BenchClock::now();
+        legacyLoadData(lib, booksFile, usersFile);
+        legacyMs = nsSince(start) / 1e6;
+        cout.rdbuf(sink.rdbuf());
+        lib.saveData("bench_books.legacy", "bench_users.legacy");
+        cout.rdbuf(saved);
+    }
+    {
+        Library lib;
+        cout.rdbuf(sink.rdbuf());
+        BenchClock::time_point start = BenchClock::now();
+        lib.loadData(booksFile, usersFile);
+        lazyTextMs = nsSince(start) / 1e6;
+        lib.loadAllUsers();
+        mmapMs = nsSince(start) / 1e6;
+        lib.saveData("bench_books.mmap", "bench_users.mmap");
+        lib.saveSnapshot("bench.snap");
+        cout.rdbuf(saved);
+    }
+    {
+        Library lib;
+        cout.rdbuf(sink.rdbuf());
+        BenchClock::time_point start = BenchClock::now();
+        lib.loadSnapshot("bench.snap");
+        lazySnapshotMs = nsSince(start) / 1e6;
+        lib.loadAllUsers();
+        snapshotMs = nsSince(start) / 1e6;
+        lib.saveData("bench_books.snap", "bench_users.snap");
+        cout.rdbuf(saved);
+    }
+    bool identical = readWholeFile("bench_books.legacy") == readWholeFile("bench_books.mmap") &&
+                     readWholeFile("bench_users.legacy") == readWholeFile("bench_users.mmap") &&
+                     readWholeFile("bench_books.mmap") == readWholeFile("bench_books.snap") &&
+                     readWholeFile("bench_users.mmap") == readWholeFile("bench_users.snap");
+    cout << fixed << setprecision(1);
+    cout << "stream loader: " << legacyMs << " ms\n";
+    cout << "mmap loader:   " << mmapMs << " ms (" << setprecision(2) << legacyMs / mmapMs << "x)\n";
+    cout << setprecision(1) << "snapshot:      " << snapshotMs << " ms (" << setprecision(2) << legacyMs / snapshotMs << "x)\n";
+    cout << setprecision(1) << "lazy startup:  " << lazyTextMs << " ms from text, " << lazySnapshotMs
+         << " ms from snapshot (accounts read on first lookup)\n";
+    cout << "identical state: " << (identical ? "yes" : "NO") << "\n";
+    const char* scratch[] = {"bench_books.txt", "bench_users.txt", "bench_books.legacy", "bench_users.legacy",
+                             "bench_books.mmap", "bench_users.mmap", "bench_books.snap", "bench_users.snap",
+                             "bench.snap", "bench_users.txt.idx"};
+    for(auto f : scratch) remove(f);
+}
+
+// Saves and loads a generated library in the sharded layout on 1, 2, 4 ...
+// up to `threads` threads, against the single-file text format, and
+// checks that the library read back from the shards holds the same books
+// and users (in shard order, so the lines are compared sorted).
+bool benchShards(int bookCount, int userCount, int threads) {
+    cout << "\n--- Sharded files benchmark ---\n";
+    const string booksFile = "bench_shard_books.txt", usersFile = "bench_shard_users.txt";
+    const string manifest = "bench.shards";
+    writeSyntheticData(booksFile, usersFile, bookCount, userCount, 20, 5);
+    uint32_t shards = max<uint32_t>(DEFAULT_SHARDS, 2 * threads);
+    cout << bookCount << " books, " << userCount << " users, " << shards << " book and " << shards << " user shards\n";
+
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    Library lib;
+    cout.rdbuf(sink.rdbuf());
+    BenchClock::time_point start = BenchClock::now();
+    lib.loadData(booksFile, usersFile);
+    lib.loadAllUsers();
+    double loadMs = nsSince(start) / 1e6;
+    start = BenchClock::now();
+    lib.saveData("bench_shard_books.out", "bench_shard_users.out");
+    double saveMs = nsSince(start) / 1e6;
+    cout.rdbuf(saved);
+    cout << fixed << setprecision(1) << "single file: load " << loadMs << " ms, save " << saveMs << " ms\n";
+    cout << setw(8) << "threads" << setw(12) << "save (ms)" << setw(12) << "load (ms)" << setw(10) << "save x"
+         << setw(10) << "load x" << "\n";
+
+    for(int t = 1;; t = min(2 * t, threads)) {
+        cout.rdbuf(sink.rdbuf());
+        start = BenchClock::now();
+        lib.saveShards(manifest, shards, shards, t);
+        double shardSaveMs = nsSince(start) / 1e6;
+        Library copy;
+        start = BenchClock::now();
+        copy.loadShards(manifest, t);
+        double shardLoadMs = nsSince(start) / 1e6;
+        if(t == threads)
+            copy.saveData("bench_shard_books.back", "bench_shard_users.back");
+        cout.rdbuf(saved);
+        cout << setw(8) << t << setw(12) << setprecision(1) << shardSaveMs << setw(12) << shardLoadMs
+             << setw(10) << setprecision(2) << saveMs / shardSaveMs << setw(10) << loadMs / shardLoadMs << "\n";
+        if(t == threads) break;
+    }
+    auto sortedLines = [](const string &file) {
+        istringstream in(readWholeFile(file));
+        vector<string> lines;
+        string line;
+        while(getline(in, line))
+            lines.push_back(line);
+        sort(lines.begin(), lines.end());
+        return lines;
+    };
+    bool identical = sortedLines("bench_shard_books.out") == sortedLines("bench_shard_books.back") &&
+                sortedLines("bench_shard_users.out") == sortedLines("bench_shard_users.back");
+    cout << "identical state: " << (identical ? "yes" : "NO") << "\n";
+
+    ShardManifest m;
+    if(readShardManifest(manifest, m)) {
+        for(auto &name : m.bookFiles) remove(shardPath(manifest, name).c_str());
+        for(auto &name : m.userFiles) remove(shardPath(manifest, name).c_str());
+    }
+    const char* scratch[] = {"bench.shards", "bench_shard_books.txt", "bench_shard_users.txt", "bench_shard_users.txt.idx",
+                             "bench_shard_books.out", "bench_shard_users.out", "bench_shard_books.back",
+                             "bench_shard_users.back"};
+    for(auto f : scratch) remove(f);
+    return identical;
+}
+
+// Measures bulk registration and login lookups at growing user counts.
+// Both columns should stay roughly flat if the user directory is O(1).
+void benchUsers() {
+    cout << "\n--- User directory benchmark ---\n";
+    cout << setw(10) << "users" << setw(18) << "add (ns/user)" << setw(20) << "login (ns/lookup)" << "\n";
+    const int lookups = 200000;
+    mt19937 rng(42);
+    for(int n : {1000, 10000, 100000, 400000}) {
+        Library lib;
+        BenchClock::time_point start = BenchClock::now();
+        for(int i = 0; i < n; i++)
+            lib.addUser(new Student(100000 + i, "User", "pass"));
+        double addNs = nsSince(start) / n;
+
+        uniform_int_distribution<int> pick(100000, 100000 + n - 1);
+        long found = 0;
+        start = BenchClock::now();
+        for(int i = 0; i < lookups; i++) {
+            User* user = lib.findUserById(pick(rng));
+            if(user && user->checkPassword("pass")) found++;
+        }
+        double loginNs = nsSince(start) / lookups;
+        if(found != lookups) cout << "(warning: " << lookups - found << " lookups missed)\n";
+        cout << setw(10) << n << setw(18) << fixed << setprecision(1) << addNs
+             << setw(20) << loginNs << "\n";
+    }
+}
+
+// Collects per-sample timings and reports order statistics; medians and
+// high percentiles are far steadier between runs than means.
+class LatencyStats {
+private:
+    vector<double> samples;
+public:
+    void add(double value) { samples.push_back(value); }
+
+    double percentile(double p) const {
+        if(samples.empty()) return 0;
+        size_t rank = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+        return samples[rank];
+    }
+
+    // Prints one table row; values are divided by scale first.
+    void report(const string &name, const string &unit, double scale = 1.0) {
+        sort(samples.begin(), samples.end());
+        cout << left << setw(22) << name << right << setw(8) << samples.size() << fixed << setprecision(1);
+        const double ps[] = {0, 50, 90, 99, 100};
+        for(double p : ps)
+            cout << setw(12) << percentile(p) / scale;
+        cout << "  " << unit << "\n";
+    }
+
+    static void printHeader() {
+        cout << left << setw(22) << "operation" << right << setw(8) << "samples" << setw(12) << "min"
+             << setw(12) << "p50" << setw(12) << "p90" << setw(12) << "p99" << setw(12) << "max" << "\n";
+    }
+};
+
+// Times the library core on a generated data set of the given size. Each
+// operation is sampled many times (per-op figures are averaged over small
+// groups of calls to stay above clock resolution) and reported as
+// min/p50/p90/p99/max so runs of different builds can be compared.
+void benchCore(int bookCount, int userCount, int historyPerUser) {
+    cout << "\n--- Core benchmark ---\n";
+    cout << bookCount << " books, " << userCount << " users, ~" << historyPerUser << " history records per user\n";
+    const string booksFile = "bench_core_books.txt", usersFile = "bench_core_users.txt";
+    const string outBooks = "bench_core_books.out", outUsers = "bench_core_users.out";
+    writeSyntheticData(booksFile, usersFile, bookCount, userCount, historyPerUser, 11);
+    mt19937 rng(3);
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    LatencyStats::printHeader();
+
+    const int fileRuns = 5;
+    LatencyStats lazyLoad, load, save;
+    Library* lib = nullptr;
+    for(int r = 0; r <= fileRuns; r++) {
+        delete lib;
+        lib = new Library;
+        cout.rdbuf(sink.rdbuf());
+        BenchClock::time_point start = BenchClock::now();
+        lib->loadData(booksFile, usersFile);
+        double lazyNs = nsSince(start);
+        lib->loadAllUsers();
+        double ns = nsSince(start);
+        cout.rdbuf(saved);
+        if(r > 0) { // first run warms the page cache
+            lazyLoad.add(lazyNs);
+            load.add(ns);
+        }
+    }
+    lazyLoad.report("loadData (lazy)", "ms", 1e6);
+    load.report("loadData (all)", "ms", 1e6);
+    for(int r = 0; r <= fileRuns; r++) {
+        remove(outBooks.c_str()); // a save over an unchanged file is incremental
+        remove(outUsers.c_str());
+        cout.rdbuf(sink.rdbuf());
+        BenchClock::time_point start = BenchClock::now();
+        lib->saveData(outBooks, outUsers);
+        double ns = nsSince(start);
+        cout.rdbuf(saved);
+        if(r > 0) save.add(ns);
+    }
+    save.report("saveData (full)", "ms", 1e6);
+    // Saves over the previous output after 100 loans and returns of
+    // random books by random users.
+    LatencyStats saveChanged;
+    int saveDay = time(0) / (24 * 3600);
+    for(int r = 0; r < fileRuns; r++) {
+        for(int k = 0; k < 100; k++) {
+            Book* book = lib->findBookByISBN(syntheticISBN(rng() % bookCount));
+            User* user = lib->findUserById(1000 + rng() % userCount);
+            BookCopy* copy = book ? book->freeCopy() : nullptr;
+            if(!copy || !user || user->getRole() == ROLE_LIBRARIAN) continue;
+            lib->checkoutBook(user, copy, saveDay, saveDay + user->loanPeriod());
+            lib->checkinCopy(user, copy, saveDay);
+        }
+        cout.rdbuf(sink.rdbuf());
+        BenchClock::time_point start = BenchClock::now();
+        lib->saveData(outBooks, outUsers);
+        double ns = nsSince(start);
+        cout.rdbuf(saved);
+        saveChanged.add(ns);
+    }
+    saveChanged.report("saveData (100 changes)", "ms", 1e6);
+
+    const int samples = 500, group = 200;
+    vector<string> isbns(group);
+    size_t hits = 0; // consumed below so the lookups are not optimised away
+    LatencyStats findBook;
+    for(int s = 0; s < samples; s++) {
+        for(auto &isbn : isbns) isbn = syntheticISBN(rng() % bookCount);
+        BenchClock::time_point start = BenchClock::now();
+        for(auto &isbn : isbns)
+            hits += lib->findBookByISBN(isbn) != nullptr;
+        findBook.add(nsSince(start) / group);
+    }
+    findBook.report("findBookByISBN", "ns/op");
+
+    vector<int> ids(group);
+    LatencyStats findUser;
+    for(int s = 0; s < samples; s++) {
+        for(auto &id : ids) id = 1000 + rng() % userCount;
+        BenchClock::time_point start = BenchClock::now();
+        for(int id : ids)
+            hits += lib->findUserById(id) != nullptr;
+        findUser.add(nsSince(start) / group);
+    }
+    findUser.report("findUserById", "ns/op");
+
+    // Queries are substrings of real titles, authors and ISBNs.
+    LatencyStats search[3];
+    size_t matches = 0;
+    for(int s = 0; s < 300; s++) {
+        Book* book = lib->findBookByISBN(syntheticISBN(rng() % bookCount));
+        for(int f = 0; f < 3; f++) {
+            string text = (f == SEARCH_TITLE) ? book->getTitle() : (f == SEARCH_AUTHOR) ? book->getAuthor() : book->getISBN();
+            size_t len = min(text.size(), (size_t)(4 + rng() % 5));
+            string query = text.substr(rng() % (text.size() - len + 1), len);
+            BenchClock::time_point start = BenchClock::now();
+            matches += lib->findBooks(static_cast<SearchField>(f), query).size();
+            search[f].add(nsSince(start));
+        }
+    }
+    search[SEARCH_TITLE].report("searchBooks (title)", "us/query", 1e3);
+    search[SEARCH_AUTHOR].report("searchBooks (author)", "us/query", 1e3);
+    search[SEARCH_ISBN].report("searchBooks (ISBN)", "us/query", 1e3);
+
+    // Autocomplete: the first 1-6 characters of real titles and authors.
+    LatencyStats suggest[2];
+    for(int s = 0; s < 1000; s++) {
+        Book* book = lib->findBookByISBN(syntheticISBN(rng() % bookCount));
+        for(int f = 0; f < 2; f++) {
+            string text = (f == SEARCH_TITLE) ? book->getTitle() : book->getAuthor();
+            string prefix = text.substr(0, 1 + rng() % 6);
+            BenchClock::time_point start = BenchClock::now();
+            matches += lib->suggestBooks(static_cast<SearchField>(f), prefix, 10).size();
+            suggest[f].add(nsSince(start));
+        }
+    }
+    suggest[SEARCH_TITLE].report("suggestBooks (title)", "us/query", 1e3);
+    suggest[SEARCH_AUTHOR].report("suggestBooks (author)", "us/query", 1e3);
+
+    // Sorted listing: the first page of each order sorts the catalog, the
+    // following ones, at random places, read the order as kept.
+    vector<Book*> page;
+    LatencyStats firstPage, nextPage[4];
+    for(int o = 0; o < 4; o++) {
+        SortOrder order = static_cast<SortOrder>(o);
+        BenchClock::time_point start = BenchClock::now();
+        size_t total = max<size_t>(1, lib->listBooks(order, 0, LIST_PAGE_SIZE, page));
+        firstPage.add(nsSince(start));
+        for(int s = 0; s < samples; s++) {
+            start = BenchClock::now();
+            matches += lib->listBooks(order, rng() % total, LIST_PAGE_SIZE, page) > 0;
+            nextPage[o].add(nsSince(start));
+        }
+    }
+    firstPage.report("listBooks (sort)", "ms", 1e6);
+    for(int o = 0; o < 4; o++)
+        nextPage[o].report(string("listBooks (") + sortOrderName(static_cast<SortOrder>(o)) + ")", "us/page", 1e3);
+
+    // Borrow/return pairs on copies that are on the shelf.
+    vector<BookCopy*> shelf;
+    for(int i = bookCount - 1; i >= 0 && shelf.size() < 1000; i--) {
+        Book* book = lib->findBookByISBN(syntheticISBN(i));
+        if(book && book->freeCopy()) shelf.push_back(book->freeCopy());
+    }
+    User* patron = lib->findUserById(1001);
+    LatencyStats borrow, giveBack;
+    int today = time(0) / (24 * 3600);
+    for(int s = 0; s < samples && patron && !shelf.empty(); s++) {
+        BookCopy* copy = shelf[s % shelf.size()];
+        BenchClock::time_point start = BenchClock::now();
+        lib->checkoutBook(patron, copy, today, today + patron->loanPeriod());
+        borrow.add(nsSince(start));
+        start = BenchClock::now();
+        lib->checkinCopy(patron, copy, today + 1);
+        giveBack.add(nsSince(start));
+    }
+    borrow.report("borrow", "ns/op");
+    giveBack.report("return", "ns/op");
+
+    // Reports served by the due-date queue.
+    LatencyStats overdue, dueSoon;
+    size_t overdueCount = 0, dueSoonCount = 0;
+    for(int s = 0; s < 50; s++) {
+        BenchClock::time_point start = BenchClock::now();
+        overdueCount = lib->overdueLoans(today).size();
+        overdue.add(nsSince(start));
+        start = BenchClock::now();
+        dueSoonCount = lib->loansDueBetween(today, today + 7).size();
+        dueSoon.add(nsSince(start));
+    }
+    overdue.report("overdueLoans", "us/report", 1e3);
+    dueSoon.report("loansDueBetween (7d)", "us/report", 1e3);
+
+    LatencyStats serialize, deserialize;
+    vector<string> encoded(group);
+    Account scratch;
+    for(int s = 0; s < samples; s++) {
+        int first = rng() % userCount;
+        BenchClock::time_point start = BenchClock::now();
+        for(int k = 0; k < group; k++) {
+            User* user = lib->findUserById(1000 + (first + k) % userCount);
+            encoded[k] = user->getAccount().serialize();
+        }
+        serialize.add(nsSince(start) / group);
+        start = BenchClock::now();
+        for(auto &data : encoded)
+            scratch.deserialize(data, *lib);
+        deserialize.add(nsSince(start) / group);
+    }
+    serialize.report("Account::serialize", "ns/account");
+    deserialize.report("Account::deserialize", "ns/account");
+    cout << "(" << hits << " lookups hit, search matched " << matches << " books in total, " << overdueCount
+         << " loans overdue, " << dueSoonCount << " due within 7 days)\n";
+
+    delete lib;
+    const char* scratchFiles[] = {"bench_core_books.txt", "bench_core_users.txt", "bench_core_books.out", "bench_core_users.out",
+                                  "bench_core_users.txt.idx"};
+    for(auto f : scratchFiles) remove(f);
+}
+
+// Ranked search on a generated catalog: author names, misspelled names and
+// title words with a typo, scored on one thread and on several. Returns
+// false if splitting the scoring across threads changed any result or the
+// slowest p99 is over the interactive budget.
+bool benchSearch(int bookCount, int threads) {
+    cout << "\n--- Ranked search benchmark ---\n";
+    const string booksFile = "bench_search_books.txt", usersFile = "bench_search_users.txt";
+    writeSyntheticData(booksFile, usersFile, bookCount, 1, 0, 7);
+    Library lib;
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    cout.rdbuf(sink.rdbuf());
+    BenchClock::time_point start = BenchClock::now();
+    lib.loadData(booksFile, usersFile);
+    double loadMs = nsSince(start) / 1e6;
+    cout.rdbuf(saved);
+    const char* scratchFiles[] = {"bench_search_books.txt", "bench_search_users.txt", "bench_search_users.txt.idx"};
+    for(auto f : scratchFiles) remove(f);
+    cout << bookCount << " books (loaded in " << fixed << setprecision(0) << loadMs << " ms), " << threads
+         << " scoring threads\n";
+    cout.unsetf(ios::floatfield);
+
+    mt19937 rng(9);
+    // One edit of a random kind at a random place; word has at least
+    // three letters, so that the typo leaves something to match.
+    auto typo = [&rng](string word) {
+        size_t at = rng() % (word.size() - 1);
+        switch(rng() % 3) {
+            case 0:  word.erase(at, 1); break;
+            case 1:  swap(word[at], word[at + 1]); break;
+            default: word[at] = 'a' + rng() % 26; break;
+        }
+        return word;
+    };
+    auto lastWord = [](const string &text) { return text.substr(text.rfind(' ') + 1); };
+    auto firstWord = [](const string &text) { return text.substr(0, text.find(' ')); };
+
+    // Each query remembers the word it was made from: the best match of a
+    // misspelled query should contain that word.
+    const int samples = 200;
+    vector<pair<string, string> > queries[3];
+    for(int s = 0; s < samples; s++) {
+        Book* book = lib.findBookByISBN(syntheticISBN(rng() % bookCount));
+        string author = book->getAuthor(), title = book->getTitle();
+        string name = lastWord(author), word = firstWord(title);
+        queries[0].push_back(make_pair(name, name));
+        if(name.size() >= 3)
+            queries[1].push_back(make_pair(firstWord(author) + " " + typo(name), name));
+        if(word.size() >= 3)
+            queries[2].push_back(make_pair(typo(word) + " " + firstWord(title.substr(title.find(' ') + 1)), word));
+    }
+    const char* names[3] = {"author", "author w/ typo", "title w/ typo"};
+
+    LatencyStats::printHeader();
+    size_t mismatched = 0, found = 0, typoQueries = 0;
+    double worstP99 = 0;
+    for(int q = 0; q < 3; q++) {
+        LatencyStats single, parallel;
+        for(auto &query : queries[q]) {
+            start = BenchClock::now();
+            vector<RankedMatch> a = lib.rankBooks(query.first, 10, 1);
+            single.add(nsSince(start));
+            start = BenchClock::now();
+            vector<RankedMatch> b = lib.rankBooks(query.first, 10, threads);
+            parallel.add(nsSince(start));
+            bool same = a.size() == b.size();
+            for(size_t i = 0; same && i < a.size(); i++)
+                same = a[i].book == b[i].book && a[i].score == b[i].score;
+            if(!same) mismatched++;
+            if(q > 0) {
+                typoQueries++;
+                string text = " " + CompletionIndex::normalize(a.empty() ? "" : a[0].book->getTitle() + " " +
+                                                               a[0].book->getAuthor()) + " ";
+                if(text.find(" " + CompletionIndex::normalize(query.second) + " ") != string::npos) found++;
+            }
+        }
+        single.report(string("rank ") + names[q] + " x1", "ms/query", 1e6);
+        parallel.report(string("rank ") + names[q] + " x" + to_string(threads), "ms/query", 1e6);
+        // Budget check on whichever setting suits this machine better.
+        worstP99 = max(worstP99, min(single.percentile(99), parallel.percentile(99)) / 1e6);
+    }
+    LatencyStats substring;
+    for(auto &query : queries[0]) {
+        start = BenchClock::now();
+        lib.findBooks(SEARCH_AUTHOR, query.first);
+        substring.add(nsSince(start));
+    }
+    substring.report("substring (author)", "ms/query", 1e6);
+    cout << "Misspelled queries whose best match has the intended word: " << found << "/" << typoQueries
+         << "; results differing between 1 and " << threads << " threads: " << mismatched << "\n";
+    cout << fixed << setprecision(1) << "Slowest p99: " << worstP99 << " ms ("
+         << (worstP99 <= 100 ? "within" : "over") << " a 100 ms interactive budget)\n";
+    cout.unsetf(ios::floatfield);
+    return mismatched == 0 && worstP99 <= 100;
+}
+
+// Times the nightly accrual pass on generated loan columns: ~3 loans per
+// account, due dates spread from 120 days ago to 30 days ahead, and one
+// account in ten fine-exempt.
+void benchFines(int loanCount) {
+    cout << "\n--- Fine accrual benchmark ---\n";
+    mt19937 rng(17);
+    int today = time(0) / (24 * 3600);
+    LoanColumns loans;
+    loans.dueDates.reserve(loanCount);
+    loans.dailyRates.reserve(loanCount);
+    while(static_cast<int>(loans.dueDates.size()) < loanCount) {
+        int32_t rate = (rng() % 10 == 0) ? 0 : FINE_PER_DAY;
+        int count = min<int>(1 + rng() % 5, loanCount - loans.dueDates.size());
+        loans.userIds.push_back(1000 + loans.userIds.size());
+        loans.firstLoan.push_back(loans.dueDates.size());
+        for(int k = 0; k < count; k++) {
+            loans.dueDates.push_back(today - 120 + static_cast<int>(rng() % 151));
+            loans.dailyRates.push_back(rate);
+        }
+    }
+    loans.firstLoan.push_back(loans.dueDates.size());
+    cout << loanCount << " loans on " << loans.userIds.size() << " accounts\n";
+
+    FineAccrual accrual;
+    accrueFines(loans, today, accrual); // first run pays for page faults
+    LatencyStats pass;
+    const int runs = 10;
+    for(int r = 0; r < runs; r++) {
+        BenchClock::time_point start = BenchClock::now();
+        accrueFines(loans, today, accrual);
+        pass.add(nsSince(start));
+    }
+    LatencyStats::printHeader();
+    pass.report("accrueFines", "ms", 1e6);
+    double seconds = pass.percentile(50) / 1e9;
+    cout << fixed << setprecision(1) << "(" << loanCount / seconds / 1e6 << "M loans/s, "
+         << loanCount * (3 * sizeof(int32_t)) / seconds / 1e9 << " GB/s of loan columns; "
+         << accrual.overdueLoans << " overdue, " << accrual.totalAccrued << " rupees accrued)\n";
+    cout.unsetf(ios::floatfield);
+}
+
+// Resident set size of this process in bytes, or 0 where it cannot be read.
+size_t residentBytes() {
+#ifdef _WIN32
+    return 0;
+#else
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(!f) return 0;
+    unsigned long total = 0, resident = 0;
+    int n = fscanf(f, "%lu %lu", &total, &resident);
+    fclose(f);
+    return (n == 2) ? resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#endif
+}
+
+// Book as it was stored before the columnar catalog: four strings and two
+// scalars in one heap object per book.
+struct LegacyBook {
+    string title, author, publisher, isbn;
+    int year;
+    BookStatus status;
+};
+
+// Compares the memory and scan cost of the columnar CatalogStore against
+// the old one-object-per-book layout on the same generated catalog.
+void benchCatalog(int bookCount) {
+    cout << "\n--- Catalog store benchmark ---\n";
+    const string booksFile = "bench_catalog_books.txt", usersFile = "bench_catalog_users.txt";
+    writeSyntheticData(booksFile, usersFile, bookCount, 1, 0, 5);
+    vector<BookRecord> records;
+    {
+        MappedFile data(booksFile);
+        TextSpan rest = data.text(), line;
+        while(nextLine(rest, line)) {
+            TextSpan title, author, publisher, yearStr, isbn;
+            int year, statInt;
+            if(nextField(line, ',', title) && nextField(line, ',', author) && nextField(line, ',', publisher) &&
+               nextField(line, ',', yearStr) && nextField(line, ',', isbn) && parseInt(yearStr, year) && parseInt(line, statInt))
+                records.push_back(BookRecord(title.str(), author.str(), publisher.str(), year, isbn.str(),
+                                             static_cast<BookStatus>(statInt)));
+        }
+    }
+    remove(booksFile.c_str());
+    remove(usersFile.c_str());
+    // Some books are out on loan so the status filter has work to do.
+    for(size_t i = 0; i < records.size(); i += 3)
+        records[i].status = BORROWED;
+    cout << records.size() << " books\n";
+
+    // The store is built first so that it cannot reuse memory the legacy
+    // layout has given back to the allocator.
+    size_t before = residentBytes();
+    CatalogStore store;
+    for(auto &rec : records)
+        store.add(rec);
+    size_t storeRss = residentBytes() - before;
+
+    before = residentBytes();
+    vector<LegacyBook*> legacy;
+    legacy.reserve(records.size());
+    for(auto &rec : records) {
+        LegacyBook* b = new LegacyBook;
+        b->title = rec.title;
+        b->author = rec.author;
+        b->publisher = rec.publisher;
+        b->isbn = rec.isbn;
+        b->year = rec.year;
+        b->status = rec.status;
+        legacy.push_back(b);
+    }
+    size_t legacyRss = residentBytes() - before;
+
+    const int scans = 20;
+    size_t legacyCount = 0, storeCount = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for(int r = 0; r < scans; r++) {
+        legacyCount = 0;
+        for(auto b : legacy)
+            if(b->status == AVAILABLE && b->year >= 1990 && b->year <= 2010) legacyCount++;
+    }
+    double legacyScanMs = nsSince(start) / 1e6 / scans;
+    start = BenchClock::now();
+    for(int r = 0; r < scans; r++)
+        storeCount = store.countWhere(AVAILABLE, 1990, 2010);
+    double storeScanMs = nsSince(start) / 1e6 / scans;
+
+    double perMillion = 1e6 / max<size_t>(records.size(), 1) / (1 << 20);
+    cout << fixed << setprecision(1);
+    cout << setw(18) << "" << setw(18) << "MB per 1M books" << setw(22) << "status/year scan (ms)" << "\n";
+    cout << setw(18) << "one object/book" << setw(18) << legacyRss * perMillion << setw(22) << setprecision(2) << legacyScanMs << "\n";
+    cout << setprecision(1) << setw(18) << "columnar store" << setw(18) << storeRss * perMillion
+         << setw(22) << setprecision(2) << storeScanMs << "\n";
+    cout << setprecision(1) << "(column bytes: " << store.columnBytes() * perMillion << " MB per 1M books; scan speedup "
+         << legacyScanMs / max(storeScanMs, 1e-6) << "x; matches: " << (legacyCount == storeCount ? "yes" : "NO") << ")\n";
+    cout.unsetf(ios::floatfield);
+    for(auto b : legacy)
+        delete b;
+}
+
+// Compares plain history vectors against the tiered AccountHistory for a
+// set of accounts with long borrowing records.
+void benchHistory(int userCount, int depth) {
+    cout << "\n--- Account history benchmark ---\n";
+    CatalogStore store;
+    const int bookCount = 10000;
+    for(int i = 0; i < bookCount; i++)
+        store.add(BookRecord("Title " + to_string(i), "Author", "Publisher", 2000, to_string(9780000000000LL + i)));
+    mt19937 rng(7);
+    cout << userCount << " accounts, " << depth << " records each\n";
+
+    // Same records for both layouts: loans of 15 or 30 days, a few returned late.
+    auto makeRecord = [&](int day) {
+        HistoryRecord hr;
+        hr.copy = store.copyAt(rng() % bookCount);
+        hr.borrowDate = day;
+        hr.dueDate = day + (rng() % 2 ? 15 : 30);
+        int late = rng() % 10 == 0 ? static_cast<int>(rng() % 20) : 0;
+        hr.returnDate = hr.dueDate - static_cast<int>(rng() % 10) + late;
+        hr.fineIncurred = late > 0 ? late * FINE_PER_DAY : 0;
+        return hr;
+    };
+
+    size_t before = residentBytes();
+    vector<vector<HistoryRecord> > plain(userCount);
+    for(auto &h : plain) {
+        int day = 10000;
+        for(int d = 0; d < depth; d++) {
+            day += rng() % 20;
+            h.push_back(makeRecord(day));
+        }
+    }
+    size_t plainRss = residentBytes() - before;
+
+    before = residentBytes();
+    vector<AccountHistory> tiered(userCount);
+    for(int u = 0; u < userCount; u++)
+        for(auto &hr : plain[u])
+            tiered[u].push_back(hr);
+    size_t tieredRss = residentBytes() - before;
+    size_t tieredBytes = 0;
+    for(auto &h : tiered)
+        tieredBytes += h.memoryBytes();
+
+    double plainFines = 0, tieredFines = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for(auto &h : plain)
+        for(auto &hr : h)
+            plainFines += hr.fineIncurred;
+    double plainMs = nsSince(start) / 1e6;
+    start = BenchClock::now();
+    for(auto &h : tiered)
+        h.forEach([&](const HistoryRecord &hr) { tieredFines += hr.fineIncurred; });
+    double tieredMs = nsSince(start) / 1e6;
+
+    cout << fixed << setprecision(1);
+    cout << setw(18) << "" << setw(14) << "resident MB" << setw(20) << "full iteration (ms)" << "\n";
+    cout << setw(18) << "plain vectors" << setw(14) << plainRss / double(1 << 20) << setw(20) << setprecision(2) << plainMs << "\n";
+    cout << setprecision(1) << setw(18) << "tiered history" << setw(14) << tieredRss / double(1 << 20)
+         << setw(20) << setprecision(2) << tieredMs << "\n";
+    cout << setprecision(1) << "(history bytes: " << tieredBytes / double(1 << 20) << " MB; matches: "
+         << (plainFines == tieredFines ? "yes" : "NO") << ")\n";
+    cout.unsetf(ios::floatfield);
+}
+
+// Patrons queue for one hot title from several threads at once; the copy
+// is then passed down the line by returns. Checks that every patron got
+// the copy exactly once and in the order their thread queued them.
+bool benchHolds(int threadCount, int holdsPerThread) {
+    cout << "\n--- Hold queue benchmark ---\n";
+    const int firstId = 100000;
+    int patronCount = threadCount * holdsPerThread;
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    cout.rdbuf(sink.rdbuf());
+    Library lib;
+    Book* hot = lib.addBook(BookRecord("Hot Title", "Author", "Press", 2020, syntheticISBN(0), AVAILABLE));
+    vector<User*> patrons;
+    for(int i = 0; i <= patronCount; i++) {
+        lib.addUser(new Student(firstId + i, "Patron " + to_string(i), "pass"));
+        patrons.push_back(lib.findUserById(firstId + i));
+    }
+    cout.rdbuf(saved);
+    int today = time(0) / (24 * 3600);
+    User* first = patrons[patronCount];
+    lib.tryCheckout(first, hot, today);
+
+    // Thread t queues patrons t * holdsPerThread .. (t + 1) * holdsPerThread - 1, in order.
+    atomic<int> placed(0);
+    BenchClock::time_point start = BenchClock::now();
+    {
+        vector<thread> workers;
+        for(int t = 0; t < threadCount; t++)
+            workers.push_back(thread([&, t] {
+                for(int k = 0; k < holdsPerThread; k++)
+                    if(lib.placeHold(patrons[t * holdsPerThread + k], hot, today) == HOLD_PLACED)
+                        placed++;
+            }));
+        for(auto &w : workers) w.join();
+    }
+    double placeSec = nsSince(start) / 1e9;
+
+    // Only the next patron of some thread may be first in line; try each
+    // thread's next one until the copy is collected, then return it.
+    vector<int> next(threadCount, 0);
+    User* holder = first;
+    int served = 0;
+    bool ordered = true;
+    start = BenchClock::now();
+    while(served < patronCount) {
+        lib.checkinBook(holder, hot, today);
+        holder = nullptr;
+        for(int t = 0; t < threadCount && !holder; t++) {
+            if(next[t] == holdsPerThread) continue;
+            User* candidate = patrons[t * holdsPerThread + next[t]];
+            if(lib.tryCheckout(candidate, hot, today) == BORROW_ALLOWED) {
+                holder = candidate;
+                next[t]++;
+            }
+        }
+        if(!holder) {
+            ordered = false;
+            break;
+        }
+        served++;
+    }
+    double drainSec = nsSince(start) / 1e9;
+    bool ok = placed == patronCount && ordered;
+    cout << fixed << setprecision(0);
+    cout << placed << " holds placed by " << threadCount << " threads: " << placed / max(placeSec, 1e-9)
+         << " holds/sec\n";
+    cout << served << " hand-offs (return + pickup): " << served / max(drainSec, 1e-9) << " per sec\n";
+    cout.unsetf(ios::floatfield);
+    cout << "Every patron served once, in queue order: " << (ok ? "yes" : "NO") << "\n";
+    return ok;
+}
+
+// Lets a group of threads start each round of the stress test together.
+class RoundBarrier {
+private:
+    mutex lock;
+    condition_variable arrived;
+    int parties, waiting;
+    unsigned generation;
+public:
+    explicit RoundBarrier(int n) : parties(n), waiting(0), generation(0) {}
+
+    void wait() {
+        unique_lock<mutex> guard(lock);
+        unsigned gen = generation;
+        if(++waiting == parties) {
+            waiting = 0;
+            generation++;
+            arrived.notify_all();
+        } else {
+            arrived.wait(guard, [this, gen] { return generation != gen; });
+        }
+    }
+};
+
+// Hammers the circulation methods from several threads and then checks
+// that the library is still consistent: every borrowed copy is on exactly
+// one account and every available copy on none, each book's available
+// count matches its copies, no account is over its limit, and a book with
+// n copies contended for by all threads at once is lent n times (or once
+// per thread, if fewer). Books have one to three copies. Returns false if
+// an invariant was broken.
+bool benchStress(int threadCount, int opsPerThread) {
+    cout << "\n--- Concurrency stress test ---\n";
+    cout << threadCount << " threads, " << opsPerThread << " operations per thread per run\n";
+    // The race below gives every thread a patron of its own.
+    const int bookCount = 2000, userCount = max(500, threadCount), firstId = 5000;
+    streambuf* saved = cout.rdbuf();
+    ostringstream sink;
+    cout.rdbuf(sink.rdbuf());
+    Library lib;
+    vector<Book*> shelf;
+    vector<User*> patrons;
+    for(int i = 0; i < bookCount; i++) {
+        BookRecord rec("Stress Title " + to_string(i), "Author " + to_string(i % 50), "Press", 2000, syntheticISBN(i));
+        for(int c = 0; c <= i % 3; c++)
+            lib.addBook(rec);
+        shelf.push_back(lib.findBookByISBN(rec.isbn));
+    }
+    for(int i = 0; i < userCount; i++) {
+        lib.addUser(new Faculty(firstId + i, "Patron " + to_string(i), "pass"));
+        patrons.push_back(lib.findUserById(firstId + i));
+    }
+    cout.rdbuf(saved);
+    int today = time(0) / (24 * 3600);
+    bool ok = true;
+
+    // Race: every thread tries to borrow the same book at the same moment.
+    const int rounds = 2000;
+    atomic<int> winners(0);
+    int doubleLends = 0;
+    RoundBarrier barrier(threadCount);
+    {
+        vector<thread> workers;
+        vector<int> lent(rounds, 0);
+        mutex lentLock;
+        for(int t = 0; t < threadCount; t++) {
+            workers.push_back(thread([&, t] {
+                User* patron = patrons[t];
+                for(int r = 0; r < rounds; r++) {
+                    Book* book = shelf[r % bookCount];
+                    barrier.wait();
+                    bool won = lib.tryCheckout(patron, book, today) == BORROW_ALLOWED;
+                    if(won) {
+                        winners++;
+                        lock_guard<mutex> guard(lentLock);
+                        lent[r]++;
+                    }
+                    barrier.wait();
+                    if(won) lib.checkinBook(patron, book, today);
+                }
+            }));
+        }
+        for(auto &w : workers) w.join();
+        for(int r = 0; r < rounds; r++)
+            if(lent[r] != min<int>(threadCount, shelf[r % bookCount]->copyCount())) doubleLends++;
+    }
+    cout << "Contended books: " << rounds << " rounds, " << winners << " successful borrows, "
+         << doubleLends << " rounds not lent once per copy\n";
+    if(doubleLends != 0) ok = false;
+
+    // Mixed load: random patrons borrow random books and return their own
+    // loans, while thread 0 also searches and edits the catalog.
+    cout << setw(10) << "threads" << setw(14) << "ops/sec" << setw(12) << "borrows" << setw(12) << "returns"
+         << setw(12) << "busy" << "\n";
+    long outstanding = 0;
+    for(int n = 1; n <= threadCount; n *= 2) {
+        atomic<long> borrows(0), returns(0), busy(0), lostReturns(0);
+        vector<thread> workers;
+        BenchClock::time_point start = BenchClock::now();
+        for(int t = 0; t < n; t++) {
+            workers.push_back(thread([&, t, n] {
+                mt19937 rng(100 * n + t);
+                vector<pair<User*, Book*>> loans;
+                for(int i = 0; i < opsPerThread; i++) {
+                    if(t == 0 && i % 1000 == 999) {
+                        Book* book = shelf[rng() % bookCount];
+                        lib.updateBook(book, "Stress Title " + to_string(rng() % bookCount), "");
+                        lib.findBooks(SEARCH_TITLE, "Title 1");
+                    } else if(!loans.empty() && rng() % 2 == 0) {
+                        size_t k = rng() % loans.size();
+                        User* patron = loans[k].first;
+                        if(lib.checkinBook(patron, loans[k].second, today)) returns++;
+                        else lostReturns++;
+                        loans[k] = loans.back();
+                        loans.pop_back();
+                    } else {
+                        User* patron = patrons[rng() % userCount];
+                        Book* book = shelf[rng() % bookCount];
+                        if(lib.tryCheckout(patron, book, today) == BORROW_ALLOWED) {
+                            borrows++;
+                            loans.push_back(make_pair(patron, book));
+                        } else {
+                            busy++;
+                        }
+                    }
+                }
+                // Loans left open here are checked below.
+            }));
+        }
+        for(auto &w : workers) w.join();
+        double seconds = nsSince(start) / 1e9;
+        outstanding += borrows - returns;
+        cout << setw(10) << n << setw(14) << fixed << setprecision(0)
+             << (static_cast<double>(n) * opsPerThread / seconds) << setw(12) << borrows << setw(12) << returns
+             << setw(12) << busy << "\n";
+        if(lostReturns != 0) {
+            cout << lostReturns << " returns of a loan this thread made were refused\n";
+            ok = false;
+        }
+    }
+
+    // Invariants, checked single-threaded once the workers are done.
+    unordered_map<const BookCopy*, int> holders;
+    long onLoan = 0;
+    int overLimit = 0;
+    for(auto patron : patrons) {
+        const Account &acc = patron->getAccount();
+        if(acc.getBorrowedCount() > 5) overLimit++;
+        for(auto &bi : acc.borrowedBooks) {
+            holders[bi.copy]++;
+            onLoan++;
+        }
+    }
+    int mismatched = 0;
+    for(auto book : shelf) {
+        uint32_t available = 0;
+        book->forEachCopy([&](const BookCopy* copy) {
+            int n = holders.count(copy) ? holders[copy] : 0;
+            if(n > 1 || (n == 1) != (copy->getStatus() == BORROWED)) mismatched++;
+            available += copy->getStatus() == AVAILABLE;
+        });
+        if(available != book->availableCopies()) mismatched++;
+    }
+    cout << "Loans outstanding: " << onLoan << " (expected " << outstanding << "), copies with inconsistent status: "
+         << mismatched << ", accounts over limit: " << overLimit << "\n";
+    if(onLoan != outstanding || mismatched != 0 || overLimit != 0) ok = false;
+    cout << (ok ? "All invariants held.\n" : "INVARIANT VIOLATED.\n");
+    return ok;
+}
+
+int runBenchmarks(const vector<string> &args) {
+    string suite = args.empty() ? "all" : args[0];
+    bool all = (suite == "all");
+    bool ran = false;
+    if(all || suite == "users") { benchUsers(); ran = true; }
+    if(all || suite == "load") { benchLoad(); ran = true; }
+    if(all || suite == "core") {
+        int books = args.size() > 1 ? atoi(args[1].c_str()) : 200000;
+        int users = args.size() > 2 ? atoi(args[2].c_str()) : 50000;
+        int history = args.size() > 3 ? atoi(args[3].c_str()) : 20;
+        benchCore(max(books, 1), max(users, 2), history);
+        ran = true;
+    }
+    if(all || suite == "catalog") {
+        int books = args.size() > 1 ? atoi(args[1].c_str()) : 1000000;
+        benchCatalog(max(books, 1));
+        ran = true;
+    }
+    if(all || suite == "history") {
+        int users = args.size() > 1 ? atoi(args[1].c_str()) : 20000;
+        int depth = args.size() > 2 ? atoi(args[2].c_str()) : 200;
+        benchHistory(max(users, 1), max(depth, 1));
+        ran = true;
+    }
+    bool passed = true;
+    if(all || suite == "search") {
+        int books = args.size() > 1 ? atoi(args[1].c_str()) : 1000000;
+        int threads = args.size() > 2 ? atoi(args[2].c_str()) : max(4, static_cast<int>(thread::hardware_concurrency()));
+        passed = benchSearch(max(books, 1), max(threads, 1)) && passed;
+        ran = true;
+    }
+    if(all || suite == "fines") {
+        int loans = args.size() > 1 ? atoi(args[1].c_str()) : 20000000;
+        benchFines(max(loans, 1));
+        ran = true;
+    }
+    if(all || suite == "shards") {
+        int books = args.size() > 1 ? atoi(args[1].c_str()) : 200000;
+        int users = args.size() > 2 ? atoi(args[2].c_str()) : 50000;
+        int threads = args.size() > 3 ? atoi(args[3].c_str()) : max(4, static_cast<int>(thread::hardware_concurrency()));
+        passed = benchShards(max(books, 1), max(users, 1), max(threads, 1)) && passed;
+        ran = true;
+    }
+    if(all || suite == "stress") {
+        int threads = args.size() > 1 ? atoi(args[1].c_str()) : max(4, static_cast<int>(thread::hardware_concurrency()));
+        int ops = args.size() > 2 ? atoi(args[2].c_str()) : 200000;
+        passed = benchStress(max(threads, 2), max(ops, 1)) && passed;
+        ran = true;
+    }
+    if(all || suite == "holds") {
+        int threads = args.size() > 1 ? atoi(args[1].c_str()) : max(4, static_cast<int>(thread::hardware_concurrency()));
+        int holds = args.size() > 2 ? atoi(args[2].c_str()) : 20000;
+        passed = benchHolds(max(threads, 1), max(holds, 1)) && passed;
+        ran = true;
+    }
+    if(!ran) {
+        cout << "Unknown benchmark suite: " << suite << "\n";
+        cout << "Available suites: users, load, core [books users history], catalog [books], search [books threads], history [users depth], fines [loans], shards [books users threads], stress [threads ops], holds [threads holds], all\n";
+        return 1;
+    }
+    return passed ? 0 : 1;
+}
+
+// ------------------------
+// Main Function
+// ------------------------
+int main(int argc, char* argv[]) {
+    vector<string> args(argv + min(argc, 2), argv + argc);
+    if(argc > 1 && string(argv[1]) == "--bench")
+        return runBenchmarks(args);
+    if(argc > 1 && string(argv[1]) == "--generate")
+        return runGenerator(args);
+    if(argc > 1 && string(argv[1]) == "--batch")
+        return runBatch(argc > 2 ? argv[2] : "-");
+    if(argc > 1 && string(argv[1]) == "--accrue")
+        return runAccrual(args);
+    // Conversion between the text files and the binary snapshot.
+    if(argc > 1 && (string(argv[1]) == "--to-snapshot" || string(argv[1]) == "--to-text")) {
+        string snapFile = argc > 2 ? argv[2] : "library.snap";
+        string booksFile = argc > 3 ? argv[3] : "books.txt";
+        string usersFile = argc > 4 ? argv[4] : "users.txt";
+        Library lib;
+        if(string(argv[1]) == "--to-snapshot") {
+            lib.loadData(booksFile, usersFile);
+            return lib.saveSnapshot(snapFile) ? 0 : 1;
+        }
+        if(!lib.loadSnapshot(snapFile)) {
+            cout << "Could not load snapshot " << snapFile << ".\n";
+            return 1;
+        }
+        lib.saveData(booksFile, usersFile);
+        return 0;
+    }
+    // Conversion between the snapshot and the sharded text files.
+    if(argc > 1 && (string(argv[1]) == "--to-shards" || string(argv[1]) == "--from-shards")) {
+        string snapFile = argc > 2 ? argv[2] : "library.snap";
+        string manifest = argc > 3 ? argv[3] : SHARD_MANIFEST;
+        Library lib;
+        if(string(argv[1]) == "--to-shards") {
+            int shards = argc > 4 ? atoi(argv[4]) : DEFAULT_SHARDS;
+            if(!lib.loadSnapshot(snapFile)) {
+                cout << "Could not load snapshot " << snapFile << ".\n";
+                return 1;
+            }
+            return lib.saveShards(manifest, max(shards, 1), max(shards, 1)) ? 0 : 1;
+        }
+        if(!lib.loadShards(manifest)) {
+            cout << "Could not load shards from " << manifest << ".\n";
+            return 1;
+        }
+        return lib.saveSnapshot(snapFile) ? 0 : 1;
+    }
+
+    Library library;
+    openLibrary(library);
+    // Copies set aside for patrons who did not collect them go down the line.
+    library.expireHolds(time(0) / (24 * 3600));
+
+    int mainChoice;
+    do {
+        cout << R"(            __   ____ ____ ____   __   ____ _  _    __  __   __   _  _   __   ___ ____ __  __ ____ _  _ ____    ___ _  _ ___ ____ ____ __  __ 
+(  ) (_  _(  _ (  _ \ /__\ (  _ ( \/ )  (  \/  ) /__\ ( \( ) /__\ / __( ___(  \/  ( ___( \( (_  _)  / __( \/ / __(_  _( ___(  \/  )
+ )(__ _)(_ ) _ <)   //(__)\ )   /\  /    )    ( /(__)\ )  ( /(__)( (_-.)__) )    ( )__) )  (  )(    \__ \\  /\__ \ )(  )__) )    ( 
+(____(____(____(_)\_(__)(__(_)\_)(__)   (_/\/\_(__)(__(_)\_(__)(__\___(____(_/\/\_(____(_)\_)(__)   (___/(__)(___/(__)(____(_/\/\_)
+              )" << "\n";
+          
+        cout << "\n===== Main Menu =====\n";
+        cout << "1. Login\n2. Register New User\n3. List All Books\n4. Help/Instructions\n5. Exit\n";
+        cout << "Enter your choice: ";
+        cin >> mainChoice;
+        switch(mainChoice) {
+            case 1: {
+                cout << "Enter your User ID: ";
+                int uid;
+                cin >> uid;
+                User* user = library.findUserById(uid);
+                if(user) {
+                    cout << "Enter password: ";
+                    string pass;
+                    cin >> pass;
+                    if(!user->checkPassword(pass)) {
+                        cout << "Invalid password. Returning to main menu.\n";
+                        break;
+                    }
+                    cout << "Welcome, " << user->getName() << "!\n";
+                    user->menu(library);
+                } else {
+                    char reg;
+                    cout << "User ID not found. Are you new here and want to register? (Y/N): ";
+                    cin >> reg;
+                    if(reg == 'Y' || reg == 'y') {
+                        registerNewUser(library);
+                    } else {
+                        cout << "Returning to main menu.\n";
+                    }
+                }
+                break;
+            }
+            case 2:
+                registerNewUser(library);
+                break;
+            case 3:
+                library.listBooks();
+                break;
+            case 4:
+                cout << "\n--- Help / Instructions ---\n";
+                cout << "1. Login with your user ID and password. If you are new, choose to register.\n";
+                cout << "2. Students and Faculty can borrow/return books. When borrowing, the current day is automatically recorded and a due date is set (15 days for students, 30 days for faculty).\n";
+                cout << "3. When returning, the system automatically calculates overdue fines (10 rupees per day for students).\n";
+                cout << "4. All account details (including borrowed books with dates and history) are saved in users.txt.\n";
+                cout << "5. Librarians have extended privileges to manage books and users.\n";
+                cout << "----------------------------\n";
+                break;
+            case 5:
+                cout << "Exiting the system. Goodbye!\n";
+                break;
+            default:
+                cout << "Invalid choice. Please try again.\n";
+        }
+    } while(mainChoice != 5);
+
+    library.checkpoint();
+    library.closeJournal();
+    writeStatsFile(STATS_FILE);
+    return 0;
+}